@@ -0,0 +1,30 @@
+/**
+ Example task module, for powertask_module_load.  Build it as a shared
+ object, once per version:
+   gcc -shared -fPIC -DMODULE_VERSION=2 example_module.c -o example_module_v2.so
+*/
+#include "powertask.h"
+
+#ifndef MODULE_VERSION
+#define MODULE_VERSION 1
+#endif
+
+/// Reports which version of the module ran it.
+static powertask_result_t function_version(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    output->data[0]=MODULE_VERSION;
+    return POWERTASK_RESULT_OK;
+}
+const static powertask_attribute_t attributes_version={
+    0x5E20, /* our task ID */
+    "ModuleVersion", /* human-readable name */
+    0, /* minimum battery energy (Joules) */
+    function_version, /* function to run */
+    1,/* bytes of telemetry input data required */
+    1, /* bytes of telemetry output data produced */
+    0,0,0,0,0,
+    4 /* input buffers, so commands queue up */
+};
+
+const powertask_attribute_t *powertask_module_tasks[]={&attributes_version,0};
@@ -60,6 +60,9 @@ typedef uint16_t powertask_result_t;
 #define POWERTASK_RESULT_FAIL_OUTPUT 0x4000 /* task failed, some output produced, 12-bit reason code is added to this */
 #define POWERTASK_RESULT_LAST 0x6000 /* result codes bigger than this are invalid */
 
+/// Reason codes 0xF00 and up are used by the scheduler itself, for failures it detects:
+#define POWERTASK_REASON_BAD_REGION 0xF01 /* region input failed validation */
+
 /// This is a user-written function that actually performs a task.
 ///   input is the incoming telemetry data.
 ///   output is the outgoing telemetry data.
@@ -68,10 +71,53 @@ typedef powertask_result_t (*powertask_function_t)(
     powertask_telemetry_t *output);
 
 
+/// This is an optional user-written function that performs a task on 
+///   a batch of queued inputs in one call, so it can use SIMD across inputs.
+///   inputs[i] is the incoming telemetry that produces outputs[i];
+///   store each input's result code in results[i].  Inputs that return
+///   POWERTASK_RESULT_RETRY stay queued for the next batch.
+typedef void (*powertask_batch_function_t)(int count,
+    const powertask_telemetry_t *const *inputs,
+    powertask_telemetry_t *const *outputs,
+    powertask_result_t *results);
+
+
 /// An powertask_energy_t is an amount of battery energy required for this task.
 ///  Units are in joules.
 typedef uint16_t powertask_energy_t; 
 
+/// A powertask_time_t is an absolute time, used for time-tagged commands.
+///  Units are microseconds since an arbitrary platform epoch.
+typedef uint64_t powertask_time_t;
+
+/// A powertask_group_t is a subsystem (e.g., payload, ADCS, comms) whose tasks
+///  share battery energy fairly with the other groups.  Group 0 is the default.
+typedef uint8_t powertask_group_t;
+
+/// Number of task groups.
+#ifndef POWERTASK_GROUP_MAX
+#define POWERTASK_GROUP_MAX 8
+#endif
+
+
+/// A powertask_flags_t holds optional POWERTASK_FLAG_ bits describing a task.
+typedef uint16_t powertask_flags_t;
+
+/// The task's output depends only on its input, and it has no side effects,
+///   so a cached output can be sent instead of running it again.
+#define POWERTASK_FLAG_DETERMINISTIC 0x0001
+
+/// The task's input is a powertask_region_t naming read-only bulk data in a store,
+///   instead of a copy of the data.  See powertask_make_runnable_region.
+#define POWERTASK_FLAG_REGION_INPUT 0x0002
+
+/// On hosted Linux, run the task's function in an isolated worker process,
+///   so if it crashes only the worker dies.  See powertask_isolate_start.
+#define POWERTASK_FLAG_ISOLATED 0x0004
+
+/// The task may be forwarded to run on another node (board) that has more
+///   energy to spare.  It must be registered there with the same ID.
+#define POWERTASK_FLAG_OFFLOAD 0x0008
 
 /// This struct describes the constant attributes of a task.
 ///   It is separate from the runtime attributes so that 
@@ -83,6 +129,13 @@ struct powertask_attribute_t {
     powertask_function_t function; // function that executes the task
     powertask_length_t input_length; // bytes of input required from telemetry
     powertask_length_t output_length; // bytes of output produced for telemetry
+    powertask_group_t group; // energy sharing group this task belongs to (0 by default)
+    powertask_energy_t energy_per_run; // estimated battery energy (Joules) used by one run of the function
+    powertask_flags_t flags; // POWERTASK_FLAG_ bits describing the task (0 by default)
+    powertask_batch_function_t batch_function; // optional: runs many queued inputs in one call
+    uint16_t batch_max; // most inputs queued for one batch_function call
+    uint8_t input_depth; // input buffers: 2 or more lets new commands queue while it's queued or running
+    uint8_t perf_state; // POWERTASK_PERF_ hint: CPU performance state to run at (0 for any)
 };
 typedef struct powertask_attribute_t powertask_attribute_t;
 
@@ -91,9 +144,89 @@ typedef struct powertask_attribute_t powertask_attribute_t;
 /// This function is normally called at startup before running any tasks, such as from main or an __attribute__((constructor)); function.
 void powertask_register(const powertask_attribute_t *attribute);
 
+/// Remove this task from the powertask system, dropping its queued and staged commands.
+///  Waiting handles finish with POWERTASK_REASON_UNREGISTERED, stored sequences
+///  that run it are deleted, and time-tagged commands for it are dropped when 
+///  they come due (unless the ID is registered again with the same input_length).
+///  A task can't unregister itself while running.  Returns 0 if the ID wasn't registered.
+int powertask_unregister(powertask_ID_t ID);
+
+/// Swap in new attributes (such as a patched function) for a registered task,
+///  keeping its queued commands, statistics, and buffers.  The new attributes
+///  must have the same ID, group, input_length, output_length, batch_max,
+///  input_depth, and batch or not.  Returns 0 if the task isn't registered
+///  or the attributes aren't compatible.
+int powertask_replace(const powertask_attribute_t *attribute);
+
+
+/*********** Constant-time mode *************/
+/// Build with -DPOWERTASK_CONSTANT_TIME for hard real-time profiles: every
+///   scheduler operation's loops are then bounded by compile-time constants,
+///   never by the number of tasks registered or runnable.
+///   - Finding a task by ID reads a two-level table (a page per high byte
+///     of the ID, from a static pool) instead of searching a tree.
+///   - make_runnable never allocates: telemetry, batch queues, and 
+///     input_depth back buffers are allocated at registration.
+///     (Isolated tasks still allocate their shared telemetry on first use.)
+///   - run_next releases at most POWERTASK_TIMED_RELEASE_MAX time-tagged commands.
+///   - unregister frees what registration allocated, so give it an allocator
+///     whose free is bounded (glibc's can consolidate or trim the heap).
+///   - Choosing the next task and checking the battery look at most at
+///     POWERTASK_GROUP_MAX groups and POWERTASK_PERF_LOOKAHEAD tasks, as always.
+///   "make ctcheck" measures the worst case of each operation.
+
+/// Pages of 256 task IDs in the constant-time registry.  IDs that share 
+///   a high byte share a page, so number your tasks in a few blocks.
+#ifndef POWERTASK_REGISTRY_PAGES
+#define POWERTASK_REGISTRY_PAGES 16
+#endif
+
 
 /*********** Advanced / system level interface *************/
 
+/// Per-task scheduling statistics, for finding starved tasks.
+struct powertask_task_stats_t {
+    uint32_t runs; // times the task function was called
+    uint32_t skips; // times skipped for lack of battery energy
+    uint32_t held; // times held back to save energy for a starved task
+    uint16_t skip_streak; // skips since the task last ran: its age
+    powertask_time_t max_wait; // longest time from becoming runnable to starting
+};
+typedef struct powertask_task_stats_t powertask_task_stats_t;
+
+/// A sliding window of recently seen sequence numbers, for dropping
+///   duplicates: bit i of "seen" is set if sequence number highest-i has been seen.
+///   A zeroed window is empty: the first sequence number it sees is accepted.
+struct powertask_window_t {
+    uint32_t highest; // newest sequence number seen
+    uint64_t seen;
+    unsigned char started; // 1 once highest is valid
+};
+typedef struct powertask_window_t powertask_window_t;
+
+/// Number of distinct failure reason codes counted separately for each task.
+#ifndef POWERTASK_FAILURE_REASONS
+#define POWERTASK_FAILURE_REASONS 4
+#endif
+
+/// Per-task failure statistics and quarantine state.
+struct powertask_failure_stats_t {
+    uint32_t failures; // total failed runs
+    uint32_t blocked; // commands dropped or delayed by hold-off or quarantine
+    uint16_t consecutive; // failures since the last success
+    uint16_t last_reason; // 12-bit reason code of the most recent failure
+    struct {
+        uint16_t reason; // 12-bit reason code
+        uint16_t count; // failures with this reason
+    } reasons[POWERTASK_FAILURE_REASONS]; // the first distinct reasons seen
+    uint32_t other_reasons; // failures with reasons that didn't fit in the table
+    powertask_time_t hold_until; // commands are delayed until this time
+    powertask_telemetry_t *deferred; // input of the delayed command waiting for hold_until, or 0
+    unsigned char quarantined; // 1 if commands are dropped until release
+    struct powertask_task_t *next_quarantined; // list of quarantined tasks
+};
+typedef struct powertask_failure_stats_t powertask_failure_stats_t;
+
 /// This struct describes a task at runtime.  Callers can allocate this,
 ///  so that the telemetry and task system does not 
 //   need to do dynamic memory allocation.
@@ -114,13 +247,78 @@ struct powertask_task_t {
     /// You can improve tree balance by your registration order.
     struct powertask_task_t *lower,*higher;
     
-    /// This is a doubly-linked list of currently runnable tasks.
+    /// This is a doubly-linked list of currently runnable tasks in the same group.
     /// If this task is not runnable, these pointers are set to NULL.
-    /// The task list always contains the idle task (and usually a watchdog too),
-    ///   so this list is never empty.
+    /// The idle task is not kept in any list: it runs when no other task can.
     struct powertask_task_t *prev,*next;
+    
+    /// If this task was released from the time-tagged command queue,
+    ///   this is the time it was scheduled to start (used to measure jitter).
+    powertask_time_t scheduled;
+    unsigned char timed; // 1 if scheduled is valid and the task has not started yet
+    /// Time-tagged commands that came due while this task had no room for 
+    ///   them, first and last, as slot number+1 (0 if none).
+    uint16_t timed_waiting, timed_waiting_last;
+    
+    /// Time this task became runnable, or last finished a run and stayed runnable.
+    powertask_time_t waiting_since;
+    powertask_task_stats_t stats;
+    powertask_failure_stats_t failure;
+    
+    /// Tasks with a batch_function queue up to batch_max inputs here.
+    ///   The first batch_queued entries are waiting to run.
+    ///   Allocated on first use, like input and output.
+    powertask_telemetry_t **batch_inputs;
+    powertask_telemetry_t **batch_outputs;
+    uint16_t batch_queued;
+    
+    /// Streaming output state: streams sent so far, and the next chunk number.
+    uint16_t stream_count;
+    uint32_t stream_sequence;
+    
+    /// 1 once this region-input task's CRC has been checked for its current command.
+    unsigned char region_checked;
+    
+    /// If not 0, this shared buffer is the task's input instead of "input".
+    struct powertask_shared_t *shared;
+    
+    /// Tasks with an input_depth of 2 or more stage commands that arrive while
+    ///   the task is queued or running into these back buffers, oldest first,
+    ///   leaving "input" (the front buffer) alone until the next dispatch.
+    powertask_telemetry_t **input_back;
+    uint8_t input_staged; // back buffers holding staged commands
+    uint8_t input_front_done; // 1 if the front buffer's command has finished
+    
+    /// Commands this task has finished, and its unfinished command handles.
+    uint32_t completions;
+    struct powertask_handle_slot_t *handles;
+    
+    /// POWERTASK_ALLOCATED_ bits: what the powertask system allocated, so 
+    ///   powertask_unregister frees those and leaves caller-owned memory alone.
+    uint8_t allocated;
+    
+    /// Sequence numbers of recent commands, for powertask_make_runnable_sequenced.
+    powertask_window_t commands_seen;
+    
+    /// Times tasks at the current performance state have run ahead of this one.
+    uint8_t perf_bypassed;
+    
+    /// 1 if this command was forwarded here from another node, so it isn't sent on again.
+    uint8_t node_received;
+    
+    /// Energy used by this task's runs since the last housekeeping record.
+    uint32_t housekeeping_energy;
+    
+    /// Hardware counter totals, allocated on first use (hosted builds only).
+    struct powertask_pmu_stats_t *pmu;
+    
+    /// 1 + this task's place in the periodic table, or 0 if it isn't periodic.
+    uint16_t periodic;
 };
 typedef struct powertask_task_t powertask_task_t;
+#define POWERTASK_ALLOCATED_TASK 0x01 /* the task struct, by powertask_register */
+#define POWERTASK_ALLOCATED_INPUT 0x02
+#define POWERTASK_ALLOCATED_OUTPUT 0x04
 
 /// This advanced function registers a new task with the powertask system.
 ///  The caller must have allocated both pointers static, so they never go away.
@@ -131,18 +329,1012 @@ void powertask_task_register(const powertask_attribute_t *attribute,powertask_ta
 ///  Returns 0 if that task ID is not registered.
 powertask_task_t *powertask_task_lookup(powertask_ID_t ID);
 
+/// Make this registered task runnable, like powertask_make_runnable,
+///  for callers that already have the task from powertask_task_lookup.
+powertask_telemetry_t *powertask_task_make_runnable(powertask_task_t *task);
+
 /// Make this task runnable--the task is added to the runnable queue.
 ///  If this task requires input, you must fill out the data portion 
 ///   of the returned telemetry structure. 
+///  A task with a batch_function queues a new input each call (up to batch_max),
+///   and all queued inputs are run together.
+///  A task with an input_depth of 2 or more that is already queued or running
+///   gets its new input in a back buffer, and runs again after the current command.
+///  Otherwise, a task that is already runnable gets only one run, with the newest input.
 powertask_telemetry_t *powertask_make_runnable(powertask_ID_t ID);
 
 /// Run the next task.  Returns 1 if tasks still exist to run.
 int powertask_run_next(void);
 
+/// This is a platform function that returns the current time.
+typedef powertask_time_t (*powertask_clock_t)(void);
+
+/// Install the platform clock.  By default the time only changes 
+///   when you call powertask_set_time.
+void powertask_set_clock(powertask_clock_t clock);
+
+/// Set the current time, for platforms without a clock function.
+void powertask_set_time(powertask_time_t now);
+
+/// Return the current time from the platform clock.
+powertask_time_t powertask_get_time(void);
+
+/// Set the current battery energy (Joules), as measured by the platform.
+void powertask_set_battery(powertask_energy_t battery);
+
+/// Return the current battery energy (Joules).
+powertask_energy_t powertask_get_battery(void);
+
+/// Return the scheduling statistics for this task ID.
+///  Returns 0 if that task ID is not registered.
+const powertask_task_stats_t *powertask_task_stats(powertask_ID_t ID);
+
 /// Set the debugging verbosity level.  0 == no debug prints.  Higher numbers == more prints.
 void powertask_debug(int debug_level);
 
 
+/*********** Energy sharing between groups *************/
+/// Groups share battery energy by stride scheduling: each group gets energy in
+///   proportion to its tickets.  The next task comes from the group that has 
+///   used the least energy per ticket, so a burst of payload tasks can't starve ADCS.
+/// Energy used by a task is the measured drop in battery energy across the call,
+///   or the task's energy_per_run estimate if the battery didn't drop.
+
+/// Set the share of energy given to this group.  Every group starts with 1 ticket.
+void powertask_group_share(powertask_group_t group,uint16_t tickets);
+
+/// Statistics about one task group.
+struct powertask_group_stats_t {
+    uint16_t tickets; // the group's share of energy
+    uint32_t runs; // task functions called
+    uint32_t skips; // times the group's next task was skipped for lack of battery
+    uint64_t energy; // total Joules used by the group's tasks
+};
+typedef struct powertask_group_stats_t powertask_group_stats_t;
+
+/// Return the statistics for this group.
+const powertask_group_stats_t *powertask_group_stats(powertask_group_t group);
+
+
+/*********** Starvation prevention *************/
+/// A task skipped for lack of battery ages.  Once it has been skipped
+///   this many times in a row, it stays at the front of its group's list,
+///   so the group tries it first every pass.
+#ifndef POWERTASK_AGING_PRIORITY_SKIPS
+#define POWERTASK_AGING_PRIORITY_SKIPS 4
+#endif
+
+/// Once a task has been skipped this many times in a row, battery energy is
+///   reserved for it: other tasks are held back unless the battery can pay
+///   for both them and the starved task.  Only one task is reserved at a time.
+#ifndef POWERTASK_AGING_RESERVE_SKIPS
+#define POWERTASK_AGING_RESERVE_SKIPS 16
+#endif
+
+/// A reservation is dropped after this many passes without the task running,
+///   so a task that can never be paid for doesn't stop everything else.
+#ifndef POWERTASK_AGING_HOLD_MAX
+#define POWERTASK_AGING_HOLD_MAX 10000
+#endif
+
+
+/*********** Failure hold-off and quarantine *************/
+/// With hold-off on, after a task fails, commands to run it are delayed by a time
+///   that doubles with each failure in a row.  After enough failures in a 
+///   row the task is quarantined: commands to run it are dropped until 
+///   it is released, so energy isn't spent on a task known to be broken.
+///   A success resets the count.
+///   Delayed commands wait in the time-tagged queue, so hold-off needs a 
+///   clock from powertask_set_clock (or regular powertask_set_time calls),
+///   and every task's input_length must fit POWERTASK_TIMED_INPUT_MAX.
+struct powertask_failure_policy_t {
+    powertask_time_t holdoff_base; // hold-off after the first failure (0 disables hold-off)
+    powertask_time_t holdoff_max; // longest hold-off
+    uint16_t quarantine_after; // failures in a row before quarantine (0 disables quarantine)
+    unsigned char release_on_mode_change; // 1 if changing mode releases all quarantined tasks
+};
+typedef struct powertask_failure_policy_t powertask_failure_policy_t;
+
+/// Set the failure policy.  By default there is no hold-off (set 
+///   holdoff_base to turn it on), 8 failures in a row quarantine a task, 
+///   and mode changes release quarantined tasks.  Turning on hold-off while a
+///   task's input is too big for it, or registering such a task while it's on,
+///   is fatal.
+void powertask_failure_policy(const powertask_failure_policy_t *policy);
+
+/// Return the failure statistics for this task ID.
+///  Returns 0 if that task ID is not registered.
+const powertask_failure_stats_t *powertask_failure_stats(powertask_ID_t ID);
+
+/// Release this task from quarantine and hold-off.  Returns 1 if it was quarantined.
+int powertask_failure_release(powertask_ID_t ID);
+
+/// A spacecraft operating mode (e.g., safe, nominal, science).
+typedef uint8_t powertask_mode_t;
+
+/// Change the operating mode.  This may release quarantined tasks.
+void powertask_set_mode(powertask_mode_t mode);
+
+/// Return the current operating mode (0 at startup).
+powertask_mode_t powertask_get_mode(void);
+
+/// Quarantine events, kept for downlink.
+#define POWERTASK_FAILURE_EVENT_QUARANTINE 1 /* task was quarantined */
+#define POWERTASK_FAILURE_EVENT_RELEASE 2 /* task was released from quarantine */
+struct powertask_failure_event_t {
+    powertask_time_t time; // when it happened
+    powertask_ID_t ID; // which task
+    uint16_t type; // POWERTASK_FAILURE_EVENT_ code
+    uint16_t reason; // last failure reason code
+    uint16_t consecutive; // failures in a row at the time
+};
+typedef struct powertask_failure_event_t powertask_failure_event_t;
+
+/// Number of quarantine events kept until read.  Older events are overwritten.
+#ifndef POWERTASK_FAILURE_EVENTS
+#define POWERTASK_FAILURE_EVENTS 16
+#endif
+
+/// Copy up to max of the oldest unread quarantine events into events.
+///   Returns the number copied; they won't be returned again.
+int powertask_failure_events(powertask_failure_event_t *events,int max);
+
+
+/*********** Result cache for deterministic tasks *************/
+/// When a POWERTASK_FLAG_DETERMINISTIC task is given the same input as
+///   a recent successful run, its cached output is used instead of calling 
+///   the function.  The least recently used entry is replaced when full.
+///   Batch tasks and tasks given a shared input are never cached.
+
+/// Number of cached results.
+#ifndef POWERTASK_MEMO_MAX
+#define POWERTASK_MEMO_MAX 32
+#endif
+
+/// Tasks with more input or output bytes than this are never cached.
+#ifndef POWERTASK_MEMO_INPUT_MAX
+#define POWERTASK_MEMO_INPUT_MAX 32
+#endif
+#ifndef POWERTASK_MEMO_OUTPUT_MAX
+#define POWERTASK_MEMO_OUTPUT_MAX 32
+#endif
+
+/// Statistics about the result cache.
+struct powertask_memo_stats_t {
+    uint32_t hits; // runs answered from the cache
+    uint32_t misses; // runs of deterministic tasks that called the function
+    uint32_t evictions; // cached results replaced by newer ones
+    uint64_t energy_saved; // energy_per_run of every hit (Joules)
+};
+typedef struct powertask_memo_stats_t powertask_memo_stats_t;
+
+/// Return the current result cache statistics.
+const powertask_memo_stats_t *powertask_memo_stats(void);
+
+/// Forget every cached result for this task ID (e.g., after its tables change).
+void powertask_memo_forget(powertask_ID_t ID);
+
+
+/*********** Downlink store and streaming output *************/
+/// Task outputs and stream chunks are stored as downlink records:
+///   this header, then "length" bytes of data.
+struct powertask_downlink_header_t {
+    powertask_ID_t ID; // task that produced the data
+    uint16_t type; // POWERTASK_DOWNLINK_ bits
+    uint16_t stream; // stream number from this task (counts up from 0)
+    powertask_result_t result; // task result code for outputs, 0 for stream chunks
+    uint32_t sequence; // chunk number within the stream, from 0
+    uint32_t length; // bytes of data after this header
+};
+typedef struct powertask_downlink_header_t powertask_downlink_header_t;
+
+#define POWERTASK_DOWNLINK_OUTPUT 0x0001 /* the task's output telemetry, sent when it finished */
+#define POWERTASK_DOWNLINK_STREAM 0x0002 /* one chunk of a streamed output */
+#define POWERTASK_DOWNLINK_FINAL 0x0004 /* the last chunk of its stream */
+
+/// This is a platform function that stores one downlink record,
+///   e.g., appending it to a flash archive or file.
+typedef void (*powertask_downlink_sink_t)(const powertask_downlink_header_t *header,
+    const powertask_data_t *data);
+
+/// Install a downlink sink.  By default (or if sink is 0), records go 
+///   into a RAM ring buffer read with powertask_downlink_read.
+void powertask_downlink_set_sink(powertask_downlink_sink_t sink);
+
+/// Bytes in the default RAM downlink ring.  The oldest records are dropped when it's full.
+#ifndef POWERTASK_DOWNLINK_BYTES
+#define POWERTASK_DOWNLINK_BYTES 65536
+#endif
+
+/// Read and remove the oldest record from the RAM downlink ring.
+///   Copies up to max bytes of its data (check header->length for truncation).
+///   Returns 1 if a record was read, 0 if the ring is empty.
+int powertask_downlink_read(powertask_downlink_header_t *header,powertask_data_t *data,uint32_t max);
+
+/// Send one chunk of a large output straight to downlink, from inside a task function.
+///   This allows outputs far bigger than output_length, or RAM, across many runs:
+///   write a chunk each run and return POWERTASK_RESULT_RETRY until done.
+///   Set final to 1 on the last chunk; the next chunk then starts a new stream.
+void powertask_stream_write(const void *data,uint32_t length,int final);
+
+/// Statistics about the downlink store.
+struct powertask_downlink_stats_t {
+    uint32_t records; // records stored
+    uint64_t bytes; // data bytes stored
+    uint32_t dropped; // records dropped from the RAM ring to make room, or too big for it
+    uint32_t ring_used; // bytes now in the RAM ring
+    uint32_t ring_high_water; // most bytes ever in the RAM ring
+};
+typedef struct powertask_downlink_stats_t powertask_downlink_stats_t;
+
+/// Return the current downlink statistics.
+const powertask_downlink_stats_t *powertask_downlink_stats(void);
+
+
+/*********** Bulk data stores and region inputs *************/
+/// A store is a read-only block of bulk data, such as a flash partition
+///   or a memory-mapped file, holding uplinked tables, ephemerides, or patches.
+///   Tasks read it in place, so big inputs never get copied into RAM.
+typedef uint8_t powertask_store_ID_t;
+
+/// Number of stores.
+#ifndef POWERTASK_STORE_MAX
+#define POWERTASK_STORE_MAX 8
+#endif
+
+/// Register the memory at base as this store.  The memory must stay valid.
+void powertask_store_register(powertask_store_ID_t store,const void *base,uint32_t length);
+
+#ifdef POWERTASK_HOSTED
+/// Memory-map this file read-only as this store.  Returns 1 on success.
+int powertask_store_map_file(powertask_store_ID_t store,const char *path);
+#endif
+
+/// This is the input telemetry data of a POWERTASK_FLAG_REGION_INPUT task:
+///   it names a range of bytes in a store.  input_length must be sizeof(powertask_region_t).
+struct powertask_region_t {
+    uint32_t offset; // first byte in the store
+    uint32_t length; // bytes in the region
+    uint32_t crc32; // expected CRC-32 of the region, or 0 to skip the check
+    powertask_store_ID_t store; // which store
+};
+typedef struct powertask_region_t powertask_region_t;
+
+/// Make this region-input task runnable on this range of a store.
+///   The range is checked again, along with the CRC, before the task runs;
+///   if it's invalid the task fails with POWERTASK_REASON_BAD_REGION.
+void powertask_make_runnable_region(powertask_ID_t ID,powertask_store_ID_t store,
+    uint32_t offset,uint32_t length,uint32_t crc32);
+
+/// From inside a region-input task function, get read-only access to its region.
+///   Returns a pointer to the data in place, and sets *length to its size.
+const void *powertask_region_data(const powertask_telemetry_t *input,uint32_t *length);
+
+/// Return the CRC-32 (as used by zlib and Ethernet) of these bytes.
+uint32_t powertask_crc32(const void *data,uint32_t length);
+
+
+/*********** Shared inputs *************/
+/// A shared input is an immutable, reference counted telemetry buffer that 
+///   many runnable tasks can use as their input at once, so one uplinked 
+///   dataset (e.g., a target list) feeding dozens of tasks is stored once.
+///   It's released when the last task using it finishes.
+typedef struct powertask_shared_t powertask_shared_t;
+
+/// Number of shared input buffers in the static pool.
+#ifndef POWERTASK_SHARED_MAX
+#define POWERTASK_SHARED_MAX 8
+#endif
+
+/// Largest shared input, in bytes of data.
+#ifndef POWERTASK_SHARED_BYTES
+#define POWERTASK_SHARED_BYTES 4096
+#endif
+
+/// Get a shared input buffer with room for length bytes of data, 
+///   holding one reference for the caller.  Fill out the data portion of
+///   powertask_shared_telemetry before giving it to any task.
+///   Returns 0 if the pool is empty.
+powertask_shared_t *powertask_shared_create(powertask_length_t length);
+
+/// Return the telemetry stored in this shared input.
+powertask_telemetry_t *powertask_shared_telemetry(powertask_shared_t *shared);
+
+/// Drop the caller's reference.  The buffer goes back to the pool once no task uses it.
+void powertask_shared_release(powertask_shared_t *shared);
+
+/// Make this task runnable with this shared input as its input telemetry.
+///   The data must be at least the task's input_length.
+///   The task gets its own reference, dropped when the task finishes.
+///   If failure hold-off delays the command, it gets a copy of the data instead.
+void powertask_make_runnable_shared(powertask_ID_t ID,powertask_shared_t *shared);
+
+/// Statistics about the shared input pool.
+struct powertask_shared_stats_t {
+    uint32_t created; // shared inputs ever created
+    uint32_t references; // tasks ever given a shared input
+    uint16_t in_use; // buffers now in use
+    uint16_t high_water; // most buffers ever in use at once
+};
+typedef struct powertask_shared_stats_t powertask_shared_stats_t;
+
+/// Return the current shared input statistics.
+const powertask_shared_stats_t *powertask_shared_stats(void);
+
+
+/*********** Buffered inputs *************/
+/// Largest input_depth: the front buffer plus this many less one back buffers.
+#ifndef POWERTASK_INPUT_DEPTH_MAX
+#define POWERTASK_INPUT_DEPTH_MAX 8
+#endif
+
+/// Number of commands staged for this task but not yet started.
+///  Returns 0 if that task ID is not registered.
+int powertask_input_staged(powertask_ID_t ID);
+
+
+/*********** Completion handles *************/
+/// Maximum number of command handles in use at once.
+///   When they're all taken, the oldest finished handle is reused.
+#ifndef POWERTASK_HANDLE_MAX
+#define POWERTASK_HANDLE_MAX 64
+#endif
+
+/// A handle names one submitted command: the low 16 bits pick a slot, 
+///   the high 16 bits are that slot's generation, so a reused slot
+///   can't be mistaken for an old command.  0 is never a valid handle.
+typedef uint32_t powertask_handle_t;
+#define POWERTASK_HANDLE_NONE 0
+
+/// Handle states, below POWERTASK_RESULT_FIRST so they can't be confused with results.
+#define POWERTASK_HANDLE_PENDING 0x0000 /* the command is queued or running */
+#define POWERTASK_HANDLE_STALE 0x0001 /* not a handle, or its slot has been reused */
+
+/// Dropped command reasons, added to POWERTASK_RESULT_FAIL_QUIET.
+#define POWERTASK_REASON_QUARANTINED 0xF02 /* the task is quarantined, so the command never ran */
+#define POWERTASK_REASON_UNREGISTERED 0xF03 /* the task was unregistered before the command ran */
+#define POWERTASK_REASON_CRASHED 0xF04 /* the isolated task's worker process died */
+#define POWERTASK_REASON_TIMEOUT 0xF05 /* the isolated task ran too long, and its worker was killed */
+#define POWERTASK_REASON_FORWARDED 0xF06 /* the command was sent to run on another node, which sends its output */
+
+/// Called when a command finishes, with the result and the task's output.
+///  The output is only valid during the call.
+typedef void (*powertask_completion_t)(powertask_handle_t handle,powertask_result_t result,
+    const powertask_telemetry_t *output,void *context);
+
+/// Make this task runnable like powertask_make_runnable, and return a handle 
+///   for this command.  *input gets the buffer to fill with the command's input.
+///  A batch task's handles finish when its whole queue is done.
+///  Returns POWERTASK_HANDLE_NONE if no slot is free (the task is still made runnable).
+powertask_handle_t powertask_submit(powertask_ID_t ID,powertask_telemetry_t **input);
+
+/// Return the command's result, or POWERTASK_HANDLE_PENDING or POWERTASK_HANDLE_STALE.
+///  If output is not 0 and the command finished, *output gets the task's output,
+///  which is valid until the task runs again.
+powertask_result_t powertask_poll(powertask_handle_t handle,const powertask_telemetry_t **output);
+
+/// Call this function when the command finishes (right away if it already has).
+///  Returns 0 if the handle is stale.
+int powertask_on_complete(powertask_handle_t handle,powertask_completion_t callback,void *context);
+
+/// Give the handle's slot back for reuse.  Later polls of it return POWERTASK_HANDLE_STALE.
+void powertask_handle_release(powertask_handle_t handle);
+
+#ifdef POWERTASK_HOSTED
+/// Run tasks until this command finishes, and return its result.
+///  Sleeps while only time-tagged commands are waiting.  Returns 
+///  POWERTASK_HANDLE_PENDING if "timeout" microseconds pass first,
+///  or if nothing is left that could finish it.
+///  The timeout and time-tagged commands need a clock from powertask_set_clock:
+///  under the default manual clock, time doesn't pass while this waits, so
+///  it returns POWERTASK_HANDLE_PENDING once only time-tagged commands are left.
+powertask_result_t powertask_wait(powertask_handle_t handle,powertask_time_t timeout);
+#endif
+
+
+/*********** Task modules *************/
+#ifdef POWERTASK_HOSTED
+/// Maximum number of task modules loaded at once.
+#ifndef POWERTASK_MODULE_MAX
+#define POWERTASK_MODULE_MAX 16
+#endif
+
+/// A task module is a shared object exporting this 0-terminated array 
+///   of its tasks' attributes:
+///     const powertask_attribute_t *powertask_module_tasks[]={&a,&b,0};
+#define POWERTASK_MODULE_SYMBOL "powertask_module_tasks"
+
+/// Load the shared object at "path" as the module called "name", registering
+///  its tasks.  If a module with this name is already loaded, this is a hot swap:
+///  tasks in both versions are replaced in place, keeping their queued commands, 
+///  tasks only in the old version are unregistered, and the old version is closed.
+///  Each version needs its own file name, since the dynamic loader caches by path.
+///  Nothing changes on failure.  Returns the number of tasks in the module, or -1.
+int powertask_module_load(const char *name,const char *path);
+
+/// Unregister all the tasks of this module, and close it.  Returns 0 if it wasn't loaded.
+int powertask_module_unload(const char *name);
+#endif
+
+
+/*********** Process-isolated tasks *************/
+#ifdef POWERTASK_HOSTED
+/// POWERTASK_FLAG_ISOLATED tasks run in pre-forked worker processes.
+///   A worker that crashes or times out is replaced, and the task fails with
+///   POWERTASK_REASON_CRASHED or POWERTASK_REASON_TIMEOUT.
+/// Isolated tasks' telemetry buffers are allocated in shared memory when
+///   they're first made runnable, so calls pass pointers, not copies;
+///   caller-allocated or shared inputs are copied through shared memory.
+/// Workers are copies of the scheduler from when they were forked, so an
+///   isolated function must not call powertask functions (they'd only change
+///   the worker's copy), and must be linked or loaded before the workers start
+///   (loading a task module re-forks them).  Batch functions always run in-process.
+
+/// Most worker processes.
+#ifndef POWERTASK_ISOLATE_WORKERS_MAX
+#define POWERTASK_ISOLATE_WORKERS_MAX 8
+#endif
+
+/// Bytes of shared memory for isolated tasks' telemetry.
+#ifndef POWERTASK_ISOLATE_BYTES
+#define POWERTASK_ISOLATE_BYTES (1024*1024)
+#endif
+
+/// Polls of the mailbox before a worker or the scheduler sleeps on a futex.
+///   Spinning makes back-to-back calls cheap, but burns CPU while idle.
+///   With only one CPU online, neither side spins.
+#ifndef POWERTASK_ISOLATE_SPIN
+#define POWERTASK_ISOLATE_SPIN 20000
+#endif
+
+/// Fork this many worker processes, which take calls in turn.  A call that takes 
+///  longer than "timeout" microseconds kills its worker (0 waits forever).
+///  Until this is called, isolated tasks run in-process.  Returns 1 on success.
+int powertask_isolate_start(int workers,powertask_time_t timeout);
+
+/// Kill the worker processes.  Isolated tasks run in-process again.
+void powertask_isolate_stop(void);
+
+/// Statistics about isolated tasks.
+struct powertask_isolate_stats_t {
+    uint32_t calls; // functions run in a worker
+    uint32_t copied; // calls whose telemetry had to be copied into shared memory
+    uint32_t crashes; // workers that died during a call
+    uint32_t timeouts; // workers killed for running too long
+    uint32_t spawned; // worker processes forked
+};
+typedef struct powertask_isolate_stats_t powertask_isolate_stats_t;
+
+/// Return the current isolated task statistics.
+const powertask_isolate_stats_t *powertask_isolate_stats(void);
+#endif
+
+
+/*********** Hardware performance counters *************/
+#ifdef POWERTASK_HOSTED
+/// For profiling task code on the ground, Linux hosted builds can read the
+///   CPU's performance counters before and after every task function call
+///   (or batch call) and add the difference to that task's totals, so 
+///   cache-hostile functions stand out before flight.  The counters count
+///   user-mode events on the thread that called powertask_pmu_start.
+///   The cost of reading the counters is measured and subtracted.
+///   Isolated tasks run in another process, so their counts aren't seen.
+#define POWERTASK_PMU_CYCLES 0 /* CPU cycles */
+#define POWERTASK_PMU_INSTRUCTIONS 1 /* instructions retired */
+#define POWERTASK_PMU_CACHE_MISSES 2 /* last level cache misses */
+#define POWERTASK_PMU_BRANCH_MISSES 3 /* mispredicted branches */
+#define POWERTASK_PMU_COUNTERS 4
+
+/// Open the counters for this thread, and start counting task calls.
+///   Returns a bitmask of the counters that opened (bit POWERTASK_PMU_CYCLES, 
+///   etc.), or 0 if none could (e.g., no PMU in a VM, or perf_event_paranoid).
+int powertask_pmu_start(void);
+
+/// Close the counters.  Totals are kept.
+void powertask_pmu_stop(void);
+
+/// One task's counter totals.
+struct powertask_pmu_stats_t {
+    uint32_t calls; // function calls counted
+    uint64_t total[POWERTASK_PMU_COUNTERS]; // summed over every call
+    uint64_t max_cycles; // most cycles in one call
+};
+typedef struct powertask_pmu_stats_t powertask_pmu_stats_t;
+
+/// Return this task's counter totals, or 0 if none have been counted.
+const powertask_pmu_stats_t *powertask_pmu_stats(powertask_ID_t ID);
+
+/// Print a table of every counted task's per-call averages to stdout.
+void powertask_pmu_report(void);
+#endif
+
+
+/*********** Distributed scheduling *************/
+/// Boards on a local bus each run a powertask node.  Nodes broadcast small
+///   summaries of their spare energy (battery less the energy_per_run of 
+///   their queued tasks).  When a POWERTASK_FLAG_OFFLOAD task comes up to run
+///   and this node can't pay for it, or a peer has POWERTASK_NODE_MARGIN more
+///   to spare, its ID and input are forwarded to the peer with the most spare
+///   energy.  Locally the command finishes with POWERTASK_REASON_FORWARDED.
+///   A forwarded command is never forwarded again.  Batch tasks stay local.
+typedef uint8_t powertask_node_t;
+
+/// Number of nodes.  Nodes are numbered from 0.
+#ifndef POWERTASK_NODE_MAX
+#define POWERTASK_NODE_MAX 8
+#endif
+#define POWERTASK_NODE_ALL 0xFF /* send to every other node */
+
+/// A peer must have this many more Joules to spare before a task this node 
+///   could run itself is sent there.
+#ifndef POWERTASK_NODE_MARGIN
+#define POWERTASK_NODE_MARGIN 1000
+#endif
+
+/// Summaries older than this (microseconds) are ignored.
+#ifndef POWERTASK_NODE_STALE
+#define POWERTASK_NODE_STALE 10000000
+#endif
+
+/// Longest message between nodes, in bytes.
+#ifndef POWERTASK_NODE_MESSAGE_MAX
+#define POWERTASK_NODE_MESSAGE_MAX 1030
+#endif
+
+/// A transport carries whole messages between nodes, e.g., over CAN, 
+///   SpaceWire, or a UART with framing.  The functions get "context".
+struct powertask_transport_t {
+    /// Send this message to node "to" (or POWERTASK_NODE_ALL).  Returns 1 if it was sent.
+    int (*send)(void *context,powertask_node_t to,const void *bytes,uint32_t length);
+    /// Copy one waiting message into bytes.  Returns its length, or 0 if none is waiting.
+    int (*receive)(void *context,void *bytes,uint32_t max);
+    void *context;
+};
+typedef struct powertask_transport_t powertask_transport_t;
+
+/// Start distributed scheduling as node "self" over this transport.
+void powertask_node_start(powertask_node_t self,const powertask_transport_t *transport);
+
+/// Broadcast this node's energy summary.  Call this every few passes.
+void powertask_node_publish(void);
+
+/// Handle every waiting message: peer summaries, and tasks forwarded here.
+///  A forwarded command for a task that can't take another command yet 
+///  waits (with the messages behind it) until the task is free, so bursts
+///  aren't lost.  Call this every pass.  Returns the number of messages handled.
+int powertask_node_poll(void);
+
+#ifdef POWERTASK_HOSTED
+/// Return a transport over Unix datagram sockets named "<directory>/node<n>",
+///   so nodes can be tested as processes on one host.  Returns 0 on failure.
+const powertask_transport_t *powertask_transport_unix(const char *directory,powertask_node_t self);
+#endif
+
+/// Statistics about distributed scheduling.
+struct powertask_node_stats_t {
+    uint32_t summaries_sent;
+    uint32_t summaries_received;
+    uint32_t tasks_forwarded; // commands sent to other nodes
+    uint32_t tasks_received; // commands other nodes sent here
+    uint32_t dropped; // messages that were malformed, or for tasks not registered here
+};
+typedef struct powertask_node_stats_t powertask_node_stats_t;
+
+/// Return the current distributed scheduling statistics.
+const powertask_node_stats_t *powertask_node_stats(void);
+
+
+/*********** Authenticated uplink *************/
+/// Uplink frames carry commands, authenticated by a SipHash-2-4 MAC under
+///   a 128-bit key shared with the ground.  Multi-byte fields are big-endian:
+///     2 bytes: POWERTASK_UPLINK_SYNC
+///     2 bytes: length of the command bytes
+///     4 bytes: frame sequence number, counting up
+///     commands: 2 byte task ID, then that task's input_length bytes of input
+///     8 bytes: MAC of the length, sequence number, and commands
+///   The decoder hashes bytes as they arrive, so a frame is checked and
+///   dispatched in one pass, and none of its commands run unless it's authentic.
+#define POWERTASK_UPLINK_SYNC 0xEB90
+
+/// Frames starting with this sync word instead carry a 4 byte command
+///   sequence number after each task ID, and duplicate commands are dropped
+///   (see powertask_make_runnable_sequenced).  Their MAC covers the sync word too.
+#define POWERTASK_UPLINK_SYNC_SEQUENCED 0xEB91
+
+/// Most command bytes in one frame.
+#ifndef POWERTASK_UPLINK_FRAME_MAX
+#define POWERTASK_UPLINK_FRAME_MAX 1024
+#endif
+
+/// Most commands in one frame.
+#ifndef POWERTASK_UPLINK_COMMANDS_MAX
+#define POWERTASK_UPLINK_COMMANDS_MAX 128
+#endif
+
+/// Frames this far behind the newest sequence number are rejected as replays.
+#define POWERTASK_UPLINK_WINDOW 64
+
+/// Set the 16 byte MAC key.  Frames are rejected until a key is set.
+void powertask_uplink_set_key(const uint8_t key[16]);
+
+/// Decode received uplink bytes.  Frames may be split across calls at any point.
+///  Returns the number of commands dispatched to powertask_make_runnable.
+int powertask_uplink_receive(const void *bytes,uint32_t length);
+
+/// Return the SipHash-2-4 of this data under this 16 byte key.
+uint64_t powertask_siphash(const uint8_t key[16],const void *data,uint32_t length);
+
+/// Statistics about the uplink decoder.
+struct powertask_uplink_stats_t {
+    uint32_t frames; // authentic frames whose commands were dispatched
+    uint32_t commands; // commands dispatched, not counting duplicates
+    uint32_t bad_mac; // frames whose MAC didn't match
+    uint32_t replayed; // authentic frames with an old or repeated sequence number
+    uint32_t malformed; // frames too long, or with unknown tasks or a bad length
+    uint32_t skipped; // bytes skipped hunting for a sync word
+};
+typedef struct powertask_uplink_stats_t powertask_uplink_stats_t;
+
+/// Return the current uplink statistics.
+const powertask_uplink_stats_t *powertask_uplink_stats(void);
+
+
+/*********** Duplicate command suppression *************/
+/// Ground retransmissions can deliver the same command twice.  A command 
+///   carrying a sequence number is dropped if that task has already seen 
+///   the number among its last POWERTASK_UPLINK_WINDOW sequence numbers.
+
+/// Make this task runnable like powertask_make_runnable, unless this 
+///  sequence number is a duplicate (or too old to tell).  Returns 0 for a
+///  dropped command, so the caller must check before filling in the input.
+powertask_telemetry_t *powertask_make_runnable_sequenced(powertask_ID_t ID,uint32_t sequence);
+
+/// Statistics about duplicate suppression.
+struct powertask_dedupe_stats_t {
+    uint32_t accepted; // sequenced commands made runnable
+    uint32_t suppressed; // duplicate commands dropped
+    uint64_t energy_saved; // energy_per_run of every dropped command (Joules)
+};
+typedef struct powertask_dedupe_stats_t powertask_dedupe_stats_t;
+
+/// Return the current duplicate suppression statistics.
+const powertask_dedupe_stats_t *powertask_dedupe_stats(void);
+
+
+/*********** CPU performance state hints *************/
+/// Compute-bound tasks often use less energy at a high clock (they finish
+///   sooner, so the rest of the board is powered for less time), while 
+///   I/O-bound tasks should wait at the lowest clock.  A task's perf_state
+///   asks for a performance state, from POWERTASK_PERF_LOW (slowest clock)
+///   up to POWERTASK_PERF_HIGH.  The platform hook switches states before the
+///   function runs, and the state is left alone until a task asks for another.
+/// To avoid switch churn, a group runs tasks a few places back in its list
+///   that match the current state ahead of a task that would need a switch.
+#ifndef POWERTASK_PERF_STATES
+#define POWERTASK_PERF_STATES 4
+#endif
+#define POWERTASK_PERF_ANY 0 /* run at whatever the current state is */
+#define POWERTASK_PERF_LOW 1
+#define POWERTASK_PERF_HIGH POWERTASK_PERF_STATES
+
+/// How far down its group's runnable list a matching task can be found.
+#ifndef POWERTASK_PERF_LOOKAHEAD
+#define POWERTASK_PERF_LOOKAHEAD 8
+#endif
+
+/// This is a platform function that switches the CPU to this performance state.
+typedef void (*powertask_perf_hook_t)(uint8_t state);
+
+/// Install the platform performance state hook.  By default (or if hook is 0)
+///   states are only recorded, not applied.
+void powertask_perf_set_hook(powertask_perf_hook_t hook);
+
+/// Set how many tasks at the current state may run ahead of a task that needs 
+///   a switch, before it gets its turn.  0 runs tasks strictly in order.  The default is 8.
+void powertask_perf_batch(uint8_t max);
+
+#ifdef POWERTASK_HOSTED
+/// Install a hook that writes each state's clock frequency in kHz, khz[state-1],
+///   to this Linux cpufreq sysfs file, such as 
+///   /sys/devices/system/cpu/cpu0/cpufreq/scaling_setspeed (with the userspace
+///   governor), or to a plain file for testing.  Returns 1 if the file can be written.
+int powertask_perf_cpufreq(const char *path,const uint32_t khz[POWERTASK_PERF_STATES]);
+#endif
+
+/// Statistics about performance state switching.
+struct powertask_perf_stats_t {
+    uint32_t switches; // performance state changes
+    uint32_t batched; // runs moved ahead of a task that needed a switch
+    uint8_t state; // current performance state, 0 before the first switch
+};
+typedef struct powertask_perf_stats_t powertask_perf_stats_t;
+
+/// Return the current performance state statistics.
+const powertask_perf_stats_t *powertask_perf_stats(void);
+
+
+/*********** Time-tagged command queue *************/
+/// Maximum number of time-tagged commands stored at once.
+#ifndef POWERTASK_TIMED_MAX
+#define POWERTASK_TIMED_MAX 4096
+#endif
+
+/// Maximum bytes of telemetry input stored with each time-tagged command.
+#ifndef POWERTASK_TIMED_INPUT_MAX
+#define POWERTASK_TIMED_INPUT_MAX 16
+#endif
+
+/// Most time-tagged commands released by one powertask_run_next call; 
+///   the rest wait for the next call.  0 means no limit.
+#ifndef POWERTASK_TIMED_RELEASE_MAX
+#ifdef POWERTASK_CONSTANT_TIME
+#define POWERTASK_TIMED_RELEASE_MAX 4
+#else
+#define POWERTASK_TIMED_RELEASE_MAX 0
+#endif
+#endif
+
+/// Store a command to make this task runnable at absolute time "when".
+///  If this task requires input, you must fill out the data portion 
+///   of the returned telemetry structure, which is stored with the command
+///   and copied into the task's input when the command is released.
+/// Commands with equal times are released in the order they were stored.
+/// A command that comes due while its task has no room for another input
+///   (it's still runnable with one input buffer, or its buffers are full)
+///   waits until the task finishes a command, instead of replacing its input.
+powertask_telemetry_t *powertask_make_runnable_at(powertask_ID_t ID,powertask_time_t when);
+
+/// Return the number of time-tagged commands still waiting for their time or their task.
+int powertask_timed_pending(void);
+
+/// Statistics about the time-tagged command queue.
+///   Jitter is the delay between a command's scheduled time and the task's actual start.
+struct powertask_timed_stats_t {
+    uint32_t stored; // commands ever stored
+    uint32_t released; // commands moved onto the run queue
+    uint32_t started; // released tasks that have begun running
+    uint32_t high_water; // most commands waiting at once
+    uint32_t waited; // commands that came due while their task had no room for them
+    uint32_t dropped; // commands whose task was unregistered (or came back with another input_length)
+    powertask_time_t jitter_last; // start jitter of the most recent task
+    powertask_time_t jitter_max; // worst start jitter seen
+    powertask_time_t jitter_total; // sum of all start jitter (divide by started for mean)
+};
+typedef struct powertask_timed_stats_t powertask_timed_stats_t;
+
+/// Return the current time-tagged command statistics.
+const powertask_timed_stats_t *powertask_timed_stats(void);
+
+
+/*********** Periodic tasks and admission control *************/
+/// A periodic task is released every period through the time-tagged 
+///   command queue, with zero input, and must finish each release (job)
+///   before the next one.  Released periodic tasks run ahead of other tasks,
+///   shortest period first (rate-monotonic priority), whenever the battery
+///   can pay for them without spending a starved task's reserved energy.
+///   A POWERTASK_FLAG_OFFLOAD periodic task's jobs can be forwarded to 
+///   another node like its other commands.  Runs aren't preempted, so a 
+///   periodic task can also wait for the longest run of a lower priority 
+///   or non-periodic task.
+///
+///   Each new periodic task is admitted only if response-time analysis 
+///   shows every periodic task still finishes within its period, and 
+///   (if the energy income is set) the income pays for them all.
+///   The analysis uses the larger of each task's declared execution time 
+///   and its longest measured job, and of energy_per_run and its measured
+///   energy; longer measurements mark it for re-analysis by 
+///   powertask_schedulability.
+
+/// Most periodic tasks at once.
+#ifndef POWERTASK_PERIODIC_MAX
+#define POWERTASK_PERIODIC_MAX 256
+#endif
+
+/// Released periodic tasks run_next looks at, highest priority first, 
+///   to find one the battery can pay for.
+#ifndef POWERTASK_PERIODIC_LOOKAHEAD
+#define POWERTASK_PERIODIC_LOOKAHEAD 4
+#endif
+
+/// What powertask_periodic does with a task that fails analysis.
+#define POWERTASK_ADMISSION_REJECT 0 /* don't make it periodic (the default) */
+#define POWERTASK_ADMISSION_WARN 1 /* make it periodic anyway, and print a warning */
+
+/// Make this registered task periodic: released every "period" microseconds,
+///   starting now, and taking at most "execution" microseconds per job.
+///   Returns 1 if the periodic set is schedulable with it, or 0 if it isn't
+///   (then the task is only made periodic in POWERTASK_ADMISSION_WARN mode).
+///   Calling it again for a periodic task changes its period and execution.
+int powertask_periodic(powertask_ID_t ID,powertask_time_t period,powertask_time_t execution);
+
+/// Stop releasing this task periodically.  A release already stored in the
+///   time-tagged queue still runs once.  Returns 0 if it wasn't periodic.
+int powertask_periodic_remove(powertask_ID_t ID);
+
+/// Set what happens to tasks that fail analysis: POWERTASK_ADMISSION_ mode.
+void powertask_periodic_admission(uint8_t mode);
+
+/// Set the longest run (microseconds) of any non-periodic task, which can
+///   delay every periodic task.  The longest measured run is used if it's bigger.
+void powertask_periodic_blocking(powertask_time_t longest);
+
+/// Set the average energy income (milliwatts: millijoules per second) from
+///   solar panels or such.  0 (the default) doesn't check energy.
+void powertask_periodic_income(uint32_t milliwatts);
+
+/// Per-task periodic statistics.
+struct powertask_periodic_stats_t {
+    powertask_time_t period; // time between releases
+    powertask_time_t execution; // declared longest job
+    powertask_time_t measured; // longest measured job (all its runs, if it RETRYs)
+    uint32_t energy; // most energy (Joules) used by one measured job
+    powertask_time_t response; // analyzed worst release-to-finish time (past the period if it can miss, all ones if it never finishes)
+    powertask_time_t max_response; // longest measured release-to-finish time
+    uint32_t releases; // jobs released
+    uint32_t misses; // jobs finished after their period, or released while the last was still queued
+};
+typedef struct powertask_periodic_stats_t powertask_periodic_stats_t;
+
+/// Return the periodic statistics for this task ID, or 0 if it isn't periodic.
+const powertask_periodic_stats_t *powertask_periodic_stats(powertask_ID_t ID);
+
+/// Schedulability of the whole periodic set.
+struct powertask_schedulability_t {
+    uint16_t tasks; // periodic tasks
+    uint8_t schedulable; // 1 if every periodic task finishes within its period, and the income pays for them
+    powertask_ID_t critical; // the periodic task with the least slack (0 if none)
+    powertask_time_t slack; // that task's period minus its worst response (0 if it misses)
+    uint32_t utilization; // CPU time used by periodic tasks, parts per million
+    int32_t utilization_margin; // 1000000 - utilization: what's left for other tasks
+    powertask_time_t blocking; // longest non-periodic run, declared or measured
+    uint32_t energy_demand; // average power used by periodic tasks (milliwatts)
+    uint32_t energy_income; // from powertask_periodic_income (0 if not checked)
+    int32_t energy_margin; // income minus demand (milliwatts)
+    uint32_t analyses; // response-time analyses run
+    uint32_t iterations; // fixed-point iterations run by all analyses
+};
+typedef struct powertask_schedulability_t powertask_schedulability_t;
+
+/// Re-analyze the periodic set if measurements have grown, printing a 
+///   warning if it can now miss, and return its schedulability.
+const powertask_schedulability_t *powertask_schedulability(void);
+
+
+/*********** Housekeeping telemetry *************/
+/// The builtin Housekeeping task sends a compact record of scheduler health
+///   to downlink as its output.  Run it by command, or set a period.
+///   Counts are since the previous record.  Multi-byte fields are big-endian:
+///     8 bytes: time of this record
+///     4 bytes: milliseconds since the previous record
+///     2 bytes: runnable tasks now
+///     4 bytes each: task runs, failed runs, RETRY runs, battery skips
+///     2 bytes: idle fraction: run_next calls that ran only the idle task, per thousand
+///     2 bytes: battery energy now (Joules)
+///     2 bytes each: time-tagged command and shared input pool high-water marks
+///     4 bytes: downlink ring high-water mark (bytes)
+///     POWERTASK_HOUSEKEEPING_TOP times: 2 byte task ID and 4 byte Joules
+///       of the tasks that used the most energy, most first (ID 0 if unused)
+#define POWERTASK_ID_HOUSEKEEPING 0xF002
+
+/// Number of top energy consumers in each record.
+#ifndef POWERTASK_HOUSEKEEPING_TOP
+#define POWERTASK_HOUSEKEEPING_TOP 4
+#endif
+
+/// Bytes in a housekeeping record.
+#define POWERTASK_HOUSEKEEPING_BYTES (42+6*POWERTASK_HOUSEKEEPING_TOP)
+
+/// Send a housekeeping record every "period" microseconds, using the 
+///   time-tagged command queue, starting after the first task is registered.
+///   0 (the default) only sends them when commanded.
+void powertask_housekeeping_period(powertask_time_t period);
+
+
+/*********** Memory and log dumps *************/
+/// The builtin MemoryRead and LogRead tasks stream a range of bytes to 
+///   downlink for debugging, POWERTASK_DUMP_CHUNK bytes per run, returning
+///   POWERTASK_RESULT_RETRY until the range is done.  The chunks form one 
+///   stream from the task's ID.  Their output is the 4 byte big-endian 
+///   count of bytes sent, which is short if a log ended early.
+///   Commands that arrive while a dump is running wait for it to finish,
+///   up to POWERTASK_DUMP_QUEUE commands in all.
+
+/// MemoryRead's input: 8 byte big-endian address, 4 byte length.
+///   The range must lie inside a window added with powertask_memory_window,
+///   or the task fails with POWERTASK_REASON_BAD_REGION.
+#define POWERTASK_ID_MEMORY_READ 0xF003
+
+/// LogRead's input: 4 byte big-endian offset, 4 byte length, read from
+///   the log reader.  Fails with POWERTASK_REASON_BAD_REGION if there is none.
+#define POWERTASK_ID_LOG_READ 0xF004
+
+/// Bytes sent per run.
+#ifndef POWERTASK_DUMP_CHUNK
+#define POWERTASK_DUMP_CHUNK 256
+#endif
+
+/// Input depth of each dump task: the running command plus those waiting.
+#ifndef POWERTASK_DUMP_QUEUE
+#define POWERTASK_DUMP_QUEUE 4
+#endif
+
+/// Number of readable memory windows.
+#ifndef POWERTASK_MEMORY_WINDOWS
+#define POWERTASK_MEMORY_WINDOWS 4
+#endif
+
+/// Allow MemoryRead to read this memory.  Returns 0 if there are too many windows.
+int powertask_memory_window(const void *base,uint32_t length);
+
+/// This is a platform function that copies up to max bytes of the log
+///   (e.g., a trace buffer or flash archive) starting at offset.
+///   Returns the bytes copied, 0 past the end of the log.
+typedef uint32_t (*powertask_log_reader_t)(uint32_t offset,powertask_data_t *data,uint32_t max);
+
+/// Install the log reader used by LogRead.
+void powertask_log_reader(powertask_log_reader_t reader);
+
+#ifdef POWERTASK_HOSTED
+/// Use this file as the log, e.g., one a downlink sink appends to.  Returns 1 on success.
+int powertask_log_file(const char *path);
+#endif
+
+/// Limit dumps to this many bytes per second, so a large dump doesn't 
+///   crowd out other work: a run without enough budget sends nothing and 
+///   returns POWERTASK_RESULT_RETRY.  0 (the default) is unlimited.
+void powertask_dump_rate(uint32_t bytes_per_second);
+
+/// Statistics about dumps.
+struct powertask_dump_stats_t {
+    uint32_t dumps; // dumps finished
+    uint32_t chunks; // chunks sent
+    uint64_t bytes; // bytes sent
+    uint32_t throttled; // runs that waited for the byte rate budget
+};
+typedef struct powertask_dump_stats_t powertask_dump_stats_t;
+
+/// Return the current dump statistics.
+const powertask_dump_stats_t *powertask_dump_stats(void);
+
+
+/*********** Stored command sequences *************/
+/// A sequence is a compact program, uplinked once and stored on board,
+///   that makes a list of tasks runnable with stored input templates.
+///   It's launched by one small command: the builtin SequenceStart task,
+///   whose input is the powertask_ID_t of the sequence to run.
+#define POWERTASK_ID_SEQUENCE_START 0xF001
+
+/// Total bytes of sequence code stored on board.
+#ifndef POWERTASK_SEQUENCE_BYTES
+#define POWERTASK_SEQUENCE_BYTES 4096
+#endif
+
+/// Maximum number of sequences stored at once.
+#ifndef POWERTASK_SEQUENCE_MAX
+#define POWERTASK_SEQUENCE_MAX 32
+#endif
+
+/// Sequence opcodes.  Multi-byte operands are big-endian.
+#define POWERTASK_SEQ_END 0x00 /* end of the sequence */
+#define POWERTASK_SEQ_RUN 0x01 /* 2 byte task ID, then input_length bytes of input template: make the task runnable */
+#define POWERTASK_SEQ_DELAY 0x02 /* 4 byte microseconds: later steps run this long after the sequence starts */
+
+/// Store a sequence on board under this ID, replacing any old sequence with the same ID.
+///   The code is checked here, so running it later needs no decoding checks:
+///   every task must already be registered, and each RUN step must carry 
+///   exactly that task's input_length bytes.
+/// Returns 1 if the sequence was stored, 0 if it was rejected.
+int powertask_sequence_define(powertask_ID_t ID,const powertask_data_t *code,powertask_length_t length);
+
+/// Remove the stored sequence with this ID.  Returns 1 if it existed.
+int powertask_sequence_delete(powertask_ID_t ID);
+
+/// Run the stored sequence with this ID, making its tasks runnable now 
+///   (or time-tagged for later, after a DELAY step).
+/// Returns the number of tasks made runnable, or -1 if there is no such sequence.
+int powertask_sequence_start(powertask_ID_t ID);
+
+
 #endif
 
 
@@ -0,0 +1,418 @@
+/**
+ Adversarial worst-case search for scheduler latency.  Run with "make adversary".
+
+ A case is a task set in registration order plus a sequence of
+ make_runnable, run_next, and battery changes.  Each case runs in fresh
+ forked processes (so its first task really is the root of the task tree),
+ a few times over, and each call's latency is the least of its repeats,
+ which filters out interrupts.  Each process first warms up the scheduler
+ calls on a task it then unregisters, so a case's first calls aren't
+ ranked for cold caches.  The search mixes random cases with
+ mutations of the worst found so far, some of them guided toward known
+ trouble (sorting ID ranges makes the task tree a list), and reports the
+ cases with the slowest single call and the deepest ID lookup.
+
+   powertask_adversary [evaluations [seed]]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "powertask_internal.h"
+
+#define ADV_TASKS_MAX 128
+#define ADV_OPS_MAX 1024
+#define ADV_REPEATS 3 /* fresh runs of each case; each call's latency is the least */
+#define ADV_KEEP 5 /* worst cases kept, and mutated */
+#define ADV_WARM_CALLS 16 /* untimed calls before each run */
+#define ADV_WARM_ID 0xF800 /* warm-up task, outside the case IDs */
+
+#define ADV_RUNNABLE 0 /* make task arg runnable */
+#define ADV_RUN_NEXT 1 /* run the next task */
+#define ADV_BATTERY 2 /* set the battery to arg Joules */
+static const char *adv_op_names[]={"make_runnable","run_next","set_battery"};
+
+/// One task of a case.
+struct adv_task_t {
+    powertask_ID_t ID;
+    uint8_t group;
+    uint8_t kind; // what its function returns: 0 OK, 1 RETRY, 2 failure
+    uint8_t perf_state;
+    uint16_t battery; // minimum_battery
+};
+
+/// One case: tasks in registration order, then ops.
+struct adv_case_t {
+    int tasks;
+    struct adv_task_t task[ADV_TASKS_MAX];
+    int ops;
+    struct { uint8_t type; uint16_t arg; } op[ADV_OPS_MAX];
+};
+
+/// What one child process measured.
+struct adv_run_t {
+    uint32_t register_ns[ADV_TASKS_MAX];
+    uint32_t op_ns[ADV_OPS_MAX];
+    uint16_t depth[ADV_TASKS_MAX]; // lookup depth of each task once all are registered
+};
+
+/// A scored case.
+struct adv_score_t {
+    struct adv_case_t c;
+    uint32_t worst_ns; // slowest make_runnable or run_next
+    int worst_op; // which op that was
+    int max_depth; // deepest lookup among the tasks
+    int worst_depth; // lookup depth of the slowest op's task (make_runnable only)
+};
+
+static struct adv_run_t *adv_runs; // ADV_REPEATS runs, shared with the children
+static uint64_t adv_random_state=1;
+
+static uint32_t adv_random(void)
+{
+    uint64_t x=adv_random_state;
+    x^=x>>12; x^=x<<25; x^=x>>27;
+    adv_random_state=x;
+    return (uint32_t)((x*0x2545F4914F6CDD1Dull)>>32);
+}
+
+static uint64_t adv_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+
+
+/********* Running a case ***********/
+static powertask_result_t adv_ok(const powertask_telemetry_t *input,powertask_telemetry_t *output)
+{
+    return POWERTASK_RESULT_OK;
+}
+static powertask_result_t adv_retry(const powertask_telemetry_t *input,powertask_telemetry_t *output)
+{
+    return POWERTASK_RESULT_RETRY;
+}
+static powertask_result_t adv_fail(const powertask_telemetry_t *input,powertask_telemetry_t *output)
+{
+    return POWERTASK_RESULT_FAIL_QUIET+1;
+}
+static const powertask_function_t adv_functions[3]={adv_ok,adv_retry,adv_fail};
+
+/// Write to every private writable page, so the copy-on-write faults
+///   after a fork happen now, not during the calls we're timing.
+static void adv_touch_pages(void)
+{
+    FILE *f=fopen("/proc/self/maps","r");
+    char line[512];
+    long page=sysconf(_SC_PAGESIZE);
+    if (f==0) return;
+    while (fgets(line,sizeof(line),f)) {
+        unsigned long start, end;
+        char perms[8];
+        if (sscanf(line,"%lx-%lx %7s",&start,&end,perms)!=3 || strcmp(perms,"rw-p")!=0) continue;
+        for (;start<end;start+=page) {
+            volatile char *p=(volatile char *)start;
+            *p=*p;
+        }
+    }
+    fclose(f);
+}
+
+/// Run the scheduler calls a few times on a task outside the case's IDs,
+///   then unregister it, so the case's first calls don't pay for cold 
+///   caches and branch predictors.
+static void adv_warm_up(void)
+{
+    static const powertask_attribute_t warm={ADV_WARM_ID,"WarmUp",0,adv_ok};
+    int i;
+    powertask_set_battery(1000);
+    for (i=0;i<ADV_WARM_CALLS;i++) {
+        powertask_register(&warm);
+        powertask_make_runnable(ADV_WARM_ID);
+        powertask_run_next();
+        powertask_run_next(); // with nothing to run
+        powertask_unregister(ADV_WARM_ID);
+    }
+}
+
+/// In a fresh child process, run the case and record each call's latency.
+static void adv_child(const struct adv_case_t *c,struct adv_run_t *run)
+{
+    static powertask_attribute_t attributes[ADV_TASKS_MAX];
+    int i;
+    powertask_debug(0);
+    adv_touch_pages();
+    adv_warm_up();
+    for (i=0;i<c->tasks;i++) {
+        const struct adv_task_t *t=&c->task[i];
+        powertask_attribute_t *a=&attributes[i];
+        memset(a,0,sizeof(*a));
+        a->ID=t->ID;
+        a->name="Adversary";
+        a->minimum_battery=t->battery;
+        a->function=adv_functions[t->kind];
+        a->group=t->group;
+        a->energy_per_run=t->battery/4;
+        a->perf_state=t->perf_state;
+        uint64_t start=adv_ns();
+        powertask_register(a);
+        run->register_ns[i]=adv_ns()-start;
+    }
+    for (i=0;i<c->tasks;i++) run->depth[i]=powertask_task_depth(c->task[i].ID);
+
+    powertask_set_battery(1000);
+    for (i=0;i<c->ops;i++) {
+        uint16_t arg=c->op[i].arg;
+        uint64_t start=adv_ns();
+        switch (c->op[i].type) {
+        case ADV_RUNNABLE: powertask_make_runnable(c->task[arg%c->tasks].ID); break;
+        case ADV_RUN_NEXT: powertask_run_next(); break;
+        case ADV_BATTERY: powertask_set_battery(arg); start=adv_ns(); break; // not a scheduler call
+        }
+        run->op_ns[i]=adv_ns()-start;
+    }
+}
+
+/// Run this case in fresh processes and score it.
+static void adv_evaluate(struct adv_score_t *s)
+{
+    const struct adv_case_t *c=&s->c;
+    int r, i;
+    for (r=0;r<ADV_REPEATS;r++) {
+        fflush(stdout);
+        pid_t pid=fork();
+        if (pid==0) {
+            adv_child(c,&adv_runs[r]);
+            _exit(0);
+        }
+        int status=0;
+        waitpid(pid,&status,0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)!=0) {
+            printf("adversary: case crashed the scheduler (status %d)\n",status);
+            exit(1);
+        }
+    }
+    s->worst_ns=0;
+    s->worst_op=-1;
+    for (i=0;i<c->ops;i++) {
+        if (c->op[i].type==ADV_BATTERY) continue;
+        uint32_t ns=adv_runs[0].op_ns[i];
+        for (r=1;r<ADV_REPEATS;r++) if (adv_runs[r].op_ns[i]<ns) ns=adv_runs[r].op_ns[i];
+        if (ns>s->worst_ns) { s->worst_ns=ns; s->worst_op=i; }
+    }
+    s->max_depth=0;
+    for (i=0;i<c->tasks;i++) if (adv_runs[0].depth[i]>s->max_depth) s->max_depth=adv_runs[0].depth[i];
+    s->worst_depth=0;
+    if (s->worst_op>=0 && c->op[s->worst_op].type==ADV_RUNNABLE)
+        s->worst_depth=adv_runs[0].depth[c->op[s->worst_op].arg%c->tasks];
+}
+
+
+/********* Making cases ***********/
+/// Return 1 if no task of this case has this ID.
+static int adv_ID_free(const struct adv_case_t *c,powertask_ID_t ID)
+{
+    int i;
+    if (ID<0x1000 || ID>=0xF000) return 0;
+    for (i=0;i<c->tasks;i++) if (c->task[i].ID==ID) return 0;
+    return 1;
+}
+
+static void adv_random_task(struct adv_case_t *c,struct adv_task_t *t)
+{
+    powertask_ID_t ID;
+    do ID=0x1000+adv_random()%0xE000; while (!adv_ID_free(c,ID));
+    t->ID=ID;
+    t->group=adv_random()%POWERTASK_GROUP_MAX;
+    t->kind=adv_random()%8==0?1+adv_random()%2:0;
+    t->perf_state=adv_random()%4==0?adv_random()%(POWERTASK_PERF_STATES+1):0;
+    t->battery=adv_random()%3==0?adv_random()%2000:0;
+}
+
+static void adv_random_op(struct adv_case_t *c,int i)
+{
+    uint32_t r=adv_random()%16;
+    c->op[i].type=r<8?ADV_RUNNABLE:r<15?ADV_RUN_NEXT:ADV_BATTERY;
+    c->op[i].arg=c->op[i].type==ADV_BATTERY?adv_random()%2000:adv_random()%ADV_TASKS_MAX;
+}
+
+static void adv_random_case(struct adv_case_t *c)
+{
+    int i;
+    c->tasks=0;
+    int tasks=1+adv_random()%ADV_TASKS_MAX;
+    for (i=0;i<tasks;i++) {
+        adv_random_task(c,&c->task[i]);
+        c->tasks++;
+    }
+    c->ops=64+adv_random()%(ADV_OPS_MAX-63);
+    for (i=0;i<c->ops;i++) adv_random_op(c,i);
+}
+
+static int adv_by_ID_up(const void *a,const void *b)
+{
+    return (int)((const struct adv_task_t *)a)->ID-(int)((const struct adv_task_t *)b)->ID;
+}
+static int adv_by_ID_down(const void *a,const void *b)
+{
+    return adv_by_ID_up(b,a);
+}
+
+/// Make one random change to this case.
+static void adv_mutate(struct adv_case_t *c)
+{
+    int i=adv_random()%c->tasks, j=adv_random()%c->tasks, k;
+    struct adv_task_t swap;
+    switch (adv_random()%10) {
+    case 0: // guided: register a range of tasks in sorted ID order
+        if (i>j) { k=i; i=j; j=k; }
+        qsort(&c->task[i],j-i+1,sizeof(c->task[0]),adv_random()%2?adv_by_ID_up:adv_by_ID_down);
+        break;
+    case 1: // swap two registrations
+        swap=c->task[i]; c->task[i]=c->task[j]; c->task[j]=swap;
+        break;
+    case 2: // guided: move a task's ID next to another's
+        if (adv_ID_free(c,c->task[j].ID+1)) c->task[i].ID=c->task[j].ID+1;
+        break;
+    case 3: // add or remove a task
+        if (c->tasks<ADV_TASKS_MAX && adv_random()%2) adv_random_task(c,&c->task[c->tasks++]);
+        else if (c->tasks>1) c->tasks--;
+        break;
+    case 4: // change a task's group, battery, result, or performance state
+        swap=c->task[i];
+        adv_random_task(c,&c->task[i]);
+        c->task[i].ID=swap.ID;
+        break;
+    case 5: // change an op
+        adv_random_op(c,adv_random()%c->ops);
+        break;
+    case 6: // insert an op
+        if (c->ops<ADV_OPS_MAX) {
+            k=adv_random()%c->ops;
+            memmove(&c->op[k+1],&c->op[k],(c->ops-k)*sizeof(c->op[0]));
+            c->ops++;
+            adv_random_op(c,k);
+        }
+        break;
+    case 7: // delete an op
+        if (c->ops>1) {
+            k=adv_random()%c->ops;
+            memmove(&c->op[k],&c->op[k+1],(c->ops-k-1)*sizeof(c->op[0]));
+            c->ops--;
+        }
+        break;
+    case 8: // repeat a block of ops
+        k=adv_random()%c->ops;
+        for (i=0;i<16 && c->ops<ADV_OPS_MAX;i++) {
+            c->op[c->ops]=c->op[(k+i)%c->ops];
+            c->ops++;
+        }
+        break;
+    case 9: // guided: make every task runnable at once
+        for (i=0;i<c->tasks && c->ops<ADV_OPS_MAX;i++) {
+            c->op[c->ops].type=ADV_RUNNABLE;
+            c->op[c->ops++].arg=i;
+        }
+        break;
+    }
+}
+
+
+/********* Search ***********/
+/// Keep the ADV_KEEP highest-scoring cases, highest first.
+static void adv_keep(struct adv_score_t *kept,int *count,const struct adv_score_t *s,int by_depth)
+{
+    int i=*count<ADV_KEEP?(*count)++:ADV_KEEP-1;
+    uint32_t score=by_depth?s->max_depth:s->worst_ns;
+    if (i==ADV_KEEP-1 && *count==ADV_KEEP && (by_depth?kept[i].max_depth:kept[i].worst_ns)>=score) return;
+    while (i>0 && (by_depth?kept[i-1].max_depth:kept[i-1].worst_ns)<score) {
+        kept[i]=kept[i-1];
+        i--;
+    }
+    kept[i]=*s;
+}
+
+/// Return the percent of adjacent registrations in ascending or descending ID order, whichever is more.
+static int adv_sortedness(const struct adv_case_t *c)
+{
+    int i, up=0, down=0;
+    if (c->tasks<2) return 100;
+    for (i=1;i<c->tasks;i++) {
+        if (c->task[i].ID>c->task[i-1].ID) up++;
+        else down++;
+    }
+    return 100*(up>down?up:down)/(c->tasks-1);
+}
+
+static void adv_report(const char *label,const struct adv_score_t *s)
+{
+    const struct adv_case_t *c=&s->c;
+    int i, unaffordable=0, retrying=0;
+    for (i=0;i<c->tasks;i++) {
+        if (c->task[i].battery>1000) unaffordable++;
+        if (c->task[i].kind==1) retrying++;
+    }
+    printf("  %s: %u ns %s", label,(unsigned int)s->worst_ns,
+        s->worst_op>=0?adv_op_names[c->op[s->worst_op].type]:"-");
+    if (s->worst_depth) printf(" (depth %d)",s->worst_depth);
+    printf(" at op %d of %d; %d tasks, %d%% sorted registration, max lookup depth %d, %d unaffordable, %d always RETRY\n",
+        s->worst_op,c->ops,c->tasks,adv_sortedness(c),s->max_depth,unaffordable,retrying);
+}
+
+int main(int argc,char *argv[])
+{
+    int evaluations=argc>1?atoi(argv[1]):600;
+    adv_random_state=argc>2?strtoull(argv[2],0,0):0x5EED;
+    if (adv_random_state==0) adv_random_state=1;
+    adv_runs=(struct adv_run_t *)mmap(0,ADV_REPEATS*sizeof(struct adv_run_t),
+        PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    if (adv_runs==MAP_FAILED) return 1;
+
+    static struct adv_score_t s, slow[ADV_KEEP], deep[ADV_KEEP], random_best;
+    int slow_count=0, deep_count=0, e;
+    random_best.worst_ns=0;
+
+    // Known trouble for reference: every task registered in ascending ID order
+    int i;
+    adv_random_case(&s.c);
+    s.c.tasks=ADV_TASKS_MAX;
+    for (i=0;i<ADV_TASKS_MAX;i++) {
+        s.c.task[i].ID=0x1000+i;
+        s.c.task[i].group=0; s.c.task[i].kind=0; s.c.task[i].perf_state=0; s.c.task[i].battery=0;
+    }
+    adv_evaluate(&s);
+    printf("adversary: %d evaluations, %d fresh runs each\n",evaluations,ADV_REPEATS);
+    adv_report("sorted IDs, for reference",&s);
+
+    double start=(double)adv_ns();
+    for (e=0;e<evaluations;e++) {
+        int fresh=e<evaluations/4 || adv_random()%8==0 || slow_count==0;
+        if (fresh) adv_random_case(&s.c);
+        else
+        { // mutate one of the worst cases found so far
+            if (adv_random()%2 || deep_count==0) s.c=slow[adv_random()%slow_count].c;
+            else s.c=deep[adv_random()%deep_count].c;
+            int m, changes=1+adv_random()%3;
+            for (m=0;m<changes;m++) adv_mutate(&s.c);
+        }
+        adv_evaluate(&s);
+        if (fresh && s.worst_ns>random_best.worst_ns) random_best=s;
+        adv_keep(slow,&slow_count,&s,0);
+        adv_keep(deep,&deep_count,&s,1);
+    }
+    double seconds=1.0e-9*(adv_ns()-start);
+
+    printf("adversary: searched for %.1f s\n",seconds);
+    adv_report("worst random case",&random_best);
+    for (i=0;i<slow_count;i++) {
+        char label[32];
+        snprintf(label,sizeof(label),"slowest #%d",i+1);
+        adv_report(label,&slow[i]);
+    }
+    adv_report("deepest lookup",&deep[0]);
+    return 0;
+}
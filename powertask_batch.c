@@ -0,0 +1,80 @@
+/**
+ Batch tasks: a task with a batch_function queues up several inputs,
+ then processes all of them in one call, amortizing the per-call
+ overhead and letting the task use SIMD across inputs.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <stdlib.h>
+#include "powertask_internal.h"
+
+/// Largest batch_max we'll run in one call (sizes the results array).
+#ifndef POWERTASK_BATCH_LIMIT
+#define POWERTASK_BATCH_LIMIT 1024
+#endif
+
+void powertask_batch_allocate(powertask_task_t *task)
+{
+    int i, max=task->attribute->batch_max;
+    if (task->batch_inputs) return;
+    if (max==0) max=1;
+    if (max>POWERTASK_BATCH_LIMIT) powertask_fatal("Task batch_max too big for POWERTASK_BATCH_LIMIT",task->attribute->ID);
+    DEBUGF(8,("  allocating batch of %d inputs\n",max));
+
+    task->batch_inputs=(powertask_telemetry_t **)calloc(max,sizeof(powertask_telemetry_t *));
+    task->batch_outputs=(powertask_telemetry_t **)calloc(max,sizeof(powertask_telemetry_t *));
+    for (i=0;i<max;i++) {
+        task->batch_inputs[i]=powertask_allocate_telemetry(task->attribute->input_length);
+        task->batch_outputs[i]=powertask_allocate_telemetry(task->attribute->output_length);
+    }
+    task->input=task->batch_inputs[0];
+    task->output=task->batch_outputs[0];
+}
+
+powertask_telemetry_t *powertask_batch_queue(powertask_task_t *task)
+{
+    int max=task->attribute->batch_max;
+    if (max==0) max=1;
+    powertask_batch_allocate(task);
+
+    if (task->batch_queued>=max) {
+        DEBUGF(2,("  batch of task %04x is full, replacing newest input\n",(int)task->attribute->ID));
+        return task->batch_inputs[max-1];
+    }
+    return task->batch_inputs[task->batch_queued++];
+}
+
+powertask_result_t powertask_batch_run(powertask_task_t *task)
+{
+    static powertask_result_t results[POWERTASK_BATCH_LIMIT];
+    int i, count=task->batch_queued, kept=0;
+
+    task->attribute->batch_function(count,
+        (const powertask_telemetry_t *const *)task->batch_inputs,
+        task->batch_outputs,results);
+
+    // Move inputs that need a retry to the front of the queue
+    for (i=0;i<count;i++) {
+        powertask_result_t result=results[i];
+        if (result!=POWERTASK_RESULT_RETRY && result!=POWERTASK_RESULT_OK
+         && (result<POWERTASK_RESULT_FAILURE || result>=POWERTASK_RESULT_LAST))
+            powertask_fatal("batch task returned invalid result code",result);
+        powertask_failure_record(task,result);
+        if (result==POWERTASK_RESULT_OK || result>=POWERTASK_RESULT_FAIL_OUTPUT)
+            powertask_downlink_output(task,task->batch_outputs[i],result);
+        if (result==POWERTASK_RESULT_RETRY) {
+            powertask_telemetry_t *in=task->batch_inputs[i], *out=task->batch_outputs[i];
+            task->batch_inputs[i]=task->batch_inputs[kept];
+            task->batch_outputs[i]=task->batch_outputs[kept];
+            task->batch_inputs[kept]=in;
+            task->batch_outputs[kept]=out;
+            kept++;
+        }
+    }
+    task->batch_queued=kept;
+    task->input=task->batch_inputs[0];
+    task->output=task->batch_outputs[0];
+
+    if (kept>0) return POWERTASK_RESULT_RETRY;
+    return POWERTASK_RESULT_OK;
+}
@@ -0,0 +1,1936 @@
+/**
+ Benchmarks for the powertask system.  Run with "make bench".
+
+ Each benchmark registers its own task IDs, since the powertask
+ registry lasts for the whole program.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "powertask.h"
+#include "powertask_workload.h"
+
+static int bench_failures=0; // checks that came out wrong: the exit status
+
+/// Count a failed check.  Returns "ok" (or "wrong") for printing.
+static const char *bench_check(int passed,const char *ok,const char *wrong)
+{
+    if (!passed) bench_failures++;
+    return passed?ok:wrong;
+}
+
+/// Return a wall-clock time in seconds, for timing benchmarks.
+static double bench_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+1.0e-9*ts.tv_nsec;
+}
+
+/// Run tasks until only the idle task is left.
+static void bench_drain(void)
+{
+    while (powertask_run_next()) {}
+}
+
+
+/********* Stored command sequences ***********/
+static powertask_result_t bench_sequence_step(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    return POWERTASK_RESULT_OK;
+}
+
+#define BENCH_SEQUENCE_STEPS 8
+static const powertask_attribute_t bench_sequence_attributes[BENCH_SEQUENCE_STEPS]={
+    {0x5E00,"SeqStep0",0,bench_sequence_step,4,0},
+    {0x5E01,"SeqStep1",0,bench_sequence_step,4,0},
+    {0x5E02,"SeqStep2",0,bench_sequence_step,4,0},
+    {0x5E03,"SeqStep3",0,bench_sequence_step,4,0},
+    {0x5E04,"SeqStep4",0,bench_sequence_step,4,0},
+    {0x5E05,"SeqStep5",0,bench_sequence_step,4,0},
+    {0x5E06,"SeqStep6",0,bench_sequence_step,4,0},
+    {0x5E07,"SeqStep7",0,bench_sequence_step,4,0},
+};
+
+static void bench_sequence(void)
+{
+    int i,rep,reps=100000;
+    powertask_data_t code[BENCH_SEQUENCE_STEPS*7+1];
+    int len=0;
+    for (i=0;i<BENCH_SEQUENCE_STEPS;i++) {
+        powertask_register(&bench_sequence_attributes[i]);
+        code[len++]=POWERTASK_SEQ_RUN;
+        code[len++]=0x5E;
+        code[len++]=i;
+        code[len++]=1; code[len++]=2; code[len++]=3; code[len++]=i; // input template
+    }
+    code[len++]=POWERTASK_SEQ_END;
+    if (!powertask_sequence_define(0x5E00,code,len)) {
+        printf("sequence: define failed!\n");
+        bench_failures++;
+        return;
+    }
+
+    double expand=0.0;
+    for (rep=0;rep<reps;rep++) {
+        double start=bench_seconds();
+        powertask_sequence_start(0x5E00);
+        expand+=bench_seconds()-start;
+        bench_drain();
+    }
+    printf("sequence: %d-step sequence expanded %d times: %.1f ns/step, %.2f million steps/sec\n",
+        BENCH_SEQUENCE_STEPS,reps,
+        1.0e9*expand/(reps*BENCH_SEQUENCE_STEPS),
+        1.0e-6*reps*BENCH_SEQUENCE_STEPS/expand);
+}
+
+
+/********* Time-tagged commands ***********/
+#define BENCH_TIMED_TASKS 4
+static powertask_time_t bench_timed_now=0; // simulated clock
+static uint32_t bench_timed_sum=0;
+
+/// Adds up its 2-byte input, taking 300 us of simulated time.
+static powertask_result_t bench_timed_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_timed_sum+=input->data[0]|(input->data[1]<<8);
+    bench_timed_now+=300;
+    powertask_set_time(bench_timed_now);
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_timed_attributes[BENCH_TIMED_TASKS]={
+    {0x5E10,"Timed0",0,bench_timed_task,2,0},
+    {0x5E11,"Timed1",0,bench_timed_task,2,0},
+    {0x5E12,"Timed2",0,bench_timed_task,2,0},
+    {0x5E13,"Timed3",0,bench_timed_task,2,0},
+};
+static const powertask_attribute_t bench_timed_shorter_attributes={
+    0x5E10,"Timed0",0,bench_timed_task,1,0 /* registered again with less input */
+};
+
+/// Commands tagged for random times in one simulated second, each run taking 
+///   300 us: every command must run once with its own input, however late.
+static void bench_timed(void)
+{
+    int i, count=2000;
+    uint32_t expected=0, r=12345;
+    for (i=0;i<BENCH_TIMED_TASKS;i++) powertask_register(&bench_timed_attributes[i]);
+    powertask_time_t start=powertask_get_time();
+    bench_timed_now=start;
+    powertask_timed_stats_t before=*powertask_timed_stats();
+    
+    double t0=bench_seconds();
+    for (i=0;i<count;i++) {
+        r=r*1103515245+12345;
+        powertask_telemetry_t *input=powertask_make_runnable_at(0x5E10+i%BENCH_TIMED_TASKS,start+(r>>8)%1000000);
+        input->data[0]=(i+1)&0xFF; input->data[1]=(i+1)>>8;
+        expected+=i+1;
+    }
+    double store=bench_seconds()-t0;
+    
+    t0=bench_seconds();
+    while (powertask_run_next() || powertask_timed_pending())
+    { // idle until the next command is due
+        if (powertask_timed_pending()) bench_timed_now+=100;
+        powertask_set_time(bench_timed_now);
+    }
+    double run=bench_seconds()-t0;
+    const powertask_timed_stats_t *st=powertask_timed_stats();
+    uint32_t started=st->started-before.started;
+    printf("timed: %d commands in 1 s, 300 us runs: %u released, inputs %s, %u waited for a busy task; "
+        "jitter mean %.1f ms, max %.1f ms; %.1f ns to store, %.1f ns to release and run\n",
+        count,(unsigned int)(st->released-before.released),bench_check(bench_timed_sum==expected,"ok","WRONG"),
+        (unsigned int)(st->waited-before.waited),
+        started?1.0e-3*(st->jitter_total-before.jitter_total)/started:0.0,1.0e-3*st->jitter_max,
+        1.0e9*store/count,1.0e9*run/count);
+    for (i=0;i<BENCH_TIMED_TASKS;i++) powertask_unregister(0x5E10+i);
+    
+    // A command stored for a task that comes back with a smaller input is dropped
+    uint32_t dropped=st->dropped, sum=bench_timed_sum;
+    powertask_register(&bench_timed_attributes[0]);
+    powertask_make_runnable_at(0x5E10,bench_timed_now)->data[0]=7;
+    powertask_unregister(0x5E10);
+    powertask_register(&bench_timed_shorter_attributes);
+    bench_drain();
+    printf("timed: command for a task registered again with less input: %s\n",
+        bench_check(st->dropped==dropped+1 && bench_timed_sum==sum,"dropped","NOT DROPPED"));
+    powertask_unregister(0x5E10);
+    powertask_set_time(start);
+}
+
+
+/********* Energy sharing between groups ***********/
+/// Simulated battery: each task function spends its energy from here.
+#define BENCH_PAYLOAD_GROUP 1
+#define BENCH_ADCS_GROUP 2
+#define BENCH_PAYLOAD_COST 50
+#define BENCH_ADCS_COST 5
+
+static int bench_fair_running=1; // tasks finish once this is cleared
+
+static void bench_spend(powertask_energy_t joules)
+{
+    powertask_energy_t battery=powertask_get_battery();
+    powertask_set_battery(battery>joules?battery-joules:0);
+}
+static powertask_result_t bench_payload(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_spend(BENCH_PAYLOAD_COST);
+    if (!bench_fair_running) return POWERTASK_RESULT_OK;
+    return POWERTASK_RESULT_RETRY; // always more to do
+}
+static powertask_result_t bench_adcs(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_spend(BENCH_ADCS_COST);
+    if (!bench_fair_running) return POWERTASK_RESULT_OK;
+    return POWERTASK_RESULT_RETRY;
+}
+static const powertask_attribute_t bench_fair_attributes[]={
+    {0x5F01,"Payload1",1000,bench_payload,0,0,BENCH_PAYLOAD_GROUP,BENCH_PAYLOAD_COST},
+    {0x5F02,"Payload2",1000,bench_payload,0,0,BENCH_PAYLOAD_GROUP,BENCH_PAYLOAD_COST},
+    {0x5F03,"Payload3",1000,bench_payload,0,0,BENCH_PAYLOAD_GROUP,BENCH_PAYLOAD_COST},
+    {0x5F04,"Payload4",1000,bench_payload,0,0,BENCH_PAYLOAD_GROUP,BENCH_PAYLOAD_COST},
+    {0x5F10,"ADCS",100,bench_adcs,0,0,BENCH_ADCS_GROUP,BENCH_ADCS_COST},
+};
+
+/// Simulate "steps" scheduler passes with this share of tickets,
+///   harvesting "income" Joules per pass, and report each group's energy.
+static void bench_fair_run(uint16_t payload_tickets,uint16_t adcs_tickets,int income,int steps)
+{
+    powertask_group_share(BENCH_PAYLOAD_GROUP,payload_tickets);
+    powertask_group_share(BENCH_ADCS_GROUP,adcs_tickets);
+    powertask_group_stats_t payload=*powertask_group_stats(BENCH_PAYLOAD_GROUP);
+    powertask_group_stats_t adcs=*powertask_group_stats(BENCH_ADCS_GROUP);
+    
+    int step;
+    double start=bench_seconds();
+    for (step=0;step<steps;step++) {
+        int battery=powertask_get_battery()+income;
+        if (battery>30000) battery=30000;
+        powertask_set_battery(battery);
+        powertask_run_next();
+    }
+    double elapsed=bench_seconds()-start;
+    
+    double payload_energy=powertask_group_stats(BENCH_PAYLOAD_GROUP)->energy-payload.energy;
+    double adcs_energy=powertask_group_stats(BENCH_ADCS_GROUP)->energy-adcs.energy;
+    double used=payload_energy+adcs_energy;
+    printf("fairshare: tickets %d:%d, income %d J/pass: payload %.1f%% ADCS %.1f%% of energy (ADCS ran %d times), utilization %.1f%%, %.1f ns/pass\n",
+        payload_tickets,adcs_tickets,income,
+        100.0*payload_energy/used,100.0*adcs_energy/used,
+        (int)(powertask_group_stats(BENCH_ADCS_GROUP)->runs-adcs.runs),
+        100.0*used/((double)income*steps),
+        1.0e9*elapsed/steps);
+}
+
+static void bench_fairshare(void)
+{
+    int i,n=sizeof(bench_fair_attributes)/sizeof(bench_fair_attributes[0]);
+    for (i=0;i<n;i++) {
+        powertask_register(&bench_fair_attributes[i]);
+        powertask_make_runnable(bench_fair_attributes[i].ID);
+    }
+    powertask_set_battery(0);
+    bench_fair_run(1,1,20,1000000);
+    bench_fair_run(3,1,20,1000000);
+    bench_fair_run(1,3,20,1000000);
+    
+    // Finish the tasks, and leave the battery full for the other benchmarks
+    bench_fair_running=0;
+    powertask_set_battery(30000);
+    bench_drain();
+}
+
+
+/********* Starvation prevention ***********/
+#define BENCH_CHEAP_COST 25
+#define BENCH_IMAGER_COST 4000
+static int bench_aging_running=1; // tasks finish once this is cleared
+
+static powertask_result_t bench_cheap(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_spend(BENCH_CHEAP_COST);
+    if (!bench_aging_running) return POWERTASK_RESULT_OK;
+    return POWERTASK_RESULT_RETRY;
+}
+static powertask_result_t bench_imager(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_spend(BENCH_IMAGER_COST);
+    if (!bench_aging_running) return POWERTASK_RESULT_OK;
+    return POWERTASK_RESULT_RETRY;
+}
+static const powertask_attribute_t bench_aging_attributes[]={
+    {0x5A01,"Cheap1",100,bench_cheap,0,0,3,BENCH_CHEAP_COST},
+    {0x5A02,"Cheap2",100,bench_cheap,0,0,3,BENCH_CHEAP_COST},
+    {0x5A03,"Cheap3",100,bench_cheap,0,0,3,BENCH_CHEAP_COST},
+    {0x5A10,"Imager",5000,bench_imager,0,0,4,BENCH_IMAGER_COST},
+};
+
+/// Cheap tasks want more energy than comes in, so without aging 
+///   the battery never climbs high enough for the imager.
+static void bench_aging(void)
+{
+    int i,n=sizeof(bench_aging_attributes)/sizeof(bench_aging_attributes[0]);
+    int step,steps=1000000,income=20;
+    for (i=0;i<n;i++) {
+        powertask_register(&bench_aging_attributes[i]);
+        powertask_make_runnable(bench_aging_attributes[i].ID);
+    }
+    powertask_set_battery(0);
+    for (step=0;step<steps;step++) {
+        powertask_set_time(step); // time is measured in passes here
+        int battery=powertask_get_battery()+income;
+        if (battery>30000) battery=30000;
+        powertask_set_battery(battery);
+        powertask_run_next();
+    }
+    
+    const powertask_task_stats_t *imager=powertask_task_stats(0x5A10);
+    const powertask_task_stats_t *cheap=powertask_task_stats(0x5A01);
+    printf("aging: imager ran %d times in %d passes, max wait %d passes, %d skips; cheap task ran %d times, held back %d times\n",
+        (int)imager->runs,steps,(int)imager->max_wait,(int)imager->skips,
+        (int)cheap->runs,(int)cheap->held);
+    
+    bench_aging_running=0;
+    powertask_set_battery(30000);
+    bench_drain();
+}
+
+
+/********* Result cache for deterministic tasks ***********/
+/// A coordinate-transform-like function that takes real work to compute.
+static powertask_result_t bench_transform(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    uint32_t x=input->data[0]|(input->data[1]<<8), i;
+    for (i=0;i<2000;i++) x=x*1103515245u+12345u;
+    output->data[0]=x; output->data[1]=x>>8; output->data[2]=x>>16; output->data[3]=x>>24;
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_memo_attributes[]={
+    {0x3E01,"Transform",0,bench_transform,2,4,0,10,0},
+    {0x3E02,"MemoTransform",0,bench_transform,2,4,0,10,POWERTASK_FLAG_DETERMINISTIC},
+};
+
+/// Run this transform task with inputs drawn from "distinct" values.
+static double bench_memo_run(powertask_ID_t ID,int distinct,int reps)
+{
+    int rep;
+    double start=bench_seconds();
+    for (rep=0;rep<reps;rep++) {
+        powertask_telemetry_t *in=powertask_make_runnable(ID);
+        in->data[0]=(rep*7)%distinct; in->data[1]=0;
+        bench_drain();
+    }
+    return (bench_seconds()-start)/reps;
+}
+
+static void bench_memo(void)
+{
+    int distinct,reps=200000;
+    powertask_register(&bench_memo_attributes[0]);
+    powertask_register(&bench_memo_attributes[1]);
+    for (distinct=8;distinct<=64;distinct*=2) {
+        powertask_memo_stats_t before=*powertask_memo_stats();
+        double plain=bench_memo_run(0x3E01,distinct,reps);
+        double memo=bench_memo_run(0x3E02,distinct,reps);
+        const powertask_memo_stats_t *after=powertask_memo_stats();
+        uint32_t hits=after->hits-before.hits, misses=after->misses-before.misses;
+        printf("memo: %d distinct inputs: hit rate %.1f%%, %d J saved, %.1f ns/run uncached vs %.1f ns/run cached\n",
+            distinct,100.0*hits/(hits+misses),(int)(after->energy_saved-before.energy_saved),
+            1.0e9*plain,1.0e9*memo);
+    }
+}
+
+
+/********* Batch task functions ***********/
+#define BENCH_BATCH_MAX 64
+
+/// Per-sample processing: scale and offset one float sample.
+static powertask_result_t bench_sample(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    const float *in=(const float *)input->data;
+    float *out=(float *)output->data;
+    out[0]=in[0]*0.25f+1.0f;
+    return POWERTASK_RESULT_OK;
+}
+/// The same processing on a whole batch: gather, compute in a vectorizable loop, scatter.
+static void bench_sample_batch(int count,
+    const powertask_telemetry_t *const *inputs,
+    powertask_telemetry_t *const *outputs,
+    powertask_result_t *results)
+{
+    float in[BENCH_BATCH_MAX], out[BENCH_BATCH_MAX];
+    int i;
+    for (i=0;i<count;i++) in[i]=*(const float *)inputs[i]->data;
+    for (i=0;i<count;i++) out[i]=in[i]*0.25f+1.0f;
+    for (i=0;i<count;i++) {
+        *(float *)outputs[i]->data=out[i];
+        results[i]=POWERTASK_RESULT_OK;
+    }
+}
+static const powertask_attribute_t bench_batch_attributes[]={
+    {0x5B01,"Sample",0,bench_sample,4,4},
+    {0x5B02,"SampleBatch",0,bench_sample,4,4,0,0,0,bench_sample_batch,BENCH_BATCH_MAX},
+};
+
+static void bench_batch(void)
+{
+    int i,rep,reps=20000;
+    powertask_register(&bench_batch_attributes[0]);
+    powertask_register(&bench_batch_attributes[1]);
+
+    double start=bench_seconds();
+    for (rep=0;rep<reps;rep++) 
+        for (i=0;i<BENCH_BATCH_MAX;i++) {
+            *(float *)powertask_make_runnable(0x5B01)->data=i;
+            bench_drain();
+        }
+    double single=bench_seconds()-start;
+
+    start=bench_seconds();
+    for (rep=0;rep<reps;rep++) {
+        for (i=0;i<BENCH_BATCH_MAX;i++)
+            *(float *)powertask_make_runnable(0x5B02)->data=i;
+        bench_drain();
+    }
+    double batched=bench_seconds()-start;
+
+    double n=(double)reps*BENCH_BATCH_MAX;
+    printf("batch: single %.2f million invocations/sec, batches of %d %.2f million invocations/sec\n",
+        1.0e-6*n/single,BENCH_BATCH_MAX,1.0e-6*n/batched);
+}
+
+
+/********* Streaming large outputs ***********/
+#define BENCH_STREAM_CHUNK 4096
+static uint32_t bench_stream_total=0; // bytes to stream
+static uint32_t bench_stream_sent=0;
+
+/// Reads out a large "image" one chunk per run.
+static powertask_result_t bench_stream(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    static powertask_data_t chunk[BENCH_STREAM_CHUNK];
+    chunk[0]=bench_stream_sent>>12; // stand-in for reading the sensor
+    bench_stream_sent+=BENCH_STREAM_CHUNK;
+    int final=bench_stream_sent>=bench_stream_total;
+    powertask_stream_write(chunk,BENCH_STREAM_CHUNK,final);
+    if (final) return POWERTASK_RESULT_OK;
+    return POWERTASK_RESULT_RETRY;
+}
+static const powertask_attribute_t bench_stream_attributes={
+    0x5C01,"StreamImage",0,bench_stream,0,0
+};
+
+static FILE *bench_archive=0;
+static void bench_archive_sink(const powertask_downlink_header_t *header,
+    const powertask_data_t *data)
+{
+    fwrite(header,sizeof(*header),1,bench_archive);
+    fwrite(data,1,header->length,bench_archive);
+}
+
+/// Stream "total" bytes, draining the RAM ring after each run if "drain" is set.
+static double bench_stream_run(uint32_t total,int drain)
+{
+    static powertask_data_t buf[BENCH_STREAM_CHUNK];
+    powertask_downlink_header_t h;
+    bench_stream_total=total;
+    bench_stream_sent=0;
+    powertask_make_runnable(0x5C01);
+    double start=bench_seconds();
+    while (powertask_run_next()) {
+        if (drain) while (powertask_downlink_read(&h,buf,sizeof(buf))) {}
+    }
+    if (drain) while (powertask_downlink_read(&h,buf,sizeof(buf))) {}
+    return bench_seconds()-start;
+}
+
+static void bench_streaming(void)
+{
+    uint32_t total=256*1024*1024;
+    powertask_register(&bench_stream_attributes);
+
+    double ring=bench_stream_run(total,1);
+    printf("stream: %d MB in %d byte chunks through the RAM ring: %.0f MB/s\n",
+        (int)(total>>20),BENCH_STREAM_CHUNK,1.0e-6*total/ring);
+
+    bench_archive=tmpfile();
+    if (bench_archive) {
+        powertask_downlink_set_sink(bench_archive_sink);
+        double file=bench_stream_run(total,0);
+        fflush(bench_archive);
+        printf("stream: %d MB in %d byte chunks into a file archive: %.0f MB/s\n",
+            (int)(total>>20),BENCH_STREAM_CHUNK,1.0e-6*total/file);
+        powertask_downlink_set_sink(0);
+        fclose(bench_archive);
+    }
+}
+
+
+/********* Memory-mapped region inputs ***********/
+static uint32_t bench_region_sum=0;
+
+/// Sums a big uplinked table, reading it in place.
+static powertask_result_t bench_region_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    uint32_t i,length,sum=0;
+    const powertask_data_t *data=(const powertask_data_t *)powertask_region_data(input,&length);
+    for (i=0;i<length;i++) sum+=data[i];
+    bench_region_sum=sum;
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_region_attributes={
+    0x5D01,"SumTable",0,bench_region_task,sizeof(powertask_region_t),0,0,0,POWERTASK_FLAG_REGION_INPUT
+};
+
+static void bench_region(void)
+{
+    uint32_t i,length=64*1024*1024;
+    const char *path="powertask_bench_table.bin";
+    powertask_data_t *table=(powertask_data_t *)malloc(length);
+    for (i=0;i<length;i++) table[i]=i*7+(i>>13);
+    FILE *f=fopen(path,"wb");
+    if (f==0 || fwrite(table,1,length,f)!=length) {
+        printf("region: can't write %s\n",path);
+        bench_failures++;
+        if (f) fclose(f);
+        free(table);
+        return;
+    }
+    fclose(f);
+    uint32_t crc=powertask_crc32(table,length);
+    free(table);
+    powertask_register(&bench_region_attributes);
+    if (!powertask_store_map_file(0,path)) {
+        printf("region: can't map %s\n",path);
+        bench_failures++;
+        return;
+    }
+
+    // Old way: copy the whole table into a RAM input buffer first
+    double start=bench_seconds();
+    powertask_data_t *copy=(powertask_data_t *)malloc(length);
+    f=fopen(path,"rb");
+    if (f==0 || fread(copy,1,length,f)!=length) printf("region: can't read %s\n",path);
+    if (f) fclose(f);
+    double copy_time=bench_seconds()-start;
+    free(copy);
+
+    // New way: read in place
+    start=bench_seconds();
+    powertask_make_runnable_region(0x5D01,0,0,length,0);
+    bench_drain();
+    double inplace=bench_seconds()-start;
+
+    start=bench_seconds();
+    powertask_make_runnable_region(0x5D01,0,0,length,crc);
+    bench_drain();
+    double checked=bench_seconds()-start;
+
+    printf("region: %d MB table: copying it in costs %.1f ms and %d MB of RAM; in place the task runs in %.1f ms (%.1f ms with CRC check) using no extra RAM (sum %08x)\n",
+        (int)(length>>20),1.0e3*copy_time,(int)(length>>20),1.0e3*inplace,1.0e3*checked,
+        bench_region_sum);
+    remove(path);
+}
+
+
+/********* Shared inputs ***********/
+#define BENCH_CONSUMERS 1000
+#define BENCH_TARGET_BYTES 4096
+static uint32_t bench_consumer_sum=0;
+
+/// Each consumer looks at one entry of the target list.
+static powertask_result_t bench_consumer(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_consumer_sum+=input->data[(bench_consumer_sum+1)%input->header.length];
+    return POWERTASK_RESULT_OK;
+}
+static powertask_attribute_t bench_copy_consumers[BENCH_CONSUMERS];
+static powertask_attribute_t bench_shared_consumers[BENCH_CONSUMERS];
+
+/// Return i with its low 10 bits reversed, so IDs register in a balanced order.
+static int bench_bit_reverse(int i)
+{
+    int r=0,b;
+    for (b=0;b<10;b++) if (i&(1<<b)) r|=1<<(9-b);
+    return r;
+}
+
+/// Records its first input byte, and fails if it's 0xFF.
+static int bench_held_shared_seen=-1;
+static powertask_result_t bench_held_shared(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_held_shared_seen=input->data[0];
+    return input->data[0]==0xFF?POWERTASK_RESULT_FAIL_QUIET+1:POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_held_shared_attributes={
+    0x6800,"HeldShared",0,bench_held_shared,4,0
+};
+
+/// A shared input given to a task in hold-off must still reach it when the hold-off ends.
+static void bench_shared_held(void)
+{
+    powertask_failure_policy_t holdoff={1000,1000,0,0};
+    powertask_failure_policy(&holdoff);
+    powertask_register(&bench_held_shared_attributes);
+    powertask_make_runnable(0x6800)->data[0]=0xFF;
+    bench_drain(); // fails: the next command is delayed
+    powertask_shared_t *s=powertask_shared_create(4);
+    powertask_shared_telemetry(s)->data[0]=42;
+    powertask_make_runnable_shared(0x6800,s);
+    powertask_shared_release(s);
+    int in_use=powertask_shared_stats()->in_use;
+    powertask_time_t now=powertask_get_time();
+    powertask_set_time(now+1000);
+    bench_drain();
+    printf("shared: held off task ran the delayed shared input with %d (%s), %d buffers in use while delayed\n",
+        bench_held_shared_seen,bench_check(bench_held_shared_seen==42,"ok","WRONG"),in_use);
+    powertask_unregister(0x6800);
+    powertask_set_time(now);
+    powertask_failure_policy_t standard={0,3600000000ull,8,1};
+    powertask_failure_policy(&standard);
+}
+
+static void bench_shared(void)
+{
+    static powertask_data_t targets[BENCH_TARGET_BYTES];
+    int i,j,rep,reps=200;
+    for (i=0;i<BENCH_TARGET_BYTES;i++) targets[i]=i*13;
+    for (j=0;j<1024;j++) {
+        i=bench_bit_reverse(j);
+        if (i>=BENCH_CONSUMERS) continue;
+        powertask_attribute_t copy={0x6000+i,"CopyConsumer",0,bench_consumer,BENCH_TARGET_BYTES,0};
+        bench_copy_consumers[i]=copy;
+        powertask_register(&bench_copy_consumers[i]);
+        powertask_attribute_t shared={0x6400+i,"SharedConsumer",0,bench_consumer,0,0};
+        bench_shared_consumers[i]=shared;
+        powertask_register(&bench_shared_consumers[i]);
+    }
+
+    double copy_time=0.0, shared_time=0.0;
+    for (rep=0;rep<reps;rep++) {
+        double start=bench_seconds();
+        for (i=0;i<BENCH_CONSUMERS;i++)
+            memcpy(powertask_make_runnable(0x6000+i)->data,targets,BENCH_TARGET_BYTES);
+        copy_time+=bench_seconds()-start;
+        bench_drain();
+
+        start=bench_seconds();
+        powertask_shared_t *s=powertask_shared_create(BENCH_TARGET_BYTES);
+        memcpy(powertask_shared_telemetry(s)->data,targets,BENCH_TARGET_BYTES);
+        for (i=0;i<BENCH_CONSUMERS;i++)
+            powertask_make_runnable_shared(0x6400+i,s);
+        powertask_shared_release(s);
+        shared_time+=bench_seconds()-start;
+        bench_drain();
+    }
+    printf("shared: fan-out of a %d byte dataset to %d tasks: copies take %.1f us and %d KB of input buffers; shared takes %.1f us and %d KB (%d buffers in use after, sum %d)\n",
+        BENCH_TARGET_BYTES,BENCH_CONSUMERS,
+        1.0e6*copy_time/reps,BENCH_CONSUMERS*BENCH_TARGET_BYTES/1024,
+        1.0e6*shared_time/reps,BENCH_TARGET_BYTES/1024,
+        (int)powertask_shared_stats()->in_use,(int)bench_consumer_sum);
+    for (i=0;i<BENCH_CONSUMERS;i++) powertask_unregister(0x6000+i); // too big for hold-off
+    bench_shared_held();
+}
+
+/********* Buffered inputs ***********/
+static int bench_buffered_runs[2];
+
+/// Each command's first byte says which task it's for; count how many get run.
+static powertask_result_t bench_buffered_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_buffered_runs[input->data[0]]++;
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_single_attributes={
+    0x5D10,"SingleBuffered",0,bench_buffered_task,4,0, 0,0,0,0,0, 1
+};
+static const powertask_attribute_t bench_depth_attributes={
+    0x5D11,"DepthBuffered",0,bench_buffered_task,4,0, 0,0,0,0,0, 4
+};
+
+/// Uplink passes deliver bursts of commands faster than one run per pass.
+static void bench_buffered(void)
+{
+    powertask_register(&bench_single_attributes);
+    powertask_register(&bench_depth_attributes);
+    int pass,c,t,burst=3,passes=30000,sent=0;
+    double start=bench_seconds();
+    for (pass=0;pass<passes;pass++) {
+        if (pass%(burst+1)==0) {
+            for (c=0;c<burst;c++) {
+                for (t=0;t<2;t++)
+                    powertask_make_runnable(t?0x5D11:0x5D10)->data[0]=t;
+                sent++;
+            }
+        }
+        powertask_run_next(); // one run for each task per pass
+        powertask_run_next();
+    }
+    bench_drain();
+    double elapsed=bench_seconds()-start;
+    printf("buffered: %d uplink commands in bursts of %d: single buffer runs %d (%d lost), depth 4 runs %d (%d lost), %.1f ns per run\n",
+        sent,burst,bench_buffered_runs[0],sent-bench_buffered_runs[0],
+        bench_buffered_runs[1],sent-bench_buffered_runs[1],
+        1.0e9*elapsed/(bench_buffered_runs[0]+bench_buffered_runs[1]));
+}
+
+/********* Completion handles ***********/
+static int bench_completions=0;
+static void bench_completed(powertask_handle_t handle,powertask_result_t result,
+    const powertask_telemetry_t *output,void *context)
+{
+    if (result==POWERTASK_RESULT_OK) bench_completions++;
+}
+
+/// Fails when input byte 0 is nonzero.
+static powertask_result_t bench_fail_if(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    return input->data[0]?POWERTASK_RESULT_FAIL_QUIET+1:POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_held_attributes={
+    0x5D12,"HeldOff",0,bench_fail_if,1,0
+};
+
+/// A sequencer runs commands one after another, waiting for each to finish.
+static void bench_handles(void)
+{
+    int i,steps=100000;
+    double start=bench_seconds();
+    for (i=0;i<steps;i++) {
+        powertask_make_runnable(0x5D10)->data[0]=0;
+        while (powertask_run_next()) {}
+    }
+    double plain=bench_seconds()-start;
+
+    start=bench_seconds();
+    for (i=0;i<steps;i++) {
+        powertask_telemetry_t *input;
+        powertask_handle_t h=powertask_submit(0x5D10,&input);
+        input->data[0]=0;
+        powertask_on_complete(h,bench_completed,0);
+        powertask_wait(h,(powertask_time_t)-1);
+        powertask_handle_release(h);
+    }
+    double handles=bench_seconds()-start;
+    printf("handles: %d sequenced commands: run loop %.1f ns each, submit/callback/wait %.1f ns each (%d callbacks)\n",
+        steps,1.0e9*plain/steps,1.0e9*handles/steps,bench_completions);
+
+    // Under the manual clock, a command delayed by hold-off never comes due
+    powertask_failure_policy_t holdoff={1000,1000,0,0};
+    powertask_failure_policy(&holdoff);
+    powertask_register(&bench_held_attributes);
+    powertask_telemetry_t *input;
+    powertask_handle_t h=powertask_submit(0x5D12,&input);
+    input->data[0]=1;
+    powertask_result_t failed=powertask_wait(h,(powertask_time_t)-1);
+    powertask_handle_release(h);
+    h=powertask_submit(0x5D12,&input);
+    input->data[0]=0;
+    powertask_result_t stalled=powertask_wait(h,(powertask_time_t)-1);
+    powertask_time_t now=powertask_get_time();
+    powertask_set_time(now+1000);
+    powertask_result_t later=powertask_wait(h,(powertask_time_t)-1);
+    powertask_handle_release(h);
+    printf("handles: after a failure (%s), waiting on the held-off command under the manual clock is %s, then %s once time passes\n",
+        bench_check(failed>=POWERTASK_RESULT_FAILURE,"failed","NOT FAILED"),
+        bench_check(stalled==POWERTASK_HANDLE_PENDING,"pending","NOT PENDING"),
+        bench_check(later==POWERTASK_RESULT_OK,"ok","NOT OK"));
+    powertask_unregister(0x5D12);
+    powertask_set_time(now);
+    powertask_failure_policy_t standard={0,3600000000ull,8,1};
+    powertask_failure_policy(&standard);
+}
+
+/********* Failure hold-off and quarantine ***********/
+static int bench_broken=1;
+static int bench_broken_runs=0;
+
+/// Fails while bench_broken is set.
+static powertask_result_t bench_broken_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_broken_runs++;
+    return bench_broken?POWERTASK_RESULT_FAIL_QUIET+0x0B:POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_broken_attributes={
+    0x5D20,"Broken",0,bench_broken_task,2,0
+};
+
+/// Command the broken task every 100 us for 100 ms, starting at time "start".
+///   Returns how many times it ran.  It stays registered.
+static int bench_broken_commands(const powertask_failure_policy_t *policy,powertask_time_t start)
+{
+    int step;
+    powertask_failure_policy(policy);
+    powertask_unregister(0x5D20); // start with a clean failure count
+    powertask_register(&bench_broken_attributes);
+    bench_broken_runs=0;
+    for (step=0;step<1000;step++) {
+        powertask_set_time(start+step*100ull);
+        powertask_make_runnable(0x5D20);
+        bench_drain();
+    }
+    return bench_broken_runs;
+}
+
+/// A broken task is commanded over and over: hold-off and quarantine 
+///   stop it wasting energy, and a mode change lets it run again.
+static void bench_failure(void)
+{
+    powertask_failure_event_t events[POWERTASK_FAILURE_EVENTS];
+    powertask_time_t start=powertask_get_time();
+    while (powertask_failure_events(events,POWERTASK_FAILURE_EVENTS)) {} // old events
+    
+    powertask_failure_policy_t none={0,0,0,0};
+    int plain=bench_broken_commands(&none,start);
+    powertask_failure_policy_t policy={1000,8000,6,1};
+    int held=bench_broken_commands(&policy,start);
+    const powertask_failure_stats_t *f=powertask_failure_stats(0x5D20);
+    uint32_t blocked=f->blocked;
+    int quarantined=f->quarantined;
+    int n=powertask_failure_events(events,POWERTASK_FAILURE_EVENTS);
+    double quarantine_ms=n>0?(events[0].time-start)*1.0e-3:-1.0;
+    
+    // The fault clears and the mode changes: it runs again
+    bench_broken=0;
+    powertask_set_mode(1);
+    bench_broken_runs=0;
+    powertask_make_runnable(0x5D20);
+    bench_drain();
+    printf("failure: broken task commanded 1000 times in 100 ms: ran %d times without hold-off, %d times with 1-8 ms hold-off "
+        "(%u commands blocked, %s after %.1f ms); after a mode change it ran %d time%s and its failure count is %d\n",
+        plain,held,(unsigned int)blocked,bench_check(quarantined && held<plain,"quarantined","NOT QUARANTINED"),quarantine_ms,
+        bench_broken_runs,bench_broken_runs==1?"":"s",(int)powertask_failure_stats(0x5D20)->consecutive);
+    
+    powertask_unregister(0x5D20);
+    powertask_set_mode(0);
+    powertask_set_time(start);
+    powertask_failure_policy_t standard={0,3600000000ull,8,1};
+    powertask_failure_policy(&standard);
+}
+
+/********* Unregistration and module hot swap ***********/
+static int bench_versions[3];
+static void bench_version_done(powertask_handle_t handle,powertask_result_t result,
+    const powertask_telemetry_t *output,void *context)
+{
+    if (output && output->data[0]<3) bench_versions[output->data[0]]++;
+}
+
+/// Unregister the task whose ID is in input bytes 0-1, from inside a run.
+static powertask_result_t bench_unregister_other(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    powertask_unregister((input->data[0]<<8)|input->data[1]);
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_unregister_attributes[]={
+    {0x6C01,"Starved",1000,bench_consumer,0,0,0}, /* group 0, skipped for battery */
+    {0x6C02,"Unregister",0,bench_unregister_other,2,0,1},
+    {0x6C03,"SlowClock",0,bench_consumer,0,0,2,0,0,0,0,0,POWERTASK_PERF_LOW},
+    {0x6C04,"Unregister",0,bench_unregister_other,2,0,2,0,0,0,0,0,POWERTASK_PERF_HIGH}
+};
+
+/// A task unregisters a task run_next skipped, then one it ran ahead of:
+///   the scheduler must not touch either afterwards.
+static void bench_unregister_running(void)
+{
+    int i;
+    powertask_energy_t battery=powertask_get_battery();
+    for (i=0;i<4;i++) powertask_register(&bench_unregister_attributes[i]);
+    powertask_set_battery(10);
+    powertask_make_runnable(0x6C01);
+    powertask_telemetry_t *input=powertask_make_runnable(0x6C02);
+    input->data[0]=0x6C; input->data[1]=0x01;
+    powertask_run_next(); // skips Starved, then unregisters it: group 0 is now empty
+    powertask_run_next();
+    
+    input=powertask_make_runnable(0x6C04); // runs at the high state
+    input->data[0]=0; input->data[1]=0;
+    bench_drain();
+    input=powertask_make_runnable(0x6C04);
+    input->data[0]=0x6C; input->data[1]=0x03;
+    powertask_make_runnable(0x6C03); // the group's front, but it needs a switch
+    bench_drain();
+    printf("modules: unregistering skipped and bypassed tasks from a run: %s\n",
+        bench_check(!powertask_task_lookup(0x6C01) && !powertask_task_lookup(0x6C03),"ok","NOT UNREGISTERED"));
+    powertask_unregister(0x6C02);
+    powertask_unregister(0x6C04);
+    powertask_set_battery(battery);
+}
+
+static void bench_modules(void)
+{
+    int i,j,count=1000;
+    static powertask_attribute_t churn[1024];
+    double start=bench_seconds();
+    for (j=0;j<1024;j++) {
+        i=bench_bit_reverse(j);
+        powertask_attribute_t a={0x6800+i,"Churn",0,bench_consumer,0,0};
+        churn[i]=a;
+        powertask_register(&churn[i]);
+        if (i<count) powertask_make_runnable(0x6800+i);
+    }
+    double reg=bench_seconds()-start;
+    start=bench_seconds();
+    for (j=0;j<1024;j++) powertask_unregister(0x6800+bench_bit_reverse(j));
+    double unreg=bench_seconds()-start;
+    printf("modules: 1024 tasks register in %.1f ns each, unregister (dropping queued work) in %.1f ns each, %d left queued\n",
+        1.0e9*reg/1024,1.0e9*unreg/1024,powertask_run_next());
+    bench_unregister_running();
+
+    // Queue work for version 1, swap in version 2 with commands still staged
+    if (powertask_module_load("example","./example_module_v1.so")<0) {
+        printf("modules: can't load ./example_module_v1.so (run \"make bench\")\n");
+        bench_failures++;
+        return;
+    }
+    for (i=0;i<4;i++) {
+        powertask_telemetry_t *input;
+        powertask_on_complete(powertask_submit(0x5E20,&input),bench_version_done,0);
+    }
+    powertask_run_next(); // version 1 runs one command
+    start=bench_seconds();
+    int loaded=powertask_module_load("example","./example_module_v2.so");
+    double swap=bench_seconds()-start;
+    bench_drain();
+    powertask_module_unload("example");
+    printf("modules: hot swap of %d task in %.1f us: %d commands ran on version 1, %d on version 2, 0x5E20 %s after unload\n",
+        loaded,1.0e6*swap,bench_versions[1],bench_versions[2],
+        bench_check(!powertask_task_lookup(0x5E20),"unregistered","STILL REGISTERED"));
+}
+
+/********* Authenticated uplink ***********/
+#define BENCH_UPLINK_TASKS 8
+#define BENCH_UPLINK_INPUT 12
+static powertask_attribute_t bench_uplink_tasks[BENCH_UPLINK_TASKS];
+static const uint8_t bench_uplink_key[16]={1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16};
+
+/// Build an uplink frame of commands for the bench tasks.  Returns its length.
+static int bench_uplink_frame(powertask_data_t *f,uint32_t sequence,int commands)
+{
+    int i=0,c,k,length=commands*(2+BENCH_UPLINK_INPUT);
+    f[i++]=POWERTASK_UPLINK_SYNC>>8; f[i++]=POWERTASK_UPLINK_SYNC&0xFF;
+    f[i++]=length>>8; f[i++]=length;
+    f[i++]=sequence>>24; f[i++]=sequence>>16; f[i++]=sequence>>8; f[i++]=sequence;
+    for (c=0;c<commands;c++) {
+        f[i++]=0x5D; f[i++]=0x20+c%BENCH_UPLINK_TASKS;
+        for (k=0;k<BENCH_UPLINK_INPUT;k++) f[i++]=c+k;
+    }
+    uint64_t mac=powertask_siphash(bench_uplink_key,f+2,i-2);
+    for (k=7;k>=0;k--) f[i++]=mac>>(8*k);
+    return i;
+}
+
+/// The old way: buffer the whole frame, check its MAC, then decode it.
+static int bench_uplink_two_pass(const powertask_data_t *received,int length,int chunk)
+{
+    static powertask_data_t frame[2048];
+    int i,n=0;
+    for (i=0;i<length;i+=chunk) // bytes arrive from the radio
+        memcpy(frame+i,received+i,(length-i<chunk)?length-i:chunk);
+    int end=length-8;
+    uint64_t mac=0;
+    for (i=end;i<length;i++) mac=(mac<<8)|frame[i];
+    if (mac!=powertask_siphash(bench_uplink_key,frame+2,end-2)) return 0;
+    for (i=8;i<end;) {
+        powertask_ID_t ID=(frame[i]<<8)|frame[i+1];
+        powertask_telemetry_t *input=powertask_make_runnable(ID);
+        memcpy(input->data,frame+i+2,input->header.length);
+        i+=2+input->header.length;
+        n++;
+    }
+    return n;
+}
+
+static void bench_uplink(void)
+{
+    int i,rep,reps=4096,commands=60,chunk=64;
+    for (i=0;i<BENCH_UPLINK_TASKS;i++) {
+        powertask_attribute_t a={0x5D20+i,"UplinkTarget",0,bench_consumer,BENCH_UPLINK_INPUT,0};
+        bench_uplink_tasks[i]=a;
+        powertask_register(&bench_uplink_tasks[i]);
+    }
+    powertask_uplink_set_key(bench_uplink_key);
+    
+    // Frames as received, each with its own sequence number
+    static powertask_data_t frames[4096][1024];
+    int length=0;
+    for (rep=0;rep<reps;rep++) length=bench_uplink_frame(frames[rep],rep+1,commands);
+
+    int sent=0;
+    double start=bench_seconds();
+    for (rep=0;rep<reps;rep++) sent+=bench_uplink_two_pass(frames[rep],length,chunk);
+    double two_pass=bench_seconds()-start;
+    bench_drain();
+
+    int dispatched=0;
+    start=bench_seconds();
+    for (rep=0;rep<reps;rep++)
+        for (i=0;i<length;i+=chunk)
+            dispatched+=powertask_uplink_receive(frames[rep]+i,(length-i<chunk)?length-i:chunk);
+    double one_pass=bench_seconds()-start;
+    bench_drain();
+
+    // A replayed and a forged frame
+    powertask_uplink_receive(frames[0],length);
+    frames[1][20]^=1;
+    bench_uplink_frame(frames[1],reps+1,commands);
+    frames[1][20]^=1;
+    powertask_uplink_receive(frames[1],length);
+    const powertask_uplink_stats_t *st=powertask_uplink_stats();
+    printf("uplink: %d byte frames of %d commands: verify then decode %.2f M commands/s, one pass %.2f M commands/s (%d vs %d sent; %d replayed, %d forged rejected) %s\n",
+        length,commands,1.0e-6*sent/two_pass,1.0e-6*dispatched/one_pass,sent,dispatched,
+        (int)st->replayed,(int)st->bad_mac,bench_check(sent==dispatched && st->replayed==1 && st->bad_mac==1,"ok","WRONG"));
+}
+
+/********* Duplicate command suppression ***********/
+static int bench_dedupe_runs=0;
+static powertask_result_t bench_dedupe_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_dedupe_runs++;
+    return POWERTASK_RESULT_OK;
+}
+static powertask_attribute_t bench_dedupe_tasks[BENCH_UPLINK_TASKS];
+
+/// Simulate marginal passes: frames and acks are each lost 30% of the time,
+///  and ground resends unacknowledged commands in a new frame.
+static int bench_dedupe_pass(int sequenced,int commands,int per_frame,uint32_t *frame_sequence)
+{
+    static powertask_data_t f[1024];
+    uint32_t random=12345;
+    int sent=0,frames=0,c,k;
+    bench_dedupe_runs=0;
+    while (sent<commands) {
+        int i=0, length=per_frame*((sequenced?6:2)+BENCH_UPLINK_INPUT);
+        uint16_t sync=sequenced?POWERTASK_UPLINK_SYNC_SEQUENCED:POWERTASK_UPLINK_SYNC;
+        uint32_t seq=++*frame_sequence;
+        f[i++]=sync>>8; f[i++]=sync&0xFF;
+        f[i++]=length>>8; f[i++]=length;
+        f[i++]=seq>>24; f[i++]=seq>>16; f[i++]=seq>>8; f[i++]=seq;
+        for (c=0;c<per_frame;c++) {
+            uint32_t command=sent+c;
+            f[i++]=0x5D; f[i++]=0x30+command%BENCH_UPLINK_TASKS;
+            if (sequenced) { f[i++]=command>>24; f[i++]=command>>16; f[i++]=command>>8; f[i++]=command; }
+            for (k=0;k<BENCH_UPLINK_INPUT;k++) f[i++]=command+k;
+        }
+        uint64_t mac=sequenced?powertask_siphash(bench_uplink_key,f,i):powertask_siphash(bench_uplink_key,f+2,i-2);
+        for (k=7;k>=0;k--) f[i++]=mac>>(8*k);
+        frames++;
+
+        random=random*1103515245u+12345u;
+        int frame_lost=((random>>16)%10)<3;
+        random=random*1103515245u+12345u;
+        int ack_lost=((random>>16)%10)<3;
+        if (!frame_lost) {
+            powertask_uplink_receive(f,i);
+            bench_drain();
+        }
+        if (!frame_lost && !ack_lost) sent+=per_frame; // ground moves on
+    }
+    return frames;
+}
+
+static void bench_dedupe(void)
+{
+    int i, commands=20000, per_frame=20;
+    for (i=0;i<BENCH_UPLINK_TASKS;i++) {
+        powertask_attribute_t a={0x5D30+i,"DedupeTarget",0,bench_dedupe_task,BENCH_UPLINK_INPUT,0,
+            0, 5, 0,0,0, 4}; // 5 Joules per run
+        bench_dedupe_tasks[i]=a;
+        powertask_register(&bench_dedupe_tasks[i]);
+    }
+    uint32_t frame_sequence=0x100000; // past the uplink bench's frames
+    int frames=bench_dedupe_pass(0,commands,per_frame,&frame_sequence);
+    int plain_runs=bench_dedupe_runs;
+    bench_dedupe_pass(1,commands,per_frame,&frame_sequence);
+    int sequenced_runs=bench_dedupe_runs;
+    const powertask_dedupe_stats_t *st=powertask_dedupe_stats();
+    printf("dedupe: %d commands in %d frames over a lossy link: %d runs without sequence numbers, %d with (%d duplicates suppressed, %d J saved)\n",
+        commands,frames,plain_runs,sequenced_runs,(int)st->suppressed,(int)st->energy_saved);
+    
+    // A fresh task's window takes its first sequence number wherever the counter starts
+    static const powertask_attribute_t late={0x5D38,"DedupeLate",0,bench_dedupe_task,BENCH_UPLINK_INPUT,0};
+    powertask_register(&late);
+    bench_dedupe_runs=0;
+    uint32_t sequences[4]={0x80000000u,0x80000001u,0x80000001u,0x80000002u};
+    for (i=0;i<4;i++) {
+        if (powertask_make_runnable_sequenced(0x5D38,sequences[i])) bench_drain();
+    }
+    printf("dedupe: counter starting at 0x80000000: %d of 4 commands ran (%s)\n",
+        bench_dedupe_runs,bench_check(bench_dedupe_runs==3,"ok","WRONG"));
+    powertask_unregister(0x5D38);
+}
+
+/********* CPU performance state hints ***********/
+/// Simulated board: while a task runs the rest of the board draws BENCH_PERF_BOARD_W,
+///   and the CPU draws BENCH_PERF_CPU_W at top clock, falling with the cube of clock
+///   (voltage scales with frequency).  A switch stalls for BENCH_PERF_SWITCH_S.
+#define BENCH_PERF_BOARD_W 1.5
+#define BENCH_PERF_CPU_W 2.0
+#define BENCH_PERF_SWITCH_S 100.0e-6
+#define BENCH_PERF_CYCLES 20.0e6 /* cycles in one compute-bound run */
+#define BENCH_PERF_IO_S 10.0e-3 /* seconds waiting in one I/O-bound run */
+#define BENCH_PERF_TASKS 16 /* half compute-bound, half I/O-bound */
+#define BENCH_PERF_RUNS 100 /* runs of each task */
+static const uint32_t bench_perf_khz[POWERTASK_PERF_STATES]={400000,800000,1200000,1600000};
+static uint8_t bench_perf_state=POWERTASK_PERF_HIGH;
+static double bench_perf_energy[2]; // Joules used by compute-bound and I/O-bound runs
+static double bench_perf_switch_energy;
+static int bench_perf_left[BENCH_PERF_TASKS];
+
+static double bench_perf_power(void)
+{
+    double f=bench_perf_khz[bench_perf_state-1]/(double)bench_perf_khz[POWERTASK_PERF_HIGH-1];
+    return BENCH_PERF_BOARD_W+BENCH_PERF_CPU_W*f*f*f;
+}
+static void bench_perf_hook(uint8_t state)
+{
+    bench_perf_state=state;
+    bench_perf_switch_energy+=bench_perf_power()*BENCH_PERF_SWITCH_S;
+}
+
+/// Input byte 0 is the task number: even tasks compute, odd tasks wait for I/O.
+static powertask_result_t bench_perf_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    int t=input->data[0], io=t&1;
+    double seconds=io?BENCH_PERF_IO_S:BENCH_PERF_CYCLES/(1000.0*bench_perf_khz[bench_perf_state-1]);
+    bench_perf_energy[io]+=bench_perf_power()*seconds;
+    if (--bench_perf_left[t]>0) return POWERTASK_RESULT_RETRY;
+    return POWERTASK_RESULT_OK;
+}
+static powertask_attribute_t bench_perf_attributes[4][BENCH_PERF_TASKS];
+
+/// Run every task BENCH_PERF_RUNS times using these attributes, and report energy.
+static void bench_perf_run(const char *policy,int version,uint8_t batch)
+{
+    int t;
+    for (t=0;t<BENCH_PERF_TASKS;t++) {
+        powertask_replace(&bench_perf_attributes[version][t]);
+        bench_perf_left[t]=BENCH_PERF_RUNS;
+        powertask_make_runnable(0x7E00+t)->data[0]=t;
+    }
+    powertask_perf_batch(batch);
+    bench_perf_energy[0]=bench_perf_energy[1]=bench_perf_switch_energy=0;
+    uint32_t switches=powertask_perf_stats()->switches;
+    bench_drain();
+    int runs=BENCH_PERF_RUNS*BENCH_PERF_TASKS/2;
+    printf("perf: %-22s compute %.1f mJ/run, I/O %.1f mJ/run, %5d switches (%.0f mJ), total %.2f J\n",
+        policy,1.0e3*bench_perf_energy[0]/runs,1.0e3*bench_perf_energy[1]/runs,
+        (int)(powertask_perf_stats()->switches-switches),1.0e3*bench_perf_switch_energy,
+        bench_perf_energy[0]+bench_perf_energy[1]+bench_perf_switch_energy);
+}
+
+static void bench_perf(void)
+{
+    int v,t;
+    for (v=0;v<4;v++) for (t=0;t<BENCH_PERF_TASKS;t++) {
+        uint8_t hint=POWERTASK_PERF_HIGH; // v==0: everything at top clock
+        if (v==1) hint=POWERTASK_PERF_LOW;
+        if (v>=2) hint=(t&1)?POWERTASK_PERF_LOW:POWERTASK_PERF_HIGH;
+        powertask_attribute_t a={0x7E00+t,"PerfTask",0,bench_perf_task,1,0,
+            0,0,0,0,0,0,hint};
+        bench_perf_attributes[v][t]=a;
+    }
+    for (t=0;t<BENCH_PERF_TASKS;t++) powertask_register(&bench_perf_attributes[0][t]);
+    powertask_perf_set_hook(bench_perf_hook);
+    bench_perf_run("all high clock:",0,0);
+    bench_perf_run("all low clock:",1,0);
+    bench_perf_run("hints, in order:",2,0);
+    bench_perf_run("hints, batched:",3,8);
+    
+    // The sysfs-style hook, writing into a stand-in file
+    const char *path="powertask_bench_setspeed.txt";
+    char setspeed[32]="";
+    powertask_perf_cpufreq(path,bench_perf_khz);
+    bench_perf_left[1]=1;
+    powertask_make_runnable(0x7E01)->data[0]=1; // an I/O task: lowest clock
+    bench_drain();
+    FILE *f=fopen(path,"r");
+    if (f) { if (!fgets(setspeed,sizeof(setspeed),f)) setspeed[0]=0; fclose(f); }
+    remove(path);
+    printf("perf: cpufreq hook left scaling_setspeed at %s",setspeed);
+    powertask_perf_set_hook(0);
+    for (t=0;t<BENCH_PERF_TASKS;t++) powertask_unregister(0x7E00+t);
+}
+
+/********* Process-isolated tasks ***********/
+/// Adds one to a 32-bit counter; or if it's BENCH_CRASH, crashes; or if BENCH_HANG, loops forever.
+#define BENCH_CRASH 0xDEAD0000u
+#define BENCH_HANG 0xB10C0000u
+static powertask_result_t bench_isolated(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    uint32_t v;
+    memcpy(&v,input->data,4);
+    if (v==BENCH_CRASH) *(volatile int *)0=1;
+    if (v==BENCH_HANG) while (1) {}
+    v++;
+    memcpy(output->data,&v,4);
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_isolate_attributes[]={
+    {0x7F00,"InProcess",0,bench_isolated,4,4},
+    {0x7F01,"Isolated",0,bench_isolated,4,4, 0,0,POWERTASK_FLAG_ISOLATED}
+};
+
+/// Run this counter task "reps" times, pausing "pause_us" between runs,
+///   and return the mean time of each run_next call in nanoseconds.
+static double bench_isolate_run(powertask_ID_t ID,int reps,int pause_us)
+{
+    int r;
+    uint32_t v=0;
+    double total=0;
+    powertask_task_t *task=powertask_task_lookup(ID);
+    for (r=0;r<reps;r++) {
+        memcpy(powertask_make_runnable(ID)->data,&v,4);
+        if (pause_us) {
+            struct timespec pause={0,1000*pause_us};
+            nanosleep(&pause,0);
+        }
+        double start=bench_seconds();
+        powertask_run_next();
+        total+=bench_seconds()-start;
+        memcpy(&v,task->output->data,4);
+    }
+    if (v!=(uint32_t)reps) printf("isolate: %04x counted to %u, not %d!\n",ID,(unsigned int)v,reps);
+    return 1.0e9*total/reps;
+}
+
+static void bench_isolate(void)
+{
+    int reps=20000;
+    powertask_register(&bench_isolate_attributes[0]);
+    powertask_register(&bench_isolate_attributes[1]);
+    powertask_isolate_start(1,50000); // 50 ms timeout
+    double in_process=bench_isolate_run(0x7F00,reps,0);
+    double isolated=bench_isolate_run(0x7F01,reps,0);
+    double in_process_idle=bench_isolate_run(0x7F00,200,2000);
+    double isolated_idle=bench_isolate_run(0x7F01,200,2000); // the worker has gone to sleep
+    printf("isolate: dispatch back to back: in-process %.1f ns, isolated worker %.1f ns; after 2 ms idle: %.1f ns vs %.1f ns (futex wake)\n",
+        in_process,isolated,in_process_idle,isolated_idle);
+    
+    // Crash, then hang, and check the next command still runs
+    uint32_t dead=BENCH_CRASH, hang=BENCH_HANG, v=7;
+    powertask_failure_release(0x7F01);
+    memcpy(powertask_make_runnable(0x7F01)->data,&dead,4);
+    bench_drain();
+    powertask_failure_release(0x7F01); // skip the failure hold-off
+    memcpy(powertask_make_runnable(0x7F01)->data,&hang,4);
+    double start=bench_seconds();
+    bench_drain();
+    double hung=bench_seconds()-start;
+    powertask_failure_release(0x7F01);
+    memcpy(powertask_make_runnable(0x7F01)->data,&v,4);
+    bench_drain();
+    memcpy(&v,powertask_task_lookup(0x7F01)->output->data,4);
+    const powertask_isolate_stats_t *st=powertask_isolate_stats();
+    printf("isolate: %d calls (%d copied), %d crashed, %d timed out after %.0f ms, %d workers forked; next call returned %u\n",
+        (int)st->calls,(int)st->copied,(int)st->crashes,(int)st->timeouts,1.0e3*hung,(int)st->spawned,(unsigned int)v);
+    powertask_isolate_stop();
+    powertask_unregister(0x7F00);
+    powertask_unregister(0x7F01);
+}
+
+/********* Distributed scheduling ***********/
+#define BENCH_NODE_PEERS 2
+/// Counts shared with the peer node processes.
+struct bench_node_shared_t {
+    volatile int stop;
+    volatile uint32_t runs[BENCH_NODE_PEERS+1]; // tasks run by each node
+    volatile double latency[BENCH_NODE_PEERS+1]; // total seconds from forwarding to starting
+    volatile int buffered[4]; // inputs the buffered task ran with, in order
+    volatile int buffered_count;
+    volatile uint32_t periodic_runs[BENCH_NODE_PEERS+1]; // periodic task jobs run by each node
+};
+static struct bench_node_shared_t *bench_node_shared;
+static int bench_node_self=0;
+
+/// Input is the bench_seconds() time the command was made runnable on node 0.
+static powertask_result_t bench_node_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    double sent;
+    memcpy(&sent,input->data,sizeof(sent));
+    bench_node_shared->latency[bench_node_self]+=bench_seconds()-sent;
+    bench_node_shared->runs[bench_node_self]++;
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_node_attributes={
+    0x7D00,"OffloadTask",500,bench_node_task,sizeof(double),0, 0,50,POWERTASK_FLAG_OFFLOAD};
+
+/// Records which input it ran with.
+static powertask_result_t bench_node_buffered(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    int n=bench_node_shared->buffered_count;
+    if (n<4) bench_node_shared->buffered[n]=input->data[0];
+    bench_node_shared->buffered_count=n+1;
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_node_buffered_attributes={
+    0x7D01,"OffloadBuffered",500,bench_node_buffered,1,0, 0,50,POWERTASK_FLAG_OFFLOAD,0,0,2};
+
+/// Counts its jobs.
+static powertask_result_t bench_node_periodic(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_node_shared->periodic_runs[bench_node_self]++;
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_node_periodic_attributes={
+    0x7D02,"OffloadPeriodic",0,bench_node_periodic,0,0, 0,50,POWERTASK_FLAG_OFFLOAD};
+
+/// A peer board's main loop: run forwarded tasks until told to stop.
+static void bench_node_peer(const char *directory,int self,powertask_energy_t battery)
+{
+    int pass=0;
+    bench_node_self=self;
+    powertask_node_start(self,powertask_transport_unix(directory,self));
+    powertask_set_battery(battery);
+    while (!bench_node_shared->stop) {
+        if (pass++%64==0) powertask_node_publish();
+        if (powertask_node_poll()==0 && !powertask_run_next()) sched_yield(); // idle
+    }
+    _exit(0);
+}
+
+/// Make the offload task runnable on node 0, and run it (forward it) until it's gone.
+static void bench_node_send(void)
+{
+    double now=bench_seconds();
+    memcpy(powertask_make_runnable(0x7D00)->data,&now,sizeof(now));
+    while (powertask_run_next())
+    { // a peer's full queue turned it away: let the peers catch up
+        powertask_node_poll();
+        sched_yield();
+    }
+}
+
+static void bench_node(void)
+{
+    char directory[]="/tmp/powertask_nodeXXXXXX", path[64];
+    int i, p, reps=20000, latency_reps=1000;
+    pid_t peers[BENCH_NODE_PEERS];
+    powertask_energy_t peer_battery[BENCH_NODE_PEERS]={8000,20000};
+    if (mkdtemp(directory)==0) { printf("node: can't make a socket directory\n"); bench_failures++; return; }
+    bench_node_shared=(struct bench_node_shared_t *)mmap(0,sizeof(*bench_node_shared),
+        PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    powertask_register(&bench_node_attributes);
+    powertask_register(&bench_node_buffered_attributes);
+    powertask_register(&bench_node_periodic_attributes);
+    powertask_node_start(0,powertask_transport_unix(directory,0));
+    fflush(stdout);
+    for (p=0;p<BENCH_NODE_PEERS;p++)
+        if ((peers[p]=fork())==0) bench_node_peer(directory,p+1,peer_battery[p]);
+    
+    // This board is nearly flat, so it sends everything away
+    powertask_energy_t battery=powertask_get_battery();
+    powertask_set_battery(100);
+    while (powertask_node_stats()->summaries_received<2*BENCH_NODE_PEERS) {
+        powertask_node_poll();
+        sched_yield();
+    }
+    double start=bench_seconds();
+    for (i=0;i<reps;i++) bench_node_send();
+    while (bench_node_shared->runs[1]+bench_node_shared->runs[2]<(uint32_t)reps) sched_yield();
+    double elapsed=bench_seconds()-start;
+    double queued_latency=(bench_node_shared->latency[1]+bench_node_shared->latency[2])/reps;
+    uint32_t runs1=bench_node_shared->runs[1], runs2=bench_node_shared->runs[2];
+    
+    // One at a time, for latency without queueing
+    bench_node_shared->latency[1]=bench_node_shared->latency[2]=0;
+    for (i=0;i<latency_reps;i++) {
+        uint32_t before=bench_node_shared->runs[1]+bench_node_shared->runs[2];
+        bench_node_send();
+        while (bench_node_shared->runs[1]+bench_node_shared->runs[2]==before) sched_yield();
+    }
+    double latency=(bench_node_shared->latency[1]+bench_node_shared->latency[2])/latency_reps;
+    
+    // A staged command is forwarded after the one ahead of it, not the same one twice
+    powertask_make_runnable(0x7D01)->data[0]=1;
+    powertask_make_runnable(0x7D01)->data[0]=2;
+    uint32_t forwarded=powertask_node_stats()->tasks_forwarded;
+    while (powertask_run_next())
+    { // a peer's full queue turned it away: let the peers catch up
+        powertask_node_poll();
+        sched_yield();
+    }
+    forwarded=powertask_node_stats()->tasks_forwarded-forwarded;
+    while (bench_node_shared->buffered_count<2) sched_yield();
+    int buffered_ok=(forwarded==2 && bench_node_shared->buffered_count==2
+        && bench_node_shared->buffered[0]==1 && bench_node_shared->buffered[1]==2);
+    
+    // A released periodic job is forwarded like any other command
+    powertask_time_t now=powertask_get_time();
+    powertask_periodic(0x7D02,10000,100);
+    start=bench_seconds();
+    while (bench_node_shared->periodic_runs[1]+bench_node_shared->periodic_runs[2]<3
+      && bench_seconds()-start<1.0) {
+        powertask_set_time(now+=1000);
+        powertask_run_next();
+        powertask_node_poll();
+        sched_yield();
+    }
+    powertask_periodic_remove(0x7D02);
+    uint32_t periodic_forwarded=bench_node_shared->periodic_runs[1]+bench_node_shared->periodic_runs[2];
+    uint32_t periodic_local=bench_node_shared->periodic_runs[0];
+    
+    bench_node_shared->stop=1;
+    for (p=0;p<BENCH_NODE_PEERS;p++) waitpid(peers[p],0,0);
+    const powertask_node_stats_t *st=powertask_node_stats();
+    printf("node: %d tasks forwarded over Unix sockets at %.0f tasks/s (%.1f us queued latency); one at a time %.1f us latency\n",
+        reps,reps/elapsed,1.0e6*queued_latency,1.0e6*latency);
+    printf("node: peer with %d J ran %u, peer with %d J ran %u; %u forwarded, %u summaries heard\n",
+        (int)peer_battery[0],(unsigned int)runs1,(int)peer_battery[1],(unsigned int)runs2,
+        (unsigned int)st->tasks_forwarded,(unsigned int)st->summaries_received);
+    printf("node: buffered task forwarded its 2 commands in order: %s\n",bench_check(buffered_ok,"ok","WRONG"));
+    printf("node: periodic task ran %u jobs on peers, %u here: %s\n",(unsigned int)periodic_forwarded,
+        (unsigned int)periodic_local,bench_check(periodic_forwarded>=3 && periodic_local==0,"ok","WRONG"));
+    
+    powertask_node_start(0,0);
+    powertask_set_battery(battery);
+    powertask_unregister(0x7D00);
+    powertask_unregister(0x7D01);
+    powertask_unregister(0x7D02);
+    for (p=0;p<=BENCH_NODE_PEERS;p++) {
+        snprintf(path,sizeof(path),"%s/node%d",directory,p);
+        unlink(path);
+    }
+    rmdir(directory);
+    munmap((void *)bench_node_shared,sizeof(*bench_node_shared));
+}
+
+/********* Housekeeping telemetry ***********/
+static int bench_hk_count=0;
+/// Every third run fails; the rest spend input[0] Joules.
+static powertask_result_t bench_hk_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    if (++bench_hk_count%3==0) return POWERTASK_RESULT_FAIL_QUIET+7;
+    bench_spend(input->data[0]);
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_hk_attributes[]={
+    {0x7C01,"HkSmall",0,bench_hk_task,1,0},
+    {0x7C02,"HkBig",0,bench_hk_task,1,0},
+    {0x7C03,"HkHungry",20000,bench_hk_task,1,0}
+};
+
+static uint32_t bench_get32(const powertask_data_t *p)
+{
+    return ((uint32_t)p[0]<<24)|((uint32_t)p[1]<<16)|(p[2]<<8)|p[3];
+}
+
+static void bench_housekeeping(void)
+{
+    int i, step;
+    powertask_data_t record[POWERTASK_HOUSEKEEPING_BYTES], data[POWERTASK_HOUSEKEEPING_BYTES];
+    powertask_downlink_header_t header;
+    for (i=0;i<3;i++) powertask_register(&bench_hk_attributes[i]);
+    powertask_failure_policy_t no_holdoff={0,0,0,0};
+    powertask_failure_policy(&no_holdoff);
+    while (powertask_downlink_read(&header,data,0)) {} // empty the ring
+    
+    // Simulate 10 seconds of passes with a record every second
+    powertask_energy_t battery=powertask_get_battery();
+    powertask_set_battery(10000);
+    powertask_set_time(1000000);
+    powertask_housekeeping_period(1000000);
+    int records=0;
+    double make_time=0;
+    for (step=0;step<10000;step++) {
+        powertask_set_time(1000000+step*1000ull);
+        if (step%10==0) powertask_make_runnable(0x7C01)->data[0]=1;
+        if (step%50==0) powertask_make_runnable(0x7C02)->data[0]=40;
+        if (step%500==0) powertask_make_runnable(0x7C03)->data[0]=1; // waits for a charge
+        powertask_set_battery(step%100==99?30000:10000);
+        double start=bench_seconds();
+        powertask_run_next();
+        make_time+=bench_seconds()-start;
+        while (powertask_downlink_read(&header,data,sizeof(data)))
+            if (header.ID==POWERTASK_ID_HOUSEKEEPING) {
+                memcpy(record,data,sizeof(record));
+                records++;
+            }
+    }
+    powertask_housekeeping_period(0);
+    powertask_set_time(0);
+    powertask_set_battery(battery);
+    
+    // The last record covers the last second
+    const powertask_data_t *p=record;
+    printf("housekeeping: %d records of %d bytes in 10 s; last: %u ms, %d runnable, %u runs, %u failed, %u retries, %u battery skips, idle %.1f%%, top ",
+        records,(int)sizeof(record),(unsigned int)bench_get32(p+8),(p[12]<<8)|p[13],
+        (unsigned int)bench_get32(p+14),(unsigned int)bench_get32(p+18),
+        (unsigned int)bench_get32(p+22),(unsigned int)bench_get32(p+26),0.1*((p[30]<<8)|p[31]));
+    for (i=0;i<POWERTASK_HOUSEKEEPING_TOP;i++) {
+        const powertask_data_t *t=p+42+6*i;
+        if ((t[0]<<8|t[1])!=0) printf("%04x %u J, ",(t[0]<<8)|t[1],(unsigned int)bench_get32(t+2));
+    }
+    printf("%.1f ns/pass\n",1.0e9*make_time/step);
+    for (i=0;i<3;i++) powertask_unregister(bench_hk_attributes[i].ID);
+}
+
+/********* Memory and log dumps ***********/
+#define BENCH_DUMP_MEMORY 262144
+#define BENCH_DUMP_LOG 100000
+static powertask_data_t bench_dump_memory[BENCH_DUMP_MEMORY];
+static uint32_t bench_dump_other=0;
+/// The log is a synthetic byte pattern.
+static uint32_t bench_dump_reader(uint32_t offset,powertask_data_t *data,uint32_t max)
+{
+    uint32_t i;
+    if (offset>=BENCH_DUMP_LOG) return 0;
+    if (max>BENCH_DUMP_LOG-offset) max=BENCH_DUMP_LOG-offset;
+    for (i=0;i<max;i++) data[i]=(offset+i)*7;
+    return max;
+}
+static powertask_result_t bench_dump_other_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_dump_other++;
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_dump_attributes={
+    0x7E01,"DumpNeighbor",0,bench_dump_other_task,0,0
+};
+
+/// Command a dump of the whole memory window and the whole log.
+static void bench_dump_command(void)
+{
+    uint64_t address=(uintptr_t)bench_dump_memory;
+    powertask_data_t *m=powertask_make_runnable(POWERTASK_ID_MEMORY_READ)->data;
+    m[0]=address>>56; m[1]=address>>48; m[2]=address>>40; m[3]=address>>32;
+    m[4]=address>>24; m[5]=address>>16; m[6]=address>>8; m[7]=address;
+    uint32_t length=BENCH_DUMP_MEMORY;
+    m[8]=length>>24; m[9]=length>>16; m[10]=length>>8; m[11]=length;
+    powertask_data_t *l=powertask_make_runnable(POWERTASK_ID_LOG_READ)->data;
+    memset(l,0,8);
+    l[4]=0xFF; l[5]=0xFF; l[6]=0xFF; l[7]=0xFF; // to the end of the log
+}
+
+static void bench_dump(void)
+{
+    static powertask_data_t data[POWERTASK_DUMP_CHUNK];
+    powertask_downlink_header_t header;
+    uint32_t i, received=0, bad=0, finals=0;
+    int step;
+    for (i=0;i<BENCH_DUMP_MEMORY;i++) bench_dump_memory[i]=i*13;
+    powertask_register(&bench_dump_attributes);
+    powertask_memory_window(bench_dump_memory,BENCH_DUMP_MEMORY);
+    powertask_log_reader(bench_dump_reader);
+    while (powertask_downlink_read(&header,data,0)) {} // empty the ring
+    
+    // Throttled to 64 kB/s, passes every simulated millisecond, with a neighbor task every other pass
+    powertask_set_time(0);
+    powertask_dump_rate(65536);
+    bench_dump_command();
+    bench_dump_other=0;
+    for (step=0;finals<2 && step<60000;step++) {
+        powertask_set_time(step*1000ull);
+        if (step%2==0) powertask_make_runnable(0x7E01);
+        powertask_run_next();
+        while (powertask_downlink_read(&header,data,sizeof(data))) {
+            if (!(header.type&POWERTASK_DOWNLINK_STREAM)) continue;
+            for (i=0;i<header.length;i++) {
+                uint32_t offset=header.sequence*POWERTASK_DUMP_CHUNK+i;
+                powertask_data_t expect=header.ID==POWERTASK_ID_MEMORY_READ?offset*13:offset*7;
+                if (data[i]!=expect) bad++;
+            }
+            received+=header.length;
+            if (header.type&POWERTASK_DOWNLINK_FINAL) finals++;
+        }
+    }
+    const powertask_dump_stats_t *st=powertask_dump_stats();
+    bench_check(bad==0,"ok","WRONG");
+    printf("dump: %u bytes (%u wrong) in %.2f simulated s = %.1f kB/s at a 64 kB/s budget, %u chunks, %u throttled runs, neighbor ran %u of %u commands\n",
+        (unsigned int)received,(unsigned int)bad,step*0.001,received/(step*0.001)/1024,
+        (unsigned int)st->chunks,(unsigned int)st->throttled,(unsigned int)bench_dump_other,(unsigned int)(step+1)/2);
+    
+    // Unthrottled, measuring the cost of each chunk
+    powertask_dump_rate(0);
+    uint32_t chunks=st->chunks;
+    bench_dump_command();
+    double start=bench_seconds();
+    while (powertask_run_next()) {
+        while (powertask_downlink_read(&header,data,0)) {}
+    }
+    double elapsed=bench_seconds()-start;
+    chunks=st->chunks-chunks;
+    printf("dump: unthrottled %u chunks of %d bytes, %.0f ns/chunk (%.0f MB/s)\n",
+        (unsigned int)chunks,POWERTASK_DUMP_CHUNK,1.0e9*elapsed/chunks,
+        (BENCH_DUMP_MEMORY+BENCH_DUMP_LOG)/elapsed/1.0e6);
+    powertask_set_time(0);
+    powertask_log_reader(0);
+    powertask_unregister(0x7E01);
+}
+
+/********* Hardware performance counters ***********/
+#define BENCH_PMU_CHASE (4*1024*1024) /* 32 MB of pointers: far bigger than cache */
+static uint32_t *bench_pmu_next=0; // a random cycle through the array
+static uint32_t bench_pmu_sink=0;
+/// Walks 4096 steps of a random cycle: nearly every step misses the cache.
+static powertask_result_t bench_pmu_chase_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    uint32_t i, p=bench_pmu_sink%BENCH_PMU_CHASE;
+    for (i=0;i<4096;i++) p=bench_pmu_next[p];
+    bench_pmu_sink=p;
+    return POWERTASK_RESULT_OK;
+}
+/// Sums the first 4096 entries in order: they stay in cache.
+static powertask_result_t bench_pmu_sum_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    uint32_t i, sum=0;
+    for (i=0;i<4096;i++) sum+=bench_pmu_next[i];
+    bench_pmu_sink+=sum;
+    return POWERTASK_RESULT_OK;
+}
+/// Branches on random bits: half the branches mispredict.
+static powertask_result_t bench_pmu_branch_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    uint32_t i, sum=0;
+    for (i=0;i<4096;i++) {
+        if (bench_pmu_next[i]&1) sum+=i; 
+        else sum^=i;
+    }
+    bench_pmu_sink+=sum;
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_pmu_attributes[]={
+    {0x7F01,"PointerChase",0,bench_pmu_chase_task,0,0},
+    {0x7F02,"SequentialSum",0,bench_pmu_sum_task,0,0},
+    {0x7F03,"RandomBranch",0,bench_pmu_branch_task,0,0}
+};
+
+static void bench_pmu(void)
+{
+    uint32_t i, step;
+    bench_pmu_next=(uint32_t *)malloc(BENCH_PMU_CHASE*sizeof(uint32_t));
+    for (i=0;i<BENCH_PMU_CHASE;i++) bench_pmu_next[i]=i;
+    for (i=BENCH_PMU_CHASE-1;i>0;i--)
+    { // Sattolo's shuffle makes one big cycle
+        uint32_t j=rand()%i, t=bench_pmu_next[i];
+        bench_pmu_next[i]=bench_pmu_next[j];
+        bench_pmu_next[j]=t;
+    }
+    for (i=0;i<3;i++) powertask_register(&bench_pmu_attributes[i]);
+    
+    int counters=powertask_pmu_start();
+    if (counters==0) printf("pmu: no hardware counters here (check /proc/sys/kernel/perf_event_paranoid)\n");
+    
+    for (step=0;step<300;step++) {
+        powertask_make_runnable(bench_pmu_attributes[step%3].ID);
+        powertask_run_next();
+    }
+    if (counters) {
+        printf("pmu: counters %x\n",counters);
+        powertask_pmu_report();
+    }
+    
+    // Time a short task with and without counting
+    double with=0, without=0;
+    for (step=0;step<4000;step++) {
+        if (step==2000) powertask_pmu_stop();
+        powertask_make_runnable(0x7F02);
+        double start=bench_seconds();
+        powertask_run_next();
+        if (step<2000) with+=bench_seconds()-start;
+        else without+=bench_seconds()-start;
+    }
+    if (counters) printf("pmu: counting adds %.0f ns per call\n",1.0e9*(with-without)/2000);
+    for (i=0;i<3;i++) powertask_unregister(bench_pmu_attributes[i].ID);
+    free(bench_pmu_next);
+}
+
+/********* Synthetic workloads ***********/
+static const char *bench_workload_configs[]={
+    "tasks=200 ids=random groups=4 energy=exp:5:50 battery=uniform:0:200 input=uniform:2:64 output=uniform:0:64 work=exp:2000:20000 retry=5 fail=2 arrivals=poisson rate=2000",
+    "tasks=120 shape=chains chain=6 energy=2 work=1000 output=16 arrivals=periodic rate=20",
+    "tasks=150 ids=random shape=dag fanout=3 energy=uniform:1:10 work=uniform:500:5000 retry=uniform:0:20 arrivals=bursty rate=500 burst=16"
+};
+
+/// Simulate 2 seconds of 100 microsecond passes of each workload, with a trickle of solar power.
+static void bench_workload(void)
+{
+    unsigned int c;
+    powertask_energy_t battery=powertask_get_battery();
+    for (c=0;c<sizeof(bench_workload_configs)/sizeof(bench_workload_configs[0]);c++) {
+        powertask_workload_config_t config;
+        powertask_workload_defaults(&config);
+        if (!powertask_workload_parse(&config,bench_workload_configs[c])) continue;
+        powertask_workload_t *w=powertask_workload_generate(&config);
+        if (w==0) {
+            printf("workload %u: invalid config\n",c);
+            continue;
+        }
+        powertask_workload_register(w);
+        powertask_set_battery(20000);
+        int step, idle=0;
+        double start=bench_seconds();
+        for (step=0;step<20000;step++) {
+            powertask_time_t now=step*100ull;
+            powertask_set_time(now);
+            powertask_set_battery(powertask_get_battery()+20);
+            powertask_workload_arrive(w,now);
+            const powertask_workload_stats_t *st=powertask_workload_stats(w);
+            uint32_t runs=st->runs;
+            powertask_run_next();
+            if (st->runs==runs) idle++;
+        }
+        double elapsed=bench_seconds()-start;
+        const powertask_workload_stats_t *st=powertask_workload_stats(w);
+        printf("workload %u: %d tasks, %u commands, %u runs (%u retry, %u failed), %u triggered, %.1f%% idle passes, %.2f ms burned, %.0f ns/pass besides that\n",
+            c,powertask_workload_count(w),(unsigned int)st->arrivals,(unsigned int)st->runs,
+            (unsigned int)st->retries,(unsigned int)st->failures,(unsigned int)st->triggered,
+            100.0*idle/step,1.0e-6*st->work_ns,(1.0e9*elapsed-st->work_ns)/step);
+        powertask_workload_unregister(w);
+        powertask_workload_free(w);
+    }
+    powertask_set_time(0);
+    powertask_set_battery(battery);
+}
+
+/********* Periodic tasks and admission control ***********/
+#define BENCH_PERIODIC_MAX POWERTASK_PERIODIC_MAX
+static powertask_attribute_t bench_periodic_attributes[BENCH_PERIODIC_MAX];
+static powertask_result_t bench_periodic_nothing(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    return POWERTASK_RESULT_OK;
+}
+
+/// A simulated clock: tasks advance it by their execution time.
+static powertask_time_t bench_periodic_now=0;
+static powertask_time_t bench_periodic_clock(void)
+{
+    return bench_periodic_now;
+}
+#define BENCH_PERIODIC_TASK(name,us) \
+static powertask_result_t name(const powertask_telemetry_t *input,powertask_telemetry_t *output) \
+{ \
+    bench_periodic_now+=us; \
+    return POWERTASK_RESULT_OK; \
+}
+BENCH_PERIODIC_TASK(bench_periodic_a,1000)
+BENCH_PERIODIC_TASK(bench_periodic_b,2000)
+BENCH_PERIODIC_TASK(bench_periodic_c,4000)
+BENCH_PERIODIC_TASK(bench_periodic_bulk,2000)
+BENCH_PERIODIC_TASK(bench_periodic_late1,2250)
+BENCH_PERIODIC_TASK(bench_periodic_late2,4750)
+BENCH_PERIODIC_TASK(bench_periodic_late4,1250)
+/// A periodic task that spends more energy than comes in, and a task it starves.
+static powertask_result_t bench_periodic_hungry(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_periodic_now+=100;
+    bench_spend(1000);
+    return POWERTASK_RESULT_OK;
+}
+static powertask_result_t bench_periodic_starved(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    bench_periodic_now+=1000;
+    bench_spend(4000);
+    return POWERTASK_RESULT_OK;
+}
+static const powertask_attribute_t bench_periodic_reserve[]={
+    {0x7F21,"Hungry",0,bench_periodic_hungry,0,0,5,1000},
+    {0x7F22,"Starved",5000,bench_periodic_starved,0,0,6,4000}
+};
+static const powertask_attribute_t bench_periodic_sim[]={
+    {0x7F01,"PeriodicA",0,bench_periodic_a,0,0,1,1},
+    {0x7F02,"PeriodicB",0,bench_periodic_b,0,0,2,1},
+    {0x7F03,"PeriodicC",0,bench_periodic_c,0,0,3,1},
+    {0x7F04,"PeriodicD",0,bench_periodic_c,0,0,3,3},
+    {0x7F05,"Bulk",0,bench_periodic_bulk,0,0,0,1}
+};
+/// A set where only a later job in a busy period misses: the last task's
+///   first job finishes in 13 ms, but its second is pushed to 24 ms.
+static const powertask_attribute_t bench_periodic_late[]={
+    {0x7F11,"Late1",0,bench_periodic_late1},
+    {0x7F12,"Late2",0,bench_periodic_late2},
+    {0x7F13,"Late3",0,bench_periodic_late2},
+    {0x7F14,"Late4",0,bench_periodic_late4}
+};
+static const powertask_time_t bench_periodic_late_periods[]={12000,13000,15000,16000};
+static const powertask_time_t bench_periodic_late_execution[]={2250,4750,4750,1250};
+
+/// Cost of admitting hundreds of periodic tasks, then a simulated second 
+///   of a small set against a non-periodic task that blocks it.
+static void bench_periodic(void)
+{
+    static const powertask_time_t periods[]={5000,10000,20000,25000,50000,100000,200000,250000,500000,1000000};
+    int sizes[]={64,128,BENCH_PERIODIC_MAX}, s, i;
+    powertask_energy_t battery=powertask_get_battery();
+    powertask_set_battery(30000);
+    srand(75);
+    for (s=0;s<3;s++) {
+        int n=sizes[s], admitted=0;
+        for (i=0;i<n;i++) {
+            powertask_attribute_t *a=&bench_periodic_attributes[i];
+            a->ID=0x7E00+i;
+            a->name="Periodic";
+            a->function=bench_periodic_nothing;
+            a->energy_per_run=1;
+            powertask_register(a);
+        }
+        // Each task asks for an even share of 70% of the CPU, but no more than 200 us a job
+        const powertask_schedulability_t *r=powertask_schedulability();
+        uint32_t analyses=r->analyses, iterations=r->iterations;
+        double start=bench_seconds();
+        for (i=0;i<n;i++) {
+            powertask_time_t period=periods[rand()%10];
+            powertask_time_t execution=period*7/10/n;
+            if (execution>200) execution=200;
+            admitted+=powertask_periodic(bench_periodic_attributes[i].ID,period,execution);
+        }
+        double admit=bench_seconds()-start;
+        r=powertask_schedulability();
+        printf("periodic %d: %d admitted, utilization %.1f%%, critical %04x has %.1f ms slack; %.2f us/admission, %.0f iterations/admission\n",
+            n,admitted,r->utilization*1.0e-4,(int)r->critical,r->slack*1.0e-3,1.0e6*admit/n,
+            (double)(r->iterations-iterations)/(r->analyses-analyses));
+
+        // Removing a task re-analyzes from scratch
+        iterations=r->iterations;
+        start=bench_seconds();
+        powertask_periodic_remove(bench_periodic_attributes[0].ID);
+        r=powertask_schedulability();
+        double full=bench_seconds()-start;
+        printf("periodic %d: full re-analysis %.1f us, %u iterations\n",n,1.0e6*full,(unsigned int)(r->iterations-iterations));
+        for (i=0;i<n;i++) powertask_unregister(bench_periodic_attributes[i].ID);
+    }
+    powertask_run_next(); // drop their stored releases
+    
+    // Admit the later-job set anyway, and simulate it
+    bench_periodic_now=0;
+    powertask_set_clock(bench_periodic_clock);
+    powertask_periodic_admission(POWERTASK_ADMISSION_WARN);
+    int admitted=0;
+    for (i=0;i<4;i++) {
+        powertask_register(&bench_periodic_late[i]);
+        admitted+=powertask_periodic(bench_periodic_late[i].ID,bench_periodic_late_periods[i],
+            bench_periodic_late_execution[i]);
+    }
+    powertask_periodic_admission(POWERTASK_ADMISSION_REJECT);
+    while (bench_periodic_now<1000000) {
+        powertask_time_t before=bench_periodic_now;
+        powertask_run_next();
+        if (bench_periodic_now==before) bench_periodic_now+=100; // idle
+    }
+    const powertask_periodic_stats_t *late=powertask_periodic_stats(0x7F14);
+    printf("periodic later job: %d of 4 pass analysis; Late4 analyzed %.2f ms for a %.0f ms period, ran %u jobs, %u missed, worst %.2f ms %s\n",
+        admitted,late->response*1.0e-3,late->period*1.0e-3,(unsigned int)late->releases,
+        (unsigned int)late->misses,late->max_response*1.0e-3,
+        bench_check(admitted==3 && late->response>late->period && late->misses>0,"ok","WRONG"));
+    for (i=0;i<4;i++) powertask_unregister(bench_periodic_late[i].ID);
+    powertask_run_next();
+    
+    // Simulate a second: A, B, and C are periodic, Bulk always wants to run
+    bench_periodic_now=0;
+    powertask_set_clock(bench_periodic_clock);
+    for (i=0;i<5;i++) powertask_register(&bench_periodic_sim[i]);
+    powertask_periodic_blocking(2000);
+    powertask_periodic_income(200000);
+    powertask_periodic(0x7F01,10000,1000);
+    powertask_periodic(0x7F02,20000,2000);
+    powertask_periodic(0x7F03,50000,4000);
+    int rejected=!powertask_periodic(0x7F04,25000,12000); // blocks A longer than its period
+    while (bench_periodic_now<1000000) {
+        powertask_time_t before=bench_periodic_now;
+        if (!powertask_task_lookup(0x7F05)->prev) powertask_make_runnable(0x7F05);
+        powertask_run_next();
+        if (bench_periodic_now==before) bench_periodic_now+=100; // idle
+    }
+    const powertask_schedulability_t *r=powertask_schedulability();
+    printf("periodic sim: utilization margin %.1f%%, energy margin %.1f W, D %s; ",
+        r->utilization_margin*1.0e-4,r->energy_margin*1.0e-3,bench_check(rejected,"rejected","ADMITTED"));
+    for (i=0;i<3;i++) {
+        const powertask_periodic_stats_t *p=powertask_periodic_stats(bench_periodic_sim[i].ID);
+        printf("%s %u jobs, %u missed, response %.1f ms (analyzed %.1f)%s",bench_periodic_sim[i].name+8,
+            (unsigned int)p->releases,(unsigned int)p->misses,p->max_response*1.0e-3,p->response*1.0e-3,i<2?", ":"\n");
+    }
+    for (i=0;i<5;i++) powertask_unregister(bench_periodic_sim[i].ID);
+    powertask_run_next();
+    powertask_periodic_blocking(0);
+    powertask_periodic_income(0);
+    
+    // A starved task's reserved energy is saved from periodic tasks too
+    bench_periodic_now=0;
+    powertask_set_battery(0);
+    for (i=0;i<2;i++) powertask_register(&bench_periodic_reserve[i]);
+    powertask_periodic(0x7F21,10000,100);
+    powertask_make_runnable(0x7F22);
+    int passes;
+    for (passes=0;passes<20000 && powertask_task_stats(0x7F22)->runs==0;passes++) {
+        powertask_time_t before=bench_periodic_now;
+        powertask_set_battery(powertask_get_battery()+5);
+        powertask_run_next();
+        if (bench_periodic_now==before) bench_periodic_now+=100; // idle
+    }
+    const powertask_task_stats_t *hungry=powertask_task_stats(0x7F21);
+    printf("periodic reserve: starved task ran after %d passes, periodic task ran %u times, held back %u: %s\n",
+        passes,(unsigned int)hungry->runs,(unsigned int)hungry->held,
+        bench_check(powertask_task_stats(0x7F22)->runs==1 && hungry->held>0,"ok","WRONG"));
+    for (i=0;i<2;i++) powertask_unregister(bench_periodic_reserve[i].ID);
+    powertask_run_next();
+    powertask_set_clock(0);
+    powertask_set_time(0);
+    powertask_set_battery(battery);
+}
+
+
+int main()
+{
+    powertask_debug(0);
+    bench_sequence();
+    bench_timed();
+    bench_fairshare();
+    bench_aging();
+    bench_memo();
+    bench_batch();
+    bench_streaming();
+    bench_region();
+    bench_shared();
+    bench_buffered();
+    bench_handles();
+    bench_failure();
+    bench_modules();
+    bench_uplink();
+    bench_dedupe();
+    bench_perf();
+    bench_isolate();
+    bench_node();
+    bench_housekeeping();
+    bench_dump();
+    bench_pmu();
+    bench_workload();
+    bench_periodic();
+    if (bench_failures) printf("bench: %d checks FAILED\n",bench_failures);
+    return bench_failures!=0;
+}
@@ -6,14 +6,14 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
-#include "powertask.h"
+#include <string.h>
+#include "powertask_internal.h"
 
 /// Debug support
-static int powertask_debug_level=0;
+int powertask_debug_level=0;
 void powertask_debug(int debug_level) {
     powertask_debug_level=debug_level; 
 }
-#define DEBUGF(level,params) { if (powertask_debug_level>=level)  printf params; }
 
 void powertask_fatal(const char *why,int ID) 
 {
@@ -21,12 +21,79 @@ void powertask_fatal(const char *why,int ID)
     exit(1);
 }
 
+/// Time support: until the platform installs a clock, time is set manually.
+static powertask_time_t powertask_manual_time=0;
+static powertask_time_t powertask_manual_clock(void)
+{
+    return powertask_manual_time;
+}
+static powertask_clock_t powertask_clock=powertask_manual_clock;
+
+void powertask_set_clock(powertask_clock_t clock)
+{
+    if (clock==0) clock=powertask_manual_clock;
+    powertask_clock=clock;
+}
+void powertask_set_time(powertask_time_t now)
+{
+    powertask_manual_time=now;
+}
+powertask_time_t powertask_get_time(void)
+{
+    return powertask_clock();
+}
+
+/// Each group has its own doubly linked list of runnable tasks,
+///  and a stride scheduling pass value (energy used per ticket).
+struct powertask_group_state_t {
+    powertask_task_t *runnable; // current entry in this group's list of runnable tasks, or 0 if none
+    uint64_t pass; // the active group with the lowest pass runs next
+    uint32_t stride; // pass added per Joule used (0 means 1 ticket)
+    int heap_index; // index in group_heap plus one, or 0 if not in the heap
+    powertask_group_stats_t stats;
+};
+typedef struct powertask_group_state_t powertask_group_state_t;
+
+/// Pass added per Joule by a group with one ticket.
+#define POWERTASK_STRIDE_ONE (1u<<20)
+
+static powertask_group_state_t groups[POWERTASK_GROUP_MAX];
+
+/// This is a binary min-heap, by pass, of the groups that have runnable tasks.
+static powertask_group_state_t *group_heap[POWERTASK_GROUP_MAX];
+static int group_heap_count=0;
+
+/// Pass of the most recently run group: groups that become active start here,
+///   so they can't bank credit while they have nothing to run.
+static uint64_t group_virtual_time=0;
+
+/// Number of runnable tasks, not counting the idle task.
+static int runnable_count=0;
+
+/// Sum of energy_per_run over the runnable tasks: energy this board already owes.
+static uint32_t queued_energy=0;
+
+/// The task whose function is running right now, or 0 between tasks.
+powertask_task_t *powertask_current_task=0;
+
+/// Scheduler counters for housekeeping.
+struct powertask_counters_t powertask_counters;
+
+/// The builtin idle task, which runs when no other task can.
+static powertask_task_t *idle_task=0;
+
+/// The starved task that battery energy is being reserved for, or 0 if none.
+static powertask_task_t *reserved_task=0;
+static uint32_t reserved_passes=0; // passes since the reservation began
+
+/// The group's current task, while run_next runs another ahead of it, or 0.
+///   Cleared if it leaves the run queue (or is unregistered) during the run.
+static powertask_task_t *bypassed_task=0;
+
+#ifndef POWERTASK_CONSTANT_TIME
 /// This is the tree of all registered tasks.
 static powertask_task_t *registered_tasks=0;
 
-/// This is the current entry in the doubly linked list of all runnable tasks.
-static powertask_task_t *runnable_tasks=0;
-
 // Link this new task into the registered-tasks binary tree
 static void powertask_link_into_tree(powertask_task_t *parent,powertask_task_t *task)
 {      
@@ -58,6 +125,178 @@ static void powertask_link_into_tree(powertask_task_t *parent,powertask_task_t *
 }
 
 
+// Unlink this task from the registered-tasks binary tree
+static void powertask_unlink_from_tree(powertask_task_t *task)
+{
+    // Find the link that points to this task
+    powertask_task_t **link=&registered_tasks;
+    while (*link!=task) {
+        if ((*link)->attribute->ID < task->attribute->ID) link=&(*link)->lower;
+        else link=&(*link)->higher;
+    }
+    
+    powertask_task_t *replacement;
+    if (task->lower==0) replacement=task->higher;
+    else if (task->higher==0) replacement=task->lower;
+    else 
+    { // two children: the nearest ID in the "higher" subtree takes our place
+        powertask_task_t **near=&task->higher;
+        while ((*near)->lower) near=&(*near)->lower;
+        replacement=*near;
+        *near=replacement->higher; // unlink it from its old spot
+        replacement->lower=task->lower;
+        replacement->higher=task->higher;
+    }
+    *link=replacement;
+    task->lower=task->higher=0;
+}
+
+/// Visit this subtree of the registered-tasks tree in ID order ("lower" holds higher IDs).
+static void powertask_walk_tree(powertask_task_t *task,void (*visit)(powertask_task_t *task))
+{
+    while (task) {
+        powertask_walk_tree(task->higher,visit);
+        visit(task);
+        task=task->lower;
+    }
+}
+
+void powertask_task_walk(void (*visit)(powertask_task_t *task))
+{
+    powertask_walk_tree(registered_tasks,visit);
+}
+
+int powertask_task_depth(powertask_ID_t ID)
+{
+    powertask_task_t *parent=registered_tasks;
+    int depth=0;
+    while (parent) {
+        depth++;
+        if (parent->attribute->ID < ID) parent=parent->lower;
+        else if (parent->attribute->ID > ID) parent=parent->higher;
+        else break;
+    }
+    return depth;
+}
+
+/// Look up the runtime task structure for this task ID.
+///  Returns 0 if that task ID is not registered.
+powertask_task_t *powertask_task_lookup(powertask_ID_t ID)
+{
+    powertask_task_t *parent=registered_tasks;        
+    if (parent==0) return 0; // nothing registered yet
+    while (1) {
+        if (parent->attribute->ID < ID)
+        {
+            if (parent->lower) parent=parent->lower;
+            else return 0; // hit leaf
+        }
+        else if (parent->attribute->ID > ID)
+        {
+            if (parent->higher) parent=parent->higher;
+            else return 0; // hit leaf
+        }
+        else /* found it! */
+        {
+            return parent;
+        }
+    }
+}
+
+/// Add this task to the registry.  Returns 1 if it's the first task ever registered.
+static int powertask_registry_insert(powertask_task_t *task)
+{
+    if (registered_tasks==0) {
+        registered_tasks=task; // root of the search tree
+        return 1;
+    }
+    powertask_link_into_tree(registered_tasks,task);
+    return 0;
+}
+
+static void powertask_registry_remove(powertask_task_t *task)
+{
+    powertask_unlink_from_tree(task);
+}
+
+#else
+/// In constant-time mode, registered tasks are found in a two-level table:
+///   the ID's high byte picks a page of 256 entries, its low byte the entry.
+///   Pages come from a static pool, and stay once used.
+static powertask_task_t **registry_pages[256];
+static powertask_task_t *registry_pool[POWERTASK_REGISTRY_PAGES][256];
+static int registry_pool_used=0;
+static uint32_t registry_page_bits[256/32]; // bit set for each page in use, for walks
+
+static int powertask_registry_insert(powertask_task_t *task)
+{
+    powertask_ID_t ID=task->attribute->ID;
+    int first=(registry_pool_used==0);
+    powertask_task_t **page=registry_pages[ID>>8];
+    if (page==0) {
+        if (registry_pool_used>=POWERTASK_REGISTRY_PAGES)
+            powertask_fatal("Too many task ID pages for POWERTASK_REGISTRY_PAGES",ID);
+        page=registry_pages[ID>>8]=registry_pool[registry_pool_used++];
+        registry_page_bits[ID>>13]|=1u<<((ID>>8)&31);
+    }
+    if (page[ID&0xFF]) {
+        DEBUGF(0,("powertask_register ID collision: old ID %04x (%s, %p), new ID %04x (%s,%p)\n",
+            (int)ID, page[ID&0xFF]->attribute->name, page[ID&0xFF]->attribute,
+            (int)ID, task->attribute->name, task->attribute));
+        powertask_fatal("powertask_register ID collision",ID);
+    }
+    page[ID&0xFF]=task;
+    return first;
+}
+
+static void powertask_registry_remove(powertask_task_t *task)
+{
+    powertask_ID_t ID=task->attribute->ID;
+    registry_pages[ID>>8][ID&0xFF]=0;
+}
+
+void powertask_task_walk(void (*visit)(powertask_task_t *task))
+{
+    int word, low;
+    for (word=0;word<256/32;word++) {
+        uint32_t bits=registry_page_bits[word];
+        while (bits) {
+            int bit=__builtin_ctz(bits);
+            bits&=bits-1;
+            powertask_task_t **page=registry_pages[word*32+bit];
+            for (low=0;low<256;low++)
+                if (page[low]) visit(page[low]);
+        }
+    }
+}
+
+int powertask_task_depth(powertask_ID_t ID)
+{
+    return 2; // the page, then the entry
+}
+
+powertask_task_t *powertask_task_lookup(powertask_ID_t ID)
+{
+    powertask_task_t **page=registry_pages[ID>>8];
+    return page?page[ID&0xFF]:0;
+}
+#endif
+const powertask_task_stats_t *powertask_task_stats(powertask_ID_t ID)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) return 0;
+    return &task->stats;
+}
+
+/// Allocate telemetry object (only called once per task, cached in task struct)
+powertask_telemetry_t *powertask_allocate_telemetry(powertask_length_t len)
+{
+    DEBUGF(8,("  allocating %d bytes of telemetry\n",(int)len));
+    powertask_telemetry_t *tel=(powertask_telemetry_t *)calloc(1,
+        sizeof(powertask_telemetry_header_t)+len);
+    tel->header.length=len;
+    return tel;
+}
 
 /// This is the builtin idle task
 #define powertask_ID_builtin_idle 0xFFFF
@@ -81,9 +320,14 @@ static void powertask_setup()
 {
     // Register our builtin idle task
     powertask_register(&attributes_idle_task);
-    powertask_make_runnable(powertask_ID_builtin_idle);    
+    idle_task=powertask_task_lookup(powertask_ID_builtin_idle);
+    if (idle_task->input==0) idle_task->input=powertask_allocate_telemetry(0);
+    if (idle_task->output==0) idle_task->output=powertask_allocate_telemetry(0);
     
-    // Register any other utility tasks (mem read?  log read?)
+    // Register our other utility tasks
+    powertask_sequence_setup();
+    powertask_housekeeping_setup();
+    powertask_dump_setup();
 }
 
 void powertask_register(const powertask_attribute_t *attribute)
@@ -92,6 +336,7 @@ void powertask_register(const powertask_attribute_t *attribute)
     //  We use calloc because it zeros the memory it allocates.
     powertask_task_t *task = (powertask_task_t*)calloc(1,sizeof(powertask_task_t));
     powertask_task_register(attribute,task);
+    task->allocated=POWERTASK_ALLOCATED_TASK;
 }
 
 
@@ -107,50 +352,152 @@ void powertask_task_register(const powertask_attribute_t *attribute,powertask_ta
     task->attribute = attribute;
     task->lower=task->higher=0;
     task->prev=task->next=0;
+    task->timed=0;
+    task->timed_waiting=task->timed_waiting_last=0;
+    memset(&task->stats,0,sizeof(task->stats));
+    memset(&task->failure,0,sizeof(task->failure));
+    task->batch_inputs=task->batch_outputs=0;
+    task->batch_queued=0;
+    task->stream_count=0;
+    task->stream_sequence=0;
+    task->region_checked=0;
+    task->shared=0;
+    task->input_back=0;
+    task->input_staged=task->input_front_done=0;
+    task->completions=0;
+    task->handles=0;
+    task->allocated=0;
+    memset(&task->commands_seen,0,sizeof(task->commands_seen));
+    task->perf_bypassed=0;
+    task->node_received=0;
+    task->housekeeping_energy=0;
+    task->pmu=0;
+    task->periodic=0;
+    if (attribute->group>=POWERTASK_GROUP_MAX)
+        powertask_fatal("Task group too big for POWERTASK_GROUP_MAX",attribute->ID);
+    if (attribute->input_depth>POWERTASK_INPUT_DEPTH_MAX)
+        powertask_fatal("Task input_depth too big for POWERTASK_INPUT_DEPTH_MAX",attribute->ID);
+    powertask_failure_register(task);
+    
+#ifdef POWERTASK_CONSTANT_TIME
+    // make_runnable must not allocate, so allocate its queues and telemetry now
+    if (attribute->batch_function) powertask_batch_allocate(task);
+    else if (attribute->input_depth>1) powertask_input_allocate(task);
+    if (!attribute->batch_function && !(attribute->flags&POWERTASK_FLAG_ISOLATED))
+    {
+        if (task->input==0) {
+            task->input=powertask_allocate_telemetry(attribute->input_length);
+            task->allocated|=POWERTASK_ALLOCATED_INPUT;
+        }
+        if (task->output==0) {
+            task->output=powertask_allocate_telemetry(attribute->output_length);
+            task->allocated|=POWERTASK_ALLOCATED_OUTPUT;
+        }
+    }
+#endif
     
-    if (registered_tasks==0) 
+    if (powertask_registry_insert(task)) 
     { // This is the first registration ever.
-        registered_tasks=task; // root of the search tree
-
         // This is our chance to register builtin tasks and such
         powertask_setup();
     }
-    else 
-    {
-        powertask_link_into_tree(registered_tasks,task);
+}
+
+/// Return 1 if group a should run before group b.
+static int powertask_group_before(const powertask_group_state_t *a,const powertask_group_state_t *b)
+{
+    if (a->pass!=b->pass) return a->pass < b->pass;
+    return a < b; // lower group number wins ties
+}
+
+/// Move the group at heap index i up or down until the heap is ordered.
+static void powertask_group_heap_fix(int i)
+{
+    powertask_group_state_t *g=group_heap[i];
+    while (i>0 && powertask_group_before(g,group_heap[(i-1)/2])) 
+    { // move up
+        group_heap[i]=group_heap[(i-1)/2];
+        group_heap[i]->heap_index=i+1;
+        i=(i-1)/2;
     }
+    while (1) 
+    { // move down
+        int child=2*i+1;
+        if (child>=group_heap_count) break;
+        if (child+1<group_heap_count && powertask_group_before(group_heap[child+1],group_heap[child]))
+            child++;
+        if (!powertask_group_before(group_heap[child],g)) break;
+        group_heap[i]=group_heap[child];
+        group_heap[i]->heap_index=i+1;
+        i=child;
+    }
+    group_heap[i]=g;
+    g->heap_index=i+1;
 }
 
-/// Look up the runtime task structure for this task ID.
-///  Returns 0 if that task ID is not registered.
-powertask_task_t *powertask_task_lookup(powertask_ID_t ID)
+/// Put this group back in the heap of groups with runnable tasks, keeping its pass.
+static void powertask_group_requeue(powertask_group_state_t *group)
 {
-    powertask_task_t *parent=registered_tasks;        
-    while (1) {
-        if (parent->attribute->ID < ID)
-        {
-            if (parent->lower) parent=parent->lower;
-            else return 0; // hit leaf
-        }
-        else if (parent->attribute->ID > ID)
-        {
-            if (parent->higher) parent=parent->higher;
-            else return 0; // hit leaf
-        }
-        else /* found it! */
-        {
-            return parent;
-        }
+    if (group->heap_index!=0) return; // already there
+    group_heap[group_heap_count]=group;
+    powertask_group_heap_fix(group_heap_count++);
+}
+
+/// Add this newly runnable group to the heap of groups with runnable tasks.
+static void powertask_group_activate(powertask_group_state_t *group)
+{
+    if (group->pass<group_virtual_time) group->pass=group_virtual_time;
+    powertask_group_requeue(group);
+}
+
+/// Remove this group from the heap of groups with runnable tasks.
+static void powertask_group_deactivate(powertask_group_state_t *group)
+{
+    int i=group->heap_index-1;
+    if (i<0) return; // not there
+    group->heap_index=0;
+    powertask_group_state_t *last=group_heap[--group_heap_count];
+    if (last!=group) {
+        group_heap[i]=last;
+        powertask_group_heap_fix(i);
     }
 }
 
-/// Allocate telemetry object (only called once per task, cached in task struct)
-powertask_telemetry_t *powertask_allocate_telemetry(powertask_length_t len)
+/// Return the energy this task's function just used on "runs" inputs: the measured
+///   drop in battery energy, or the task's estimate if the battery didn't drop.
+static uint32_t powertask_energy_used(powertask_task_t *task,powertask_energy_t battery_before,
+    uint32_t runs)
 {
-    DEBUGF(8,("  allocating %d bytes of telemetry\n",(int)len));
-    powertask_telemetry_t *tel=(powertask_telemetry_t *)calloc(1,
-        sizeof(powertask_telemetry_header_t)+len);
-    return tel;
+    powertask_energy_t battery_after=powertask_get_battery();
+    if (battery_after<battery_before) return battery_before-battery_after;
+    return task->attribute->energy_per_run*runs;
+}
+
+/// Charge this group for the energy its task just used.
+static void powertask_group_charge(powertask_group_state_t *group,uint32_t used)
+{
+    group->stats.runs++;
+    group->stats.energy+=used;
+    
+    // Even a free task costs a little, so it can't hold the front of the line forever.
+    if (used==0) used=1;
+    group_virtual_time=group->pass;
+    group->pass+=(uint64_t)used*(group->stride?group->stride:POWERTASK_STRIDE_ONE);
+}
+
+void powertask_group_share(powertask_group_t group,uint16_t tickets)
+{
+    if (group>=POWERTASK_GROUP_MAX) powertask_fatal("Invalid group in powertask_group_share",group);
+    if (tickets==0) tickets=1;
+    groups[group].stats.tickets=tickets;
+    groups[group].stride=POWERTASK_STRIDE_ONE/tickets;
+}
+
+const powertask_group_stats_t *powertask_group_stats(powertask_group_t group)
+{
+    if (group>=POWERTASK_GROUP_MAX) powertask_fatal("Invalid group in powertask_group_stats",group);
+    if (groups[group].stats.tickets==0) groups[group].stats.tickets=1;
+    return &groups[group].stats;
 }
 
 /// Make this task runnable--the task is added to the runnable queue.
@@ -160,111 +507,494 @@ powertask_telemetry_t *powertask_make_runnable(powertask_ID_t ID)
 {
     powertask_task_t *task=powertask_task_lookup(ID);
     if (task==0) powertask_fatal("Invalid task in powertask_make_runnable",ID);
+    return powertask_task_make_runnable(task);
+}
+
+void powertask_task_allocate(powertask_task_t *task)
+{
+#ifdef POWERTASK_HOSTED
+    if ((task->attribute->flags&POWERTASK_FLAG_ISOLATED) && task->attribute->input_depth<=1)
+    { // isolated workers read and write these in place (they're never freed)
+        if (task->input==0) task->input=powertask_isolate_allocate(task->attribute->input_length);
+        if (task->output==0) task->output=powertask_isolate_allocate(task->attribute->output_length);
+    }
+#endif
+    if (task->input==0) {
+        task->input=powertask_allocate_telemetry(task->attribute->input_length);
+        task->allocated|=POWERTASK_ALLOCATED_INPUT;
+    }
+    if (task->output==0) {
+        task->output=powertask_allocate_telemetry(task->attribute->output_length);
+        task->allocated|=POWERTASK_ALLOCATED_OUTPUT;
+    }
+}
+
+powertask_telemetry_t *powertask_task_make_runnable(powertask_task_t *task)
+{
+    powertask_ID_t ID=task->attribute->ID;
     DEBUGF(3,("powertask_make_runnable %04x (%s)\n",(int)ID,task->attribute->name));
     
     // Is it already runnable?
-    if (task->prev!=0) {
+    if (task->prev!=0 || task==idle_task) {
+        if (task->attribute->batch_function) return powertask_batch_queue(task);
+        if (task->attribute->input_depth>1) return powertask_input_stage(task);
+        if (task->shared) powertask_shared_done(task); // the new input replaces it
         DEBUGF(2,("  ignoring request to make task %04x runnable, already runnable",(int)ID));
         return task->input; //<- could this cause disaster?  fatal instead?
     }
     
+    // Is it being held off or quarantined after failures?
+    powertask_telemetry_t *held=powertask_failure_hold(task);
+    if (held) return held;
+    
     // Allocate telemetry slots (will be needed when it runs)
-    if (task->input==0) 
-        task->input=powertask_allocate_telemetry(task->attribute->input_length);
-    if (task->output==0) 
-        task->output=powertask_allocate_telemetry(task->attribute->output_length);
+    powertask_telemetry_t *input;
+    if (task->attribute->batch_function) 
+        input=powertask_batch_queue(task);
+    else 
+    {
+        powertask_task_allocate(task);
+        input=task->input;
+    }
     
-    // Link into doubly linked list of runnable tasks
-    if (runnable_tasks==0) 
-    { // first time running any task!
+    // Link into doubly linked list of runnable tasks in this group
+    powertask_group_state_t *group=&groups[task->attribute->group];
+    if (group->runnable==0) 
+    { // first runnable task in this group
         task->prev=task;
         task->next=task;
-        runnable_tasks=task;
+        group->runnable=task;
+        powertask_group_activate(group);
     }
     else 
     { // link into existing list of runnable tasks
-        task->next=runnable_tasks->next;
-        runnable_tasks->next=task;
-        task->prev=runnable_tasks;
-        runnable_tasks=task; // cut into line?
+        task->next=group->runnable->next;
+        task->next->prev=task;
+        group->runnable->next=task;
+        task->prev=group->runnable;
+        group->runnable=task; // cut into line?
     }
+    runnable_count++;
+    queued_energy+=task->attribute->energy_per_run;
+    if (task->periodic) powertask_periodic_runnable(task,1);
+    task->waiting_since=powertask_get_time();
+    task->region_checked=0;
     
     // Rely on caller to fill in telemetry data (is this right?)
-    return task->input;
+    return input;
+}
+
+int powertask_runnable_count(void)
+{
+    return runnable_count;
+}
+
+uint32_t powertask_queued_energy(void)
+{
+    return queued_energy;
 }
 
 powertask_energy_t powertask_current_battery=30000;  // <- FIXME: need a real battery interface
+void powertask_set_battery(powertask_energy_t battery)
+{
+    powertask_current_battery=battery;
+}
+powertask_energy_t powertask_get_battery(void)
+{
+    return powertask_current_battery;
+}
 
-// Remove the current task from the runnable_tasks list,
-//  and point to the previous task.
+// Remove the current task from its group's runnable list,
+//  and point to the next task.
 void remove_task(powertask_task_t *task)
 {
     DEBUGF(3,("  removing %04x (%s) from the run queue\n",
         (int)task->attribute->ID,task->attribute->name));  
+    powertask_group_state_t *group=&groups[task->attribute->group];
     task->prev->next=task->next;
     task->next->prev=task->prev;
-    if (task==runnable_tasks)
-        runnable_tasks=task->next;
+    if (task==group->runnable)
+        group->runnable=task->next;
+    if (task==group->runnable) 
+    { // it was the last task in this group
+        group->runnable=0;
+        powertask_group_deactivate(group);
+    }
+    task->prev=task->next=0; // not runnable anymore
+    runnable_count--;
+    queued_energy-=task->attribute->energy_per_run;
+    if (task==reserved_task) reserved_task=0;
+    if (task==bypassed_task) bypassed_task=0;
+    if (task->periodic) powertask_periodic_runnable(task,0);
+    if (task->shared) powertask_shared_done(task);
 }
 
 
+int powertask_unregister(powertask_ID_t ID)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) return 0;
+    if (task==idle_task) powertask_fatal("Can't unregister the idle task",ID);
+    if (task==powertask_current_task) powertask_fatal("A task can't unregister itself while running",ID);
+    DEBUGF(2,("powertask_unregister %04x (%s)\n",(int)ID,task->attribute->name));
+    
+    // Drop its queued and staged commands
+    if (task->prev) remove_task(task);
+    task->batch_queued=0;
+    task->input_staged=task->input_front_done=0;
+    
+    powertask_sequence_forget(ID); // while it's still registered
+    powertask_registry_remove(task);
+    powertask_failure_forget(task);
+    if (task->timed_waiting) powertask_timed_forget(task);
+    if (task->periodic) powertask_periodic_forget(task);
+    powertask_handle_forget(task);
+    powertask_memo_forget(ID);
+    
+    // Free what we allocated
+    int i;
+    if (task->batch_inputs) {
+        int max=task->attribute->batch_max;
+        if (max==0) max=1;
+        for (i=0;i<max;i++) {
+            free(task->batch_inputs[i]);
+            free(task->batch_outputs[i]);
+        }
+        free(task->batch_inputs);
+        free(task->batch_outputs);
+    }
+    if (task->input_back) {
+        for (i=0;i<task->attribute->input_depth-1;i++) free(task->input_back[i]);
+        free(task->input_back);
+    }
+    free(task->pmu);
+    if (task->allocated&POWERTASK_ALLOCATED_INPUT) free(task->input);
+    if (task->allocated&POWERTASK_ALLOCATED_OUTPUT) free(task->output);
+    if (task->allocated&POWERTASK_ALLOCATED_TASK) free(task);
+    return 1;
+}
+
+int powertask_attribute_compatible(const powertask_attribute_t *a,const powertask_attribute_t *b)
+{
+    return a->ID==b->ID && a->group==b->group 
+        && a->input_length==b->input_length
+        && a->output_length==b->output_length
+        && a->batch_max==b->batch_max
+        && a->input_depth==b->input_depth
+        && (a->batch_function==0)==(b->batch_function==0);
+}
+
+int powertask_replace(const powertask_attribute_t *attribute)
+{
+    powertask_task_t *task=powertask_task_lookup(attribute->ID);
+    if (task==0) return 0;
+    const powertask_attribute_t *old=task->attribute;
+    if (!powertask_attribute_compatible(attribute,old))
+    {
+        DEBUGF(1,("powertask_replace %04x: new attributes don't match the old ones\n",(int)attribute->ID));
+        return 0;
+    }
+    DEBUGF(2,("powertask_replace %04x (%s) with %s\n",(int)attribute->ID,old->name,attribute->name));
+    if (task->prev) queued_energy+=attribute->energy_per_run-old->energy_per_run;
+    task->attribute=attribute;
+    powertask_memo_forget(attribute->ID); // cached outputs came from the old function
+    return 1;
+}
+
+/// This task's command has finished: if it has another command staged, 
+///   it stays runnable to run that next; otherwise it leaves the run queue.
+///   Then any handles waiting on the command finish.
+static void powertask_command_done(powertask_task_t *task,powertask_result_t result)
+{
+    task->completions++;
+    task->node_received=0;
+    if (task->input_staged==0) {
+        remove_task(task);
+    }
+    else {
+        DEBUGF(3,("  task %04x has %d more staged commands\n",
+            (int)task->attribute->ID,(int)task->input_staged));
+        task->input_front_done=1; // the swap happens when it's dispatched
+        task->waiting_since=powertask_get_time();
+        task->region_checked=0;
+        groups[task->attribute->group].runnable=task->next; // move on to other tasks
+    }
+    // After it's off the queue, so callbacks can make it runnable again
+    if (task->handles) powertask_handle_complete(task,result);
+    if (task->timed_waiting) powertask_timed_resume(task);
+}
+
+/// If this OFFLOAD task's next command goes to another node, finish it here
+///   and return 1.  Returns 0 if it should run here.
+static int powertask_offload(powertask_task_t *task)
+{
+    if (!(task->attribute->flags&POWERTASK_FLAG_OFFLOAD)) return 0;
+    if (task->input_front_done) powertask_input_swap(task); // send its next command, not the finished one
+    if (!powertask_node_offload(task)) return 0;
+    powertask_command_done(task,POWERTASK_RESULT_FAIL_QUIET+POWERTASK_REASON_FORWARDED);
+    return 1;
+}
+
+/// Return the task this group should try next: usually its current task, but
+///   if that needs a performance state switch, a task a few places back that 
+///   can run at the current state (and be paid for) goes first, to batch switches.
+static powertask_task_t *powertask_group_pick(powertask_group_state_t *group,
+    powertask_energy_t reserved_battery)
+{
+    powertask_task_t *front=group->runnable, *task;
+    int i;
+    if (powertask_perf_matches(front) || !powertask_perf_may_bypass(front)
+      || front->stats.skip_streak>=POWERTASK_AGING_PRIORITY_SKIPS) 
+        return front;
+    for (i=1, task=front->next; i<POWERTASK_PERF_LOOKAHEAD && task!=front; i++, task=task->next)
+    {
+        if (task->attribute->perf_state!=POWERTASK_PERF_ANY && powertask_perf_matches(task)
+          && powertask_current_battery >= task->attribute->minimum_battery
+          && (reserved_task==0 
+            || powertask_current_battery >= reserved_battery + task->attribute->energy_per_run))
+        {
+            DEBUGF(3,("run_next runs %04x (%s) ahead of %04x to save a performance switch\n",
+                (int)task->attribute->ID,task->attribute->name,(int)front->attribute->ID));
+            powertask_perf_bypass(front);
+            return task;
+        }
+    }
+    return front;
+}
+
 /// Run the next task.  Returns 1 if tasks still exist to run.
 int powertask_run_next(void)
 {
-    powertask_task_t *task=runnable_tasks;    
-    powertask_energy_t need_battery=task->attribute->minimum_battery;
-
+    powertask_time_t now=powertask_get_time();
+    powertask_timed_release(now); // time-tagged commands that are due join the queue
+    powertask_counters.passes++;
+    
+    powertask_group_state_t *skipped[POWERTASK_GROUP_MAX];
+    int skip_count=0, i;
+    powertask_group_state_t *group=0;
+    powertask_task_t *task=0;
+    
+    // A released periodic task goes first, shortest period first, if the battery can pay for it
+    //   without spending a starved task's reserved energy.
+    if (powertask_periodic_count) 
+    {
+        task=powertask_periodic_pick(powertask_current_battery,reserved_task);
+        if (task) {
+            group=&groups[task->attribute->group];
+            powertask_group_deactivate(group); // re-added below if it still has tasks
+            if (task!=group->runnable) bypassed_task=group->runnable; // it keeps its place in line
+            group->runnable=task;
+            if (powertask_offload(task))
+            { // another node runs it: the group goes back in line for the other tasks
+                if (bypassed_task) group->runnable=bypassed_task;
+                bypassed_task=0;
+                if (group->runnable) powertask_group_requeue(group);
+                group=0;
+                task=0;
+            }
+        }
+    }
+    
+    // Then a starved task with reserved energy, once the battery can pay for it.
+    powertask_energy_t reserved_battery=0;
+    if (task==0 && reserved_task) 
+    {
+        reserved_battery=reserved_task->attribute->minimum_battery;
+        if (powertask_current_battery >= reserved_battery)
+        {
+            task=reserved_task;
+            group=&groups[task->attribute->group];
+            powertask_group_deactivate(group); // re-added below if it still has tasks
+            group->runnable=task;
+        }
+        else if (++reserved_passes>POWERTASK_AGING_HOLD_MAX)
+        {
+            DEBUGF(1,("run_next gives up reserving energy for %04x (%s)\n",
+                (int)reserved_task->attribute->ID,reserved_task->attribute->name));
+            reserved_task->stats.skip_streak=0;
+            reserved_task=0;
+        }
+    }
+    
+    // Try each group's current task, lowest pass first, 
+    //   until we find one we have the battery energy to run.
+    while (task==0 && group_heap_count>0)
+    {
+        group=group_heap[0];
+        powertask_group_deactivate(group); // re-added below if it still has tasks
+        task=powertask_group_pick(group,reserved_battery);
+        if (powertask_offload(task))
+        { // another node runs it: move on to other tasks
+            if (group->runnable && !group->heap_index) skipped[skip_count++]=group; // (a released command may requeue it)
+            group=0;
+            task=0;
+            continue;
+        }
+        if (task!=group->runnable) 
+        { // it can run now: the group's current task keeps its place in line
+            bypassed_task=group->runnable;
+            break;
+        }
+        powertask_energy_t need_battery=task->attribute->minimum_battery;
+        if (powertask_current_battery < need_battery)
+        { // not enough battery: the task ages
+            DEBUGF(3,("run_next skips %04x (%s): not enough battery, need %d have %d\n",
+                (int)task->attribute->ID,task->attribute->name,
+                (int)need_battery,(int)powertask_current_battery));   
+            group->stats.skips++;
+            task->stats.skips++;
+            powertask_counters.skips++;
+            if (task->stats.skip_streak<0xFFFF) task->stats.skip_streak++;
+            
+            if (task->stats.skip_streak>=POWERTASK_AGING_RESERVE_SKIPS && reserved_task==0)
+            {
+                DEBUGF(2,("  reserving energy for starved task %04x (%s)\n",
+                    (int)task->attribute->ID,task->attribute->name));
+                reserved_task=task;
+                reserved_passes=0;
+            }
+            // Aged tasks stay at the front of their group, young ones move aside
+            if (task->stats.skip_streak<POWERTASK_AGING_PRIORITY_SKIPS)
+                group->runnable=task->next;
+        }
+        else if (reserved_task && task!=reserved_task 
+            && powertask_current_battery < reserved_battery + task->attribute->energy_per_run)
+        { // running this would spend the starved task's energy
+            DEBUGF(3,("run_next holds back %04x (%s) for starved task\n",
+                (int)task->attribute->ID,task->attribute->name));
+            task->stats.held++;
+            group->runnable=task->next;
+        }
+        else break; // we have the energy to run this now
+        
+        // Move on to other tasks
+        skipped[skip_count++]=group;
+        group=0;
+        task=0;
+    }
+    if (task==0) { // nothing else can run
+        task=idle_task;
+        powertask_counters.idle++;
+    }
+    
     DEBUGF(3,("run_next chooses %04x (%s)\n",
         (int)task->attribute->ID,task->attribute->name));
-    if (powertask_current_battery >= need_battery)
-    { // we have the energy to run this now
+    {
         powertask_result_t result;
-        DEBUGF(3,("  running function %p\n",task->attribute->function));
-        result=task->attribute->function(task->input,task->output);
-        DEBUGF(3,("  function returns %04x\n",result));
+        powertask_energy_t battery_before=powertask_current_battery;
+        powertask_timed_started(task,now);
+        if (group) 
+        { // it's a real task, not idle
+            powertask_time_t wait=now-task->waiting_since;
+            if (now<task->waiting_since) wait=0;
+            if (wait>task->stats.max_wait) task->stats.max_wait=wait;
+            task->stats.runs++;
+            task->stats.skip_streak=0;
+            task->perf_bypassed=0;
+            task->node_received=0;
+            if (task==reserved_task) reserved_task=0; // it got its energy
+            if (task->input_front_done) powertask_input_swap(task); // start its next command
+        }
+        uint32_t used=0, memo_hash=0;
+        powertask_time_t run_start=0; // measured only while there are periodic tasks
+        if (powertask_periodic_count && group) run_start=powertask_get_time();
+        int deterministic=(task->attribute->flags&POWERTASK_FLAG_DETERMINISTIC) && task->shared==0
+            && !task->attribute->batch_function; // a hit would finish its whole batch
+        if ((task->attribute->flags&POWERTASK_FLAG_REGION_INPUT) && !powertask_region_check(task))
+        { // don't run it on bad data
+            result=POWERTASK_RESULT_FAIL_QUIET+POWERTASK_REASON_BAD_REGION;
+        }
+        else if (deterministic && powertask_memo_lookup(task,&memo_hash))
+        { // same input as a recent run: send its output, don't run the function
+            DEBUGF(3,("  using cached result\n"));
+            result=POWERTASK_RESULT_OK;
+        }
+        else if (task->attribute->batch_function)
+        { // run every queued input together
+            DEBUGF(3,("  running batch function %p on %d inputs\n",
+                task->attribute->batch_function,(int)task->batch_queued));
+            uint32_t count=task->batch_queued;
+            powertask_perf_apply(task);
+            powertask_current_task=task;
+            powertask_pmu_begin();
+            result=powertask_batch_run(task);
+            powertask_pmu_end(task);
+            powertask_current_task=0;
+            used=powertask_energy_used(task,battery_before,count);
+        }
+        else 
+        {
+            DEBUGF(3,("  running function %p\n",task->attribute->function));
+            powertask_perf_apply(task);
+            powertask_current_task=task;
+            const powertask_telemetry_t *input=task->input;
+            if (task->shared) input=powertask_shared_telemetry(task->shared);
+#ifdef POWERTASK_HOSTED
+            if (task->attribute->flags&POWERTASK_FLAG_ISOLATED)
+                result=powertask_isolate_run(task,input);
+            else
+#endif
+            {
+                powertask_pmu_begin();
+                result=task->attribute->function(input,task->output);
+                powertask_pmu_end(task);
+            }
+            powertask_current_task=0;
+            DEBUGF(3,("  function returns %04x\n",result));
+            used=powertask_energy_used(task,battery_before,1);
+            if (deterministic && result==POWERTASK_RESULT_OK) powertask_memo_store(task,memo_hash);
+        }
+        if (group) {
+            powertask_counters.runs++;
+            if (result==POWERTASK_RESULT_RETRY) powertask_counters.retries++;
+            else if (result>=POWERTASK_RESULT_FAILURE) powertask_counters.failures++;
+            task->housekeeping_energy+=used;
+            powertask_group_charge(group,used);
+            if (!task->attribute->batch_function) // batches record each input's result
+                powertask_failure_record(task,result);
+            if (powertask_periodic_count) powertask_periodic_ran(task,run_start,used,result);
+        }
+        
         if (result==POWERTASK_RESULT_RETRY)
         {
             // Leave it in the runnable list, it will come around again
             
             // Move on to other tasks
-            runnable_tasks=runnable_tasks->next;
+            if (group) group->runnable=task->next;
+            task->waiting_since=powertask_get_time();
         }
         else if (result==POWERTASK_RESULT_OK)
         {
-            // FIXME: store output telemetry somewhere
-            // It's successful, remove it from the runnable list
-            remove_task(task);
+            // It's successful, send its output and remove it from the runnable list
+            if (!task->attribute->batch_function) // batches send each output
+                powertask_downlink_output(task,task->output,result);
+            powertask_command_done(task,result);
         }
         else if (result>=POWERTASK_RESULT_FAIL_QUIET && result<POWERTASK_RESULT_FAIL_OUTPUT)
         {
             // Failed without output, remove it
-            remove_task(task);
+            powertask_command_done(task,result);
         }
         else if (result>=POWERTASK_RESULT_FAIL_OUTPUT && result<POWERTASK_RESULT_LAST)
         {
-            // FIXME: store output telemetry somewhere
             // Failed with output, send it and remove it
-            remove_task(task);
+            powertask_downlink_output(task,task->output,result);
+            powertask_command_done(task,result);
         }
         else // invalid result code
         {
             powertask_fatal("task returned invalid result code",result);
         }
     }
-    else {
-        DEBUGF(3,("  not enough battery, need %d have %d\n",
-            (int)need_battery,(int)powertask_current_battery));   
-        // Move on to other tasks
-        runnable_tasks=runnable_tasks->next;
-             
-    }
+    
+    // Put the groups we looked at back in line
+    //   (the task that ran may have unregistered tasks, emptying a group)
+    if (bypassed_task) group->runnable=bypassed_task;
+    bypassed_task=0;
+    if (group && group->runnable) powertask_group_requeue(group);
+    for (i=0;i<skip_count;i++) 
+        if (skipped[i]->runnable) powertask_group_requeue(skipped[i]);
     
     // We have nothing left to run
-    return runnable_tasks!=runnable_tasks->next;
+    return runnable_count>0;
 }
-
-
-
-
-
-
@@ -0,0 +1,320 @@
+/**
+ Worst-case timing check for constant-time mode.  Run with "make ctcheck".
+
+ Runs millions of randomized scheduler operations, timing each one in
+ CPU cycles, and fails if the worst make_runnable, make_runnable_at,
+ run_next, lookup, or unregister takes longer than its bound: a multiple
+ of that operation's mean, but at least a floor.  Part of the task set
+ is registered in sorted ID order, the worst case for the default tree
+ registry.
+
+ The whole sequence is run in a few fresh processes, and each operation's
+ time is the least of its runs, so an interrupt or page fault that hits
+ one run isn't blamed on the scheduler.  Each run first touches its
+ pages and does untimed warm-up operations, so page faults and cold
+ caches aren't blamed on it either, and turns off the C library's heap
+ consolidation and trimming, whose cost unregister's free can't bound.
+
+   powertask_ctcheck [operations [bound, as a multiple of the mean]]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include "powertask.h"
+
+/// Default bound on any one operation, as a multiple of its mean time.
+#ifndef CTCHECK_BOUND
+#define CTCHECK_BOUND 20
+#endif
+/// Least bound on any one operation, in cycles (a few cache misses).
+#ifndef CTCHECK_BOUND_FLOOR
+#define CTCHECK_BOUND_FLOOR 2000
+#endif
+
+#define CTCHECK_RUNS 3
+#define CTCHECK_WARM 10000 /* untimed operations before the timed ones */
+#define CTCHECK_TASKS 512 /* 256 sorted IDs from 0x2000, 256 random IDs in 0x1000-0x17FF */
+
+#define CT_RUNNABLE 0
+#define CT_RUNNABLE_AT 1
+#define CT_RUN_NEXT 2
+#define CT_LOOKUP 3
+#define CT_UNREGISTER 4
+#define CT_REGISTER 5 /* allocates, so it's reported but not bounded */
+#define CT_BATTERY 6 /* not timed */
+#define CT_TYPES 7
+static const char *ct_names[CT_TYPES]={"make_runnable","make_runnable_at","run_next","lookup","unregister","register","set_battery"};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static uint64_t ct_ticks(void)
+{
+    _mm_lfence(); // don't start timing before earlier instructions finish
+    return __rdtsc();
+}
+#define CT_TICK_NAME "cycles"
+#else
+#include <time.h>
+static uint64_t ct_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+#define CT_TICK_NAME "ns"
+#endif
+
+static uint64_t ct_random_state=1;
+static uint32_t ct_random(void)
+{
+    uint64_t x=ct_random_state;
+    x^=x>>12; x^=x<<25; x^=x>>27;
+    ct_random_state=x;
+    return (uint32_t)((x*0x2545F4914F6CDD1Dull)>>32);
+}
+
+static powertask_result_t ct_ok(const powertask_telemetry_t *input,powertask_telemetry_t *output)
+{
+    return POWERTASK_RESULT_OK;
+}
+static powertask_result_t ct_retry(const powertask_telemetry_t *input,powertask_telemetry_t *output)
+{
+    return POWERTASK_RESULT_RETRY;
+}
+static powertask_result_t ct_fail(const powertask_telemetry_t *input,powertask_telemetry_t *output)
+{
+    return POWERTASK_RESULT_FAIL_QUIET+1;
+}
+
+static void ct_batch(int count,const powertask_telemetry_t *const *inputs,
+    powertask_telemetry_t *const *outputs,powertask_result_t *results)
+{
+    int i;
+    for (i=0;i<count;i++) results[i]=POWERTASK_RESULT_OK;
+}
+
+static powertask_attribute_t ct_attributes[CTCHECK_TASKS];
+static unsigned char ct_registered[CTCHECK_TASKS];
+
+/// Make up the task set: the same every run.
+static void ct_make_tasks(void)
+{
+    int i;
+    static unsigned char used[0x800];
+    for (i=0;i<CTCHECK_TASKS;i++) {
+        powertask_attribute_t *a=&ct_attributes[i];
+        if (i<CTCHECK_TASKS/2) a->ID=0x2000+i;
+        else {
+            int low;
+            do low=ct_random()%0x800; while (used[low]);
+            used[low]=1;
+            a->ID=0x1000+low;
+        }
+        a->name="CtCheck";
+        uint32_t kind=ct_random()%10;
+        a->function=kind==0?ct_fail:kind==1?ct_retry:ct_ok;
+        a->minimum_battery=ct_random()%3==0?ct_random()%800:0;
+        a->energy_per_run=ct_random()%20;
+        a->input_length=ct_random()%9;
+        a->output_length=ct_random()%17;
+        a->group=ct_random()%POWERTASK_GROUP_MAX;
+        uint32_t queue=ct_random()%16;
+        if (queue==0) { // batch queue
+            a->batch_function=ct_batch;
+            a->batch_max=1+ct_random()%8;
+        }
+        else if (queue==1) a->input_depth=2+ct_random()%3; // back buffers
+    }
+}
+
+/// Write to every private writable page, so first-touch page faults
+///   (and copy-on-write faults after the fork) happen now, not during 
+///   the operations we're timing.
+static void ct_touch_pages(void)
+{
+    FILE *f=fopen("/proc/self/maps","r");
+    char line[512];
+    long page=sysconf(_SC_PAGESIZE);
+    if (f==0) return;
+    while (fgets(line,sizeof(line),f)) {
+        unsigned long start, end;
+        char perms[8];
+        if (sscanf(line,"%lx-%lx %7s",&start,&end,perms)!=3 || strcmp(perms,"rw-p")!=0) continue;
+        for (;start<end;start+=page) {
+            volatile char *p=(volatile char *)start;
+            *p=*p;
+        }
+    }
+    fclose(f);
+}
+
+/// Return a random task index that is (or isn't) registered, or -1 after a few tries.
+static int ct_pick(int registered)
+{
+    int tries;
+    for (tries=0;tries<16;tries++) {
+        int i=ct_random()%CTCHECK_TASKS;
+        if (ct_registered[i]==registered) return i;
+    }
+    return -1;
+}
+
+/// Do one random operation at time "now": return its type, and store its time.
+static int ct_op(powertask_time_t now,uint32_t *ticks)
+{
+    uint32_t r=ct_random()%100;
+    int t, type;
+    uint64_t start=0, end=0;
+    if (r<30 && (t=ct_pick(1))>=0) {
+        type=CT_RUNNABLE;
+        start=ct_ticks();
+        powertask_make_runnable(ct_attributes[t].ID);
+        end=ct_ticks();
+    }
+    else if (r<35 && (t=ct_pick(1))>=0) {
+        type=CT_RUNNABLE_AT;
+        powertask_time_t when=now+ct_random()%5000;
+        start=ct_ticks();
+        powertask_make_runnable_at(ct_attributes[t].ID,when);
+        end=ct_ticks();
+    }
+    else if (r<70) {
+        type=CT_RUN_NEXT;
+        start=ct_ticks();
+        powertask_run_next();
+        end=ct_ticks();
+    }
+    else if (r<80) {
+        type=CT_LOOKUP;
+        t=ct_random()%CTCHECK_TASKS;
+        start=ct_ticks();
+        powertask_task_lookup(ct_attributes[t].ID);
+        end=ct_ticks();
+    }
+    else if (r<85 && (t=ct_pick(1))>=0) {
+        type=CT_UNREGISTER;
+        start=ct_ticks();
+        powertask_unregister(ct_attributes[t].ID);
+        end=ct_ticks();
+        ct_registered[t]=0;
+    }
+    else if (r<90 && (t=ct_pick(0))>=0) {
+        type=CT_REGISTER;
+        start=ct_ticks();
+        powertask_register(&ct_attributes[t]);
+        end=ct_ticks();
+        ct_registered[t]=1;
+    }
+    else {
+        type=CT_BATTERY;
+        powertask_set_battery(ct_random()%1000);
+    }
+    *ticks=end-start>0xFFFFFFFFull?0xFFFFFFFFu:(uint32_t)(end-start);
+    return type;
+}
+
+/// Run CTCHECK_WARM operations to warm up, then every timed operation,
+///   recording its type and time.
+static void ct_run(int ops,unsigned char *type,uint32_t *ticks)
+{
+    int i;
+    uint32_t warm;
+    powertask_debug(0);
+#ifdef __GLIBC__
+    // unregister's free would sometimes consolidate the whole heap or give it back to the OS
+    mallopt(M_MXFAST,0);
+    mallopt(M_TRIM_THRESHOLD,64<<20);
+#endif
+    powertask_failure_policy_t policy={1000,100000,8,0};
+    powertask_failure_policy(&policy);
+    for (i=0;i<CTCHECK_TASKS/2;i++)
+    { // ascending IDs: the tree registry becomes a list
+        powertask_register(&ct_attributes[i]);
+        ct_registered[i]=1;
+    }
+    powertask_set_battery(500);
+    ct_touch_pages();
+    powertask_time_t now=0;
+    for (i=0;i<CTCHECK_WARM;i++) {
+        now+=10;
+        powertask_set_time(now);
+        ct_op(now,&warm);
+    }
+    for (i=0;i<ops;i++) {
+        now+=10;
+        powertask_set_time(now);
+        type[i]=ct_op(now,&ticks[i]);
+    }
+}
+
+int main(int argc,char *argv[])
+{
+    int ops=argc>1?atoi(argv[1]):2000000;
+    uint32_t bound=argc>2?strtoul(argv[2],0,0):CTCHECK_BOUND;
+    int r, i;
+    if (ops<1) return 1;
+    unsigned char *type=(unsigned char *)mmap(0,ops,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    uint32_t *ticks=(uint32_t *)mmap(0,(size_t)CTCHECK_RUNS*ops*sizeof(uint32_t),
+        PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    if (type==MAP_FAILED || ticks==MAP_FAILED) return 1;
+
+#ifdef POWERTASK_CONSTANT_TIME
+    printf("ctcheck: constant-time mode, %d operations after %d to warm up, bound %u times the mean (at least %u %s)\n",
+        ops,CTCHECK_WARM,(unsigned int)bound,CTCHECK_BOUND_FLOOR,CT_TICK_NAME);
+#else
+    printf("ctcheck: default (tree) mode, %d operations after %d to warm up, bound %u times the mean (at least %u %s)\n",
+        ops,CTCHECK_WARM,(unsigned int)bound,CTCHECK_BOUND_FLOOR,CT_TICK_NAME);
+#endif
+    ct_random_state=0xC7C4EC4;
+    ct_make_tasks();
+    for (r=0;r<CTCHECK_RUNS;r++) {
+        fflush(stdout);
+        pid_t pid=fork();
+        if (pid==0) { // every run starts from the same registry and random state
+            ct_run(ops,type,ticks+(size_t)r*ops);
+            _exit(0);
+        }
+        int status=0;
+        waitpid(pid,&status,0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)!=0) {
+            printf("ctcheck: run %d failed (status %d)\n",r,status);
+            return 1;
+        }
+    }
+
+    // Each operation's time is the least of its runs
+    uint32_t count[CT_TYPES], worst[CT_TYPES];
+    uint64_t total[CT_TYPES];
+    int worst_op[CT_TYPES];
+    memset(count,0,sizeof(count)); memset(worst,0,sizeof(worst)); memset(total,0,sizeof(total));
+    for (i=0;i<ops;i++) {
+        uint32_t t=ticks[i];
+        for (r=1;r<CTCHECK_RUNS;r++) if (ticks[(size_t)r*ops+i]<t) t=ticks[(size_t)r*ops+i];
+        int k=type[i];
+        count[k]++;
+        total[k]+=t;
+        if (t>=worst[k]) { worst[k]=t; worst_op[k]=i; }
+    }
+
+    int failed=0;
+    for (i=0;i<CT_BATTERY;i++) {
+        if (count[i]==0) continue;
+        int bounded=(i!=CT_REGISTER);
+        uint64_t limit=bound*(total[i]/count[i]);
+        if (limit<CTCHECK_BOUND_FLOOR) limit=CTCHECK_BOUND_FLOOR;
+        int over=bounded && worst[i]>limit;
+        printf("  %-17s %8u calls, mean %6.0f, worst %7u %s at op %d",ct_names[i],(unsigned int)count[i],
+            (double)total[i]/count[i],(unsigned int)worst[i],CT_TICK_NAME,worst_op[i]);
+        if (bounded) printf(", bound %u%s\n",(unsigned int)limit,over?"  OVER BOUND":"");
+        else printf("  (allocates: not bounded)\n");
+        if (over) failed=1;
+    }
+    printf("ctcheck: %s\n",failed?"FAILED":"passed");
+    return failed;
+}
@@ -0,0 +1,35 @@
+/**
+ Duplicate command suppression: commands carrying a sequence number are
+ checked against a sliding window of the task's recent sequence numbers,
+ so retransmitted commands don't cost a second run.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include "powertask_internal.h"
+
+static powertask_dedupe_stats_t dedupe_stats;
+
+powertask_telemetry_t *powertask_task_make_runnable_sequenced(powertask_task_t *task,uint32_t sequence)
+{
+    if (!powertask_window_accept(&task->commands_seen,sequence)) {
+        DEBUGF(2,("  dropping duplicate command %u for task %04x\n",
+            (unsigned int)sequence,(int)task->attribute->ID));
+        dedupe_stats.suppressed++;
+        dedupe_stats.energy_saved+=task->attribute->energy_per_run;
+        return 0;
+    }
+    dedupe_stats.accepted++;
+    return powertask_task_make_runnable(task);
+}
+
+powertask_telemetry_t *powertask_make_runnable_sequenced(powertask_ID_t ID,uint32_t sequence)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) powertask_fatal("Invalid task in powertask_make_runnable_sequenced",ID);
+    return powertask_task_make_runnable_sequenced(task,sequence);
+}
+
+const powertask_dedupe_stats_t *powertask_dedupe_stats(void)
+{
+    return &dedupe_stats;
+}
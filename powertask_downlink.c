@@ -0,0 +1,137 @@
+/**
+ Downlink store: task outputs and streamed output chunks become
+ downlink records.  Records go to a platform sink (like a flash archive),
+ or by default into a RAM ring buffer that the radio drains.
+
+ Streaming lets a task send outputs much bigger than RAM, one chunk per
+ run, without ever holding the whole thing.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+static powertask_downlink_sink_t downlink_sink=0;
+static powertask_downlink_stats_t downlink_stats;
+
+/// The RAM ring: records are stored as a header then data, wrapping around.
+static powertask_data_t ring[POWERTASK_DOWNLINK_BYTES];
+static uint32_t ring_read=0; // index of the oldest record
+static uint32_t ring_write=0; // index to store the next record
+
+void powertask_downlink_set_sink(powertask_downlink_sink_t sink)
+{
+    downlink_sink=sink;
+}
+
+const powertask_downlink_stats_t *powertask_downlink_stats(void)
+{
+    return &downlink_stats;
+}
+
+/// Copy bytes into the ring at ring_write, wrapping around.
+static void ring_put(const void *src,uint32_t n)
+{
+    const powertask_data_t *s=(const powertask_data_t *)src;
+    uint32_t first=POWERTASK_DOWNLINK_BYTES-ring_write;
+    if (first>n) first=n;
+    memcpy(&ring[ring_write],s,first);
+    memcpy(&ring[0],s+first,n-first);
+    ring_write=(ring_write+n)%POWERTASK_DOWNLINK_BYTES;
+}
+
+/// Copy n bytes out of the ring starting at index "from", wrapping around.
+static void ring_get(void *dest,uint32_t from,uint32_t n)
+{
+    powertask_data_t *d=(powertask_data_t *)dest;
+    uint32_t first=POWERTASK_DOWNLINK_BYTES-from;
+    if (first>n) first=n;
+    memcpy(d,&ring[from],first);
+    memcpy(d+first,&ring[0],n-first);
+}
+
+/// Remove the oldest record from the ring.
+static void ring_drop_oldest(void)
+{
+    powertask_downlink_header_t h;
+    ring_get(&h,ring_read,sizeof(h));
+    uint32_t n=sizeof(h)+h.length;
+    ring_read=(ring_read+n)%POWERTASK_DOWNLINK_BYTES;
+    downlink_stats.ring_used-=n;
+}
+
+/// Store a record in the RAM ring, dropping old records to make room.
+static void ring_store(const powertask_downlink_header_t *header,const powertask_data_t *data)
+{
+    uint32_t n=sizeof(*header)+header->length;
+    if (n>POWERTASK_DOWNLINK_BYTES) {
+        DEBUGF(1,("  downlink record from %04x too big for POWERTASK_DOWNLINK_BYTES\n",(int)header->ID));
+        downlink_stats.dropped++;
+        return;
+    }
+    while (POWERTASK_DOWNLINK_BYTES-downlink_stats.ring_used<n) {
+        ring_drop_oldest();
+        downlink_stats.dropped++;
+    }
+    ring_put(header,sizeof(*header));
+    ring_put(data,header->length);
+    downlink_stats.ring_used+=n;
+    if (downlink_stats.ring_used>downlink_stats.ring_high_water)
+        downlink_stats.ring_high_water=downlink_stats.ring_used;
+}
+
+int powertask_downlink_read(powertask_downlink_header_t *header,powertask_data_t *data,uint32_t max)
+{
+    if (downlink_stats.ring_used==0) return 0;
+    ring_get(header,ring_read,sizeof(*header));
+    if (max>header->length) max=header->length;
+    ring_get(data,(ring_read+sizeof(*header))%POWERTASK_DOWNLINK_BYTES,max);
+    ring_drop_oldest();
+    return 1;
+}
+
+/// Send one record to the sink or ring.
+static void downlink_store(const powertask_downlink_header_t *header,const powertask_data_t *data)
+{
+    DEBUGF(4,("  downlink record from %04x: type %x, stream %d chunk %d, %d bytes\n",
+        (int)header->ID,(int)header->type,(int)header->stream,
+        (int)header->sequence,(int)header->length));
+    downlink_stats.records++;
+    downlink_stats.bytes+=header->length;
+    if (downlink_sink) downlink_sink(header,data);
+    else ring_store(header,data);
+}
+
+void powertask_downlink_output(powertask_task_t *task,const powertask_telemetry_t *output,
+    powertask_result_t result)
+{
+    if (task->attribute->output_length==0) return; // nothing to send
+    powertask_downlink_header_t h;
+    h.ID=task->attribute->ID;
+    h.type=POWERTASK_DOWNLINK_OUTPUT|POWERTASK_DOWNLINK_FINAL;
+    h.stream=0;
+    h.result=result;
+    h.sequence=0;
+    h.length=task->attribute->output_length;
+    downlink_store(&h,output->data);
+}
+
+void powertask_stream_write(const void *data,uint32_t length,int final)
+{
+    powertask_task_t *task=powertask_current_task;
+    if (task==0) powertask_fatal("powertask_stream_write called outside a task function",0);
+
+    powertask_downlink_header_t h;
+    h.ID=task->attribute->ID;
+    h.type=POWERTASK_DOWNLINK_STREAM|(final?POWERTASK_DOWNLINK_FINAL:0);
+    h.stream=task->stream_count;
+    h.result=0;
+    h.sequence=task->stream_sequence++;
+    h.length=length;
+    downlink_store(&h,(const powertask_data_t *)data);
+
+    if (final) { // next chunk starts a new stream
+        task->stream_count++;
+        task->stream_sequence=0;
+    }
+}
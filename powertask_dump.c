@@ -0,0 +1,222 @@
+/**
+ Memory and log dumps: the builtin MemoryRead and LogRead tasks stream
+ a range of bytes to downlink one chunk per run, returning RETRY until
+ the range is done, so a big dump is interleaved with other work.  A
+ shared byte-rate budget keeps dumps from using all of the downlink.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include "powertask_internal.h"
+
+/// The progress of one dump task.
+struct dump_t {
+    int active; // 1 if a dump is in progress
+    uintptr_t position; // next address or log offset to send
+    uint32_t remaining; // bytes left to send
+    uint32_t sent; // bytes sent so far
+};
+static struct dump_t dump_memory, dump_log;
+
+/// Memory that MemoryRead may read.
+static struct {
+    uintptr_t base;
+    uint32_t length;
+} dump_windows[POWERTASK_MEMORY_WINDOWS];
+static int dump_window_count=0;
+
+static powertask_log_reader_t dump_reader=0;
+
+static uint32_t dump_rate=0; // bytes per second, 0 if unlimited
+static uint64_t dump_allowance=0; // budget not yet spent, in millionths of a byte
+static powertask_time_t dump_refilled=0; // time the budget was last topped up
+static powertask_dump_stats_t dump_stats;
+
+int powertask_memory_window(const void *base,uint32_t length)
+{
+    if (dump_window_count>=POWERTASK_MEMORY_WINDOWS) return 0;
+    dump_windows[dump_window_count].base=(uintptr_t)base;
+    dump_windows[dump_window_count].length=length;
+    dump_window_count++;
+    return 1;
+}
+
+void powertask_log_reader(powertask_log_reader_t reader)
+{
+    dump_reader=reader;
+}
+
+void powertask_dump_rate(uint32_t bytes_per_second)
+{
+    dump_rate=bytes_per_second;
+    dump_allowance=0;
+    dump_refilled=powertask_get_time();
+}
+
+const powertask_dump_stats_t *powertask_dump_stats(void)
+{
+    return &dump_stats;
+}
+
+/// Read big-endian operands
+static uint32_t dump_read32(const powertask_data_t *p)
+{
+    return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+/// Return 1 if this address range lies inside a memory window.
+static int dump_readable(uint64_t address,uint32_t length)
+{
+    int w;
+    for (w=0;w<dump_window_count;w++) {
+        uintptr_t base=dump_windows[w].base;
+        uint32_t size=dump_windows[w].length;
+        if (address>=base && length<=size && address-base<=size-length) return 1;
+    }
+    return 0;
+}
+
+/// Return how many bytes this run may send, up to a chunk, or 0 if the
+///   byte rate budget is spent.
+static uint32_t dump_budget(const struct dump_t *d)
+{
+    uint32_t want=d->remaining<POWERTASK_DUMP_CHUNK?d->remaining:POWERTASK_DUMP_CHUNK;
+    if (dump_rate==0 || want==0) return want;
+
+    // Top up the budget for the time since the last run, holding at most one chunk
+    powertask_time_t now=powertask_get_time();
+    if (now>dump_refilled) {
+        uint64_t elapsed=now-dump_refilled;
+        if (elapsed>1000000) elapsed=1000000;
+        dump_allowance+=elapsed*dump_rate;
+        if (dump_allowance>POWERTASK_DUMP_CHUNK*1000000ull) dump_allowance=POWERTASK_DUMP_CHUNK*1000000ull;
+    }
+    dump_refilled=now;
+
+    if (dump_allowance<want*1000000ull) {
+        dump_stats.throttled++;
+        return 0;
+    }
+    dump_allowance-=want*1000000ull;
+    return want;
+}
+
+/// Record that n bytes went out.  Returns OK and the byte count as output
+///   if the dump is done, or RETRY if there's more.
+static powertask_result_t dump_advance(struct dump_t *d,uint32_t n,int done,powertask_telemetry_t *output)
+{
+    d->position+=n;
+    d->remaining-=n;
+    d->sent+=n;
+    dump_stats.chunks++;
+    dump_stats.bytes+=n;
+    if (!done) return POWERTASK_RESULT_RETRY;
+
+    powertask_data_t *p=output->data;
+    p[0]=d->sent>>24; p[1]=d->sent>>16; p[2]=d->sent>>8; p[3]=d->sent;
+    d->active=0;
+    dump_stats.dumps++;
+    return POWERTASK_RESULT_OK;
+}
+
+/// This is the builtin MemoryRead task.
+static powertask_result_t dump_memory_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    struct dump_t *d=&dump_memory;
+    if (!d->active)
+    { // start a new dump
+        uint64_t address=((uint64_t)dump_read32(input->data)<<32) | dump_read32(input->data+4);
+        uint32_t length=dump_read32(input->data+8);
+        if (!dump_readable(address,length)) {
+            DEBUGF(1,("  MemoryRead outside every window: %llx, %u bytes\n",
+                (unsigned long long)address,(unsigned int)length));
+            return POWERTASK_RESULT_FAIL_QUIET+POWERTASK_REASON_BAD_REGION;
+        }
+        d->active=1;
+        d->position=(uintptr_t)address;
+        d->remaining=length;
+        d->sent=0;
+    }
+    uint32_t n=dump_budget(d);
+    if (n==0 && d->remaining>0) return POWERTASK_RESULT_RETRY;
+    int done=(n==d->remaining);
+    powertask_stream_write((const void *)d->position,n,done);
+    return dump_advance(d,n,done,output);
+}
+
+/// This is the builtin LogRead task.
+static powertask_result_t dump_log_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    static powertask_data_t chunk[POWERTASK_DUMP_CHUNK];
+    struct dump_t *d=&dump_log;
+    if (!d->active)
+    { // start a new dump
+        if (dump_reader==0) {
+            DEBUGF(1,("  LogRead without a log reader\n"));
+            return POWERTASK_RESULT_FAIL_QUIET+POWERTASK_REASON_BAD_REGION;
+        }
+        d->active=1;
+        d->position=dump_read32(input->data);
+        d->remaining=dump_read32(input->data+4);
+        d->sent=0;
+    }
+    uint32_t n=dump_budget(d);
+    if (n==0 && d->remaining>0) return POWERTASK_RESULT_RETRY;
+    uint32_t got=n?dump_reader((uint32_t)d->position,chunk,n):0;
+    if (got>n) got=n;
+    int done=(got<n || got==d->remaining); // a short read is the end of the log
+    powertask_stream_write(chunk,got,done);
+    return dump_advance(d,got,done,output);
+}
+
+const static powertask_attribute_t attributes_memory_task={
+    POWERTASK_ID_MEMORY_READ, /* our task ID */
+    "MemoryRead", /* human-readable name */
+    0, /* minimum battery energy (Joules) */
+    dump_memory_task, /* function to run */
+    12, /* bytes of telemetry input data required */
+    4, /* bytes of telemetry output data produced */
+    0,0,0,0,0, /* group, energy_per_run, flags, batch_function, batch_max */
+    POWERTASK_DUMP_QUEUE /* commands that arrive during a dump wait their turn */
+};
+const static powertask_attribute_t attributes_log_task={
+    POWERTASK_ID_LOG_READ, /* our task ID */
+    "LogRead", /* human-readable name */
+    0, /* minimum battery energy (Joules) */
+    dump_log_task, /* function to run */
+    8, /* bytes of telemetry input data required */
+    4, /* bytes of telemetry output data produced */
+    0,0,0,0,0, /* group, energy_per_run, flags, batch_function, batch_max */
+    POWERTASK_DUMP_QUEUE /* commands that arrive during a dump wait their turn */
+};
+
+void powertask_dump_setup(void)
+{
+    powertask_register(&attributes_memory_task);
+    powertask_register(&attributes_log_task);
+}
+
+
+#ifdef POWERTASK_HOSTED
+#include <fcntl.h>
+#include <unistd.h>
+
+static int dump_log_fd=-1;
+
+static uint32_t dump_file_reader(uint32_t offset,powertask_data_t *data,uint32_t max)
+{
+    ssize_t got=pread(dump_log_fd,data,max,offset);
+    return got>0?(uint32_t)got:0;
+}
+
+int powertask_log_file(const char *path)
+{
+    int fd=open(path,O_RDONLY);
+    if (fd<0) return 0;
+    if (dump_log_fd>=0) close(dump_log_fd);
+    dump_log_fd=fd;
+    powertask_log_reader(dump_file_reader);
+    return 1;
+}
+#endif
@@ -0,0 +1,202 @@
+/**
+ Failure handling: per-task failure statistics, exponential hold-off,
+ and quarantine of tasks that keep failing.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include "powertask_internal.h"
+
+static powertask_failure_policy_t failure_policy={
+    0, /* no hold-off: it needs a running clock */
+    3600000000ull, /* longest hold-off: 1 hour */
+    8, /* failures in a row before quarantine */
+    1 /* mode changes release quarantined tasks */
+};
+
+static powertask_mode_t failure_mode=0;
+
+/// List of quarantined tasks, linked by failure.next_quarantined
+static powertask_task_t *quarantined_tasks=0;
+
+/// Ring buffer of quarantine events
+static powertask_failure_event_t failure_events[POWERTASK_FAILURE_EVENTS];
+static int failure_event_first=0; // index of the oldest unread event
+static int failure_event_count=0;
+
+/// Number of registered tasks whose input is too big to delay in the timed queue
+static int failure_oversized=0;
+
+void powertask_failure_policy(const powertask_failure_policy_t *policy)
+{
+    if (policy->holdoff_base!=0 && failure_oversized>0)
+        powertask_fatal("Hold-off needs every task's input within POWERTASK_TIMED_INPUT_MAX",failure_oversized);
+    failure_policy=*policy;
+}
+
+void powertask_failure_register(powertask_task_t *task)
+{
+    if (task->attribute->input_length<=POWERTASK_TIMED_INPUT_MAX) return;
+    if (failure_policy.holdoff_base!=0)
+        powertask_fatal("Task input too big for failure hold-off (POWERTASK_TIMED_INPUT_MAX)",task->attribute->ID);
+    failure_oversized++;
+}
+
+const powertask_failure_stats_t *powertask_failure_stats(powertask_ID_t ID)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) return 0;
+    return &task->failure;
+}
+
+/// Record a quarantine event for downlink, overwriting the oldest if full.
+static void failure_event(powertask_task_t *task,uint16_t type)
+{
+    int i=(failure_event_first+failure_event_count)%POWERTASK_FAILURE_EVENTS;
+    if (failure_event_count==POWERTASK_FAILURE_EVENTS)
+        failure_event_first=(failure_event_first+1)%POWERTASK_FAILURE_EVENTS;
+    else
+        failure_event_count++;
+
+    powertask_failure_event_t *e=&failure_events[i];
+    e->time=powertask_get_time();
+    e->ID=task->attribute->ID;
+    e->type=type;
+    e->reason=task->failure.last_reason;
+    e->consecutive=task->failure.consecutive;
+}
+
+int powertask_failure_events(powertask_failure_event_t *events,int max)
+{
+    int n=0;
+    while (n<max && failure_event_count>0) {
+        events[n++]=failure_events[failure_event_first];
+        failure_event_first=(failure_event_first+1)%POWERTASK_FAILURE_EVENTS;
+        failure_event_count--;
+    }
+    return n;
+}
+
+/// Take this task out of quarantine and hold-off.
+static void failure_release(powertask_task_t *task)
+{
+    powertask_task_t **link=&quarantined_tasks;
+    while (*link!=task) link=&(*link)->failure.next_quarantined;
+    *link=task->failure.next_quarantined;
+
+    DEBUGF(2,("  releasing %04x (%s) from quarantine\n",
+        (int)task->attribute->ID,task->attribute->name));
+    failure_event(task,POWERTASK_FAILURE_EVENT_RELEASE);
+    task->failure.quarantined=0;
+    task->failure.next_quarantined=0;
+    task->failure.consecutive=0;
+    task->failure.hold_until=0;
+    task->failure.deferred=0;
+}
+
+void powertask_failure_forget(powertask_task_t *task)
+{
+    if (task->attribute->input_length>POWERTASK_TIMED_INPUT_MAX) failure_oversized--;
+    if (!task->failure.quarantined) return;
+    powertask_task_t **link=&quarantined_tasks;
+    while (*link!=task) link=&(*link)->failure.next_quarantined;
+    *link=task->failure.next_quarantined;
+    task->failure.quarantined=0;
+}
+
+int powertask_failure_release(powertask_ID_t ID)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) powertask_fatal("Invalid task in powertask_failure_release",ID);
+    task->failure.hold_until=0;
+    task->failure.deferred=0; // a delayed command still runs at its time
+    if (!task->failure.quarantined) return 0;
+    failure_release(task);
+    return 1;
+}
+
+void powertask_set_mode(powertask_mode_t mode)
+{
+    DEBUGF(2,("powertask_set_mode %d\n",(int)mode));
+    if (mode!=failure_mode && failure_policy.release_on_mode_change)
+    {
+        while (quarantined_tasks) failure_release(quarantined_tasks);
+    }
+    failure_mode=mode;
+}
+
+powertask_mode_t powertask_get_mode(void)
+{
+    return failure_mode;
+}
+
+powertask_telemetry_t *powertask_failure_hold(powertask_task_t *task)
+{
+    powertask_failure_stats_t *f=&task->failure;
+    if (f->quarantined)
+    { // drop the command: hand back a scratch buffer that never runs
+        DEBUGF(2,("  dropping command for quarantined task %04x\n",(int)task->attribute->ID));
+        f->blocked++;
+        f->deferred=0;
+        powertask_task_allocate(task);
+        return task->input;
+    }
+    if (f->hold_until!=0 && powertask_get_time()<f->hold_until)
+    { // delay the command until the hold-off ends
+        DEBUGF(2,("  delaying command for failing task %04x\n",(int)task->attribute->ID));
+        f->blocked++;
+        if (f->deferred==0) // later commands share the one delayed command
+            f->deferred=powertask_make_runnable_at(task->attribute->ID,f->hold_until);
+        return f->deferred;
+    }
+    f->deferred=0;
+    return 0; // go ahead
+}
+
+void powertask_failure_record(powertask_task_t *task,powertask_result_t result)
+{
+    powertask_failure_stats_t *f=&task->failure;
+    if (result==POWERTASK_RESULT_OK)
+    { // success resets the count
+        f->consecutive=0;
+        f->hold_until=0;
+        return;
+    }
+    if (result<POWERTASK_RESULT_FAILURE) return; // RETRY isn't a failure
+
+    // Count this reason code
+    uint16_t reason=result&0x0FFF;
+    int i;
+    f->failures++;
+    f->last_reason=reason;
+    if (f->consecutive<0xFFFF) f->consecutive++;
+    for (i=0;i<POWERTASK_FAILURE_REASONS;i++) {
+        if (f->reasons[i].count==0) f->reasons[i].reason=reason; // new reason
+        if (f->reasons[i].reason==reason) {
+            f->reasons[i].count++;
+            break;
+        }
+    }
+    if (i==POWERTASK_FAILURE_REASONS) f->other_reasons++;
+
+    // Hold off, doubling with each failure in a row
+    if (failure_policy.holdoff_base!=0)
+    {
+        powertask_time_t hold=failure_policy.holdoff_max;
+        int shift=f->consecutive-1;
+        if (shift<32 && (failure_policy.holdoff_base<<shift)<hold)
+            hold=failure_policy.holdoff_base<<shift;
+        f->hold_until=powertask_get_time()+hold;
+    }
+
+    // Quarantine
+    if (failure_policy.quarantine_after!=0 && !f->quarantined
+      && f->consecutive>=failure_policy.quarantine_after)
+    {
+        DEBUGF(1,("  quarantining %04x (%s) after %d failures, reason %03x\n",
+            (int)task->attribute->ID,task->attribute->name,(int)f->consecutive,(int)reason));
+        f->quarantined=1;
+        f->next_quarantined=quarantined_tasks;
+        quarantined_tasks=task;
+        failure_event(task,POWERTASK_FAILURE_EVENT_QUARANTINE);
+    }
+}
@@ -0,0 +1,195 @@
+/**
+ Completion handles: a submitted command gets a small generation-checked
+ handle that the caller can poll, wait on, or attach a callback to,
+ instead of watching the downlink for the task's output.
+
+ Each task counts the commands it has finished; a handle waits for the
+ count to reach the value it will have once this command is done.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include "powertask_internal.h"
+
+#ifdef POWERTASK_HOSTED
+#include <time.h>
+#endif
+
+#define HANDLE_FREE 0
+#define HANDLE_WAITING 1
+#define HANDLE_DONE 2
+
+struct powertask_handle_slot_t {
+    uint16_t generation; // never 0, so handles are never 0
+    uint8_t state; // HANDLE_FREE, HANDLE_WAITING, or HANDLE_DONE
+    powertask_result_t result; // valid once HANDLE_DONE
+    powertask_task_t *task;
+    uint32_t target; // task->completions once this command is done
+    powertask_completion_t callback; // 0 if none
+    void *context;
+    struct powertask_handle_slot_t *next; // next waiting handle of the same task
+};
+typedef struct powertask_handle_slot_t powertask_handle_slot_t;
+
+static powertask_handle_slot_t slots[POWERTASK_HANDLE_MAX];
+static int reuse_next=0; // where to look for a finished slot to reuse
+
+static powertask_handle_t handle_of(const powertask_handle_slot_t *s)
+{
+    return ((powertask_handle_t)s->generation<<16)|(powertask_handle_t)(s-slots);
+}
+
+/// Return the slot this handle names, or 0 if it's stale.
+static powertask_handle_slot_t *handle_find(powertask_handle_t handle)
+{
+    uint32_t i=handle&0xFFFF;
+    if (i>=POWERTASK_HANDLE_MAX) return 0;
+    powertask_handle_slot_t *s=&slots[i];
+    if (s->state==HANDLE_FREE || s->generation!=(handle>>16)) return 0;
+    return s;
+}
+
+/// Take a free slot, or else the next finished one.  Returns 0 if all are waiting.
+static powertask_handle_slot_t *handle_allocate(void)
+{
+    int i;
+    powertask_handle_slot_t *s=0;
+    for (i=0;i<POWERTASK_HANDLE_MAX && s==0;i++)
+        if (slots[i].state==HANDLE_FREE) s=&slots[i];
+    for (i=0;i<POWERTASK_HANDLE_MAX && s==0;i++) {
+        powertask_handle_slot_t *d=&slots[reuse_next];
+        reuse_next=(reuse_next+1)%POWERTASK_HANDLE_MAX;
+        if (d->state==HANDLE_DONE) s=d;
+    }
+    if (s==0) return 0;
+    if (++s->generation==0) s->generation=1;
+    s->callback=0;
+    s->context=0;
+    s->next=0;
+    return s;
+}
+
+powertask_handle_t powertask_submit(powertask_ID_t ID,powertask_telemetry_t **input)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) powertask_fatal("Invalid task in powertask_submit",ID);
+    *input=powertask_make_runnable(ID);
+
+    powertask_handle_slot_t *s=handle_allocate();
+    if (s==0) {
+        DEBUGF(1,("powertask_submit: all POWERTASK_HANDLE_MAX handles are waiting\n"));
+        return POWERTASK_HANDLE_NONE;
+    }
+    s->task=task;
+    if (task->failure.quarantined)
+    { // this command will never run
+        s->state=HANDLE_DONE;
+        s->result=POWERTASK_RESULT_FAIL_QUIET+POWERTASK_REASON_QUARANTINED;
+        return handle_of(s);
+    }
+
+    // Count the commands that finish before and including this one
+    uint32_t ahead=1;
+    if (task->prev!=0 && task->attribute->input_depth>1)
+        ahead=task->input_staged+(task->input_front_done?0:1);
+    s->target=task->completions+ahead;
+    s->state=HANDLE_WAITING;
+    s->next=task->handles;
+    task->handles=s;
+    DEBUGF(4,("  handle %08x waits for task %04x completion %d\n",
+        (unsigned int)handle_of(s),(int)ID,(int)s->target));
+    return handle_of(s);
+}
+
+void powertask_handle_complete(powertask_task_t *task,powertask_result_t result)
+{
+    powertask_handle_slot_t **p=&task->handles;
+    while (*p) {
+        powertask_handle_slot_t *s=*p;
+        if ((int32_t)(task->completions-s->target)<0)
+        { // a later command
+            p=&s->next;
+            continue;
+        }
+        *p=s->next;
+        s->next=0;
+        s->state=HANDLE_DONE;
+        s->result=result;
+        if (s->callback) {
+            s->callback(handle_of(s),result,task->output,s->context);
+            p=&task->handles; // the callback may have changed the list
+        }
+    }
+}
+
+void powertask_handle_forget(powertask_task_t *task)
+{
+    int i;
+    while (task->handles) {
+        powertask_handle_slot_t *s=task->handles;
+        task->handles=s->next;
+        s->next=0;
+        s->state=HANDLE_DONE;
+        s->result=POWERTASK_RESULT_FAIL_QUIET+POWERTASK_REASON_UNREGISTERED;
+        if (s->callback) s->callback(handle_of(s),s->result,0,s->context);
+    }
+    for (i=0;i<POWERTASK_HANDLE_MAX;i++)
+        if (slots[i].task==task) slots[i].task=0;
+}
+
+powertask_result_t powertask_poll(powertask_handle_t handle,const powertask_telemetry_t **output)
+{
+    powertask_handle_slot_t *s=handle_find(handle);
+    if (s==0) return POWERTASK_HANDLE_STALE;
+    if (s->state==HANDLE_WAITING) return POWERTASK_HANDLE_PENDING;
+    if (output) *output=s->task?s->task->output:0; // 0 if it was unregistered
+    return s->result;
+}
+
+int powertask_on_complete(powertask_handle_t handle,powertask_completion_t callback,void *context)
+{
+    powertask_handle_slot_t *s=handle_find(handle);
+    if (s==0) return 0;
+    if (s->state==HANDLE_DONE) {
+        callback(handle,s->result,s->task?s->task->output:0,context);
+        return 1;
+    }
+    s->callback=callback;
+    s->context=context;
+    return 1;
+}
+
+void powertask_handle_release(powertask_handle_t handle)
+{
+    powertask_handle_slot_t *s=handle_find(handle);
+    if (s==0) return;
+    if (s->state==HANDLE_WAITING && s->task)
+    { // unlink it from its task
+        powertask_handle_slot_t **p=&s->task->handles;
+        while (*p!=s) p=&(*p)->next;
+        *p=s->next;
+    }
+    s->state=HANDLE_FREE;
+}
+
+#ifdef POWERTASK_HOSTED
+powertask_result_t powertask_wait(powertask_handle_t handle,powertask_time_t timeout)
+{
+    powertask_time_t deadline=powertask_get_time()+timeout;
+    if (deadline<timeout) deadline=(powertask_time_t)-1; // no overflow for "forever"
+    for (;;) {
+        powertask_result_t result=powertask_poll(handle,0);
+        if (result!=POWERTASK_HANDLE_PENDING) return result;
+        if (powertask_get_time()>=deadline) return POWERTASK_HANDLE_PENDING;
+        if (!powertask_run_next())
+        { // the queue is empty
+            result=powertask_poll(handle,0);
+            if (result!=POWERTASK_HANDLE_PENDING) return result;
+            if (powertask_timed_pending()==0) return POWERTASK_HANDLE_PENDING; // it can't finish
+            powertask_time_t before=powertask_get_time();
+            struct timespec nap={0,100000}; // wait for time-tagged commands
+            nanosleep(&nap,0);
+            if (powertask_get_time()==before) return POWERTASK_HANDLE_PENDING; // no clock: they never come due
+        }
+    }
+}
+#endif
@@ -0,0 +1,115 @@
+/**
+ Housekeeping telemetry: the builtin Housekeeping task packs scheduler
+ counters, pool high-water marks, and the top energy consumers since the
+ last record into a compact big-endian record for downlink.
+
+ run_next only bumps a few counters; all the work happens here, when a
+ record is made.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include "powertask_internal.h"
+
+static powertask_time_t housekeeping_every=0; // 0 if only commanded
+static powertask_time_t housekeeping_next=0; // time of the next periodic record
+static powertask_time_t housekeeping_last=0; // time of the last record
+static struct powertask_counters_t housekeeping_reported; // counters at the last record
+
+/// The tasks that used the most energy since the last record, most first.
+static struct {
+    powertask_ID_t ID;
+    uint32_t energy;
+} housekeeping_top[POWERTASK_HOUSEKEEPING_TOP];
+
+/// Rank this task's energy since the last record, and start counting again.
+static void housekeeping_rank(powertask_task_t *task)
+{
+    uint32_t energy=task->housekeeping_energy;
+    int i=POWERTASK_HOUSEKEEPING_TOP;
+    task->housekeeping_energy=0;
+    if (energy==0) return;
+    while (i>0 && housekeeping_top[i-1].energy<energy) {
+        if (i<POWERTASK_HOUSEKEEPING_TOP) housekeeping_top[i]=housekeeping_top[i-1];
+        i--;
+    }
+    if (i<POWERTASK_HOUSEKEEPING_TOP) {
+        housekeeping_top[i].ID=task->attribute->ID;
+        housekeeping_top[i].energy=energy;
+    }
+}
+
+/// Write big-endian fields
+static powertask_data_t *housekeeping_put16(powertask_data_t *p,uint32_t v)
+{
+    p[0]=v>>8; p[1]=v;
+    return p+2;
+}
+static powertask_data_t *housekeeping_put32(powertask_data_t *p,uint32_t v)
+{
+    p[0]=v>>24; p[1]=v>>16; p[2]=v>>8; p[3]=v;
+    return p+4;
+}
+
+/// This is the builtin Housekeeping task: its output is the record.
+static powertask_result_t powertask_housekeeping_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    powertask_time_t now=powertask_get_time();
+    struct powertask_counters_t c=powertask_counters, *r=&housekeeping_reported;
+    uint32_t passes=c.passes-r->passes, idle=c.idle-r->idle;
+    int i;
+
+    for (i=0;i<POWERTASK_HOUSEKEEPING_TOP;i++) housekeeping_top[i].ID=housekeeping_top[i].energy=0;
+    powertask_task_walk(housekeeping_rank);
+
+    powertask_data_t *p=output->data;
+    p=housekeeping_put32(p,now>>32);
+    p=housekeeping_put32(p,now);
+    powertask_time_t ms=(now-housekeeping_last)/1000;
+    p=housekeeping_put32(p,ms>0xFFFFFFFFu?0xFFFFFFFFu:ms);
+    p=housekeeping_put16(p,powertask_runnable_count());
+    p=housekeeping_put32(p,c.runs-r->runs);
+    p=housekeeping_put32(p,c.failures-r->failures);
+    p=housekeeping_put32(p,c.retries-r->retries);
+    p=housekeeping_put32(p,c.skips-r->skips);
+    p=housekeeping_put16(p,passes?(uint32_t)((uint64_t)idle*1000/passes):0);
+    p=housekeeping_put16(p,powertask_get_battery());
+    p=housekeeping_put16(p,powertask_timed_stats()->high_water);
+    p=housekeeping_put16(p,powertask_shared_stats()->high_water);
+    p=housekeeping_put32(p,powertask_downlink_stats()->ring_high_water);
+    for (i=0;i<POWERTASK_HOUSEKEEPING_TOP;i++) {
+        p=housekeeping_put16(p,housekeeping_top[i].ID);
+        p=housekeeping_put32(p,housekeeping_top[i].energy);
+    }
+
+    housekeeping_reported=c;
+    housekeeping_reported.runs++; // this run is counted after we return
+    housekeeping_last=now;
+    if (housekeeping_every!=0 && now>=housekeeping_next)
+    { // schedule the next periodic record (a commanded one doesn't)
+        housekeeping_next=now+housekeeping_every;
+        powertask_make_runnable_at(POWERTASK_ID_HOUSEKEEPING,housekeeping_next);
+    }
+    return POWERTASK_RESULT_OK;
+}
+const static powertask_attribute_t attributes_housekeeping_task={
+    POWERTASK_ID_HOUSEKEEPING, /* our task ID */
+    "Housekeeping", /* human-readable name */
+    0, /* minimum battery energy (Joules) */
+    powertask_housekeeping_task, /* function to run */
+    0, /* bytes of telemetry input data required */
+    POWERTASK_HOUSEKEEPING_BYTES /* bytes of telemetry output data produced */
+};
+
+void powertask_housekeeping_setup(void)
+{
+    powertask_register(&attributes_housekeeping_task);
+}
+
+void powertask_housekeeping_period(powertask_time_t period)
+{
+    housekeeping_every=period;
+    if (period==0) return;
+    housekeeping_next=powertask_get_time()+period;
+    powertask_make_runnable_at(POWERTASK_ID_HOUSEKEEPING,housekeeping_next);
+}
@@ -0,0 +1,52 @@
+/**
+ Buffered inputs: a task with an input_depth of 2 or more has back
+ buffers for commands that arrive while it's queued or running.
+ The running command's front buffer is never written, and the oldest
+ staged command swaps in when the task is next dispatched.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <stdlib.h>
+#include "powertask_internal.h"
+
+void powertask_input_allocate(powertask_task_t *task)
+{
+    int i, backs=task->attribute->input_depth-1;
+    if (task->input_back) return;
+    DEBUGF(8,("  allocating %d back input buffers\n",backs));
+    task->input_back=(powertask_telemetry_t **)calloc(backs,sizeof(powertask_telemetry_t *));
+    for (i=0;i<backs;i++)
+        task->input_back[i]=powertask_allocate_telemetry(task->attribute->input_length);
+}
+
+powertask_telemetry_t *powertask_input_stage(powertask_task_t *task)
+{
+    int backs=task->attribute->input_depth-1;
+    powertask_input_allocate(task); // on the first staged command
+
+    if (task->input_staged>=backs) {
+        DEBUGF(2,("  task %04x input buffers full, replacing newest staged input\n",
+            (int)task->attribute->ID));
+        return task->input_back[backs-1];
+    }
+    DEBUGF(3,("  staging input %d for task %04x\n",(int)task->input_staged,(int)task->attribute->ID));
+    return task->input_back[task->input_staged++];
+}
+
+void powertask_input_swap(powertask_task_t *task)
+{
+    int i, staged=task->input_staged;
+    powertask_telemetry_t *done=task->input;
+    task->input=task->input_back[0];
+    for (i=0;i+1<staged;i++) task->input_back[i]=task->input_back[i+1];
+    task->input_back[staged-1]=done; // reuse the finished buffer
+    task->input_staged--;
+    task->input_front_done=0;
+}
+
+int powertask_input_staged(powertask_ID_t ID)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) return 0;
+    return task->input_staged;
+}
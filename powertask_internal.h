@@ -0,0 +1,208 @@
+/*
+  Internal interface shared between the powertask source files.
+  Applications should only use powertask.h, not this file.
+
+  CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#ifndef __UAF_POWERTASK_INTERNAL_H
+#define __UAF_POWERTASK_INTERNAL_H
+
+#include <stdio.h>
+#include "powertask.h"
+
+/// Debug support
+extern int powertask_debug_level;
+#define DEBUGF(level,params) { if (powertask_debug_level>=level)  printf params; }
+
+/// Print an error message and exit.  Does not return.
+void powertask_fatal(const char *why,int ID);
+
+/// The task whose function is running right now, or 0 between tasks.
+extern powertask_task_t *powertask_current_task;
+
+/// Store this finished task's output telemetry for downlink.
+void powertask_downlink_output(powertask_task_t *task,const powertask_telemetry_t *output,
+    powertask_result_t result);
+
+/// Allocate a telemetry object with room for len bytes of data.
+powertask_telemetry_t *powertask_allocate_telemetry(powertask_length_t len);
+
+/// Give this task its input and output telemetry if it has none yet, 
+///   in shared memory for isolated tasks, marking what must be freed.
+void powertask_task_allocate(powertask_task_t *task);
+
+/// If this task is in failure hold-off or quarantine, return the buffer
+///   powertask_make_runnable should hand back instead of queueing the task.
+///   Returns 0 if the task may be queued now.
+powertask_telemetry_t *powertask_failure_hold(powertask_task_t *task);
+
+/// Update this task's failure statistics after a run returns this result.
+void powertask_failure_record(powertask_task_t *task,powertask_result_t result);
+
+/// Return 1 if a task's attributes can be swapped from b to a without
+///   touching its queued commands or buffers.
+int powertask_attribute_compatible(const powertask_attribute_t *a,const powertask_attribute_t *b);
+
+/// This task is being registered: its input must fit a delayed command if hold-off is on.
+void powertask_failure_register(powertask_task_t *task);
+
+/// This task is being unregistered: take it out of quarantine.
+void powertask_failure_forget(powertask_task_t *task);
+
+/// If this deterministic task's input matches a cached result, copy the 
+///   cached output and return 1.  Either way, *hash gets the input's hash.
+int powertask_memo_lookup(powertask_task_t *task,uint32_t *hash);
+
+/// Cache the output of this deterministic task's successful run.
+void powertask_memo_store(powertask_task_t *task,uint32_t hash);
+
+/// Allocate this batch task's input and output queues, if they aren't yet.
+void powertask_batch_allocate(powertask_task_t *task);
+
+/// Queue another input for this batch task, and return it for the caller to fill.
+powertask_telemetry_t *powertask_batch_queue(powertask_task_t *task);
+
+/// Run all the queued inputs of this batch task in one call, recording 
+///   each input's failures.  Returns POWERTASK_RESULT_RETRY if any inputs
+///   are still queued, or POWERTASK_RESULT_OK if they're all done.
+powertask_result_t powertask_batch_run(powertask_task_t *task);
+
+/// Check this region-input task's region before it runs.  Returns 1 if it's valid.
+int powertask_region_check(powertask_task_t *task);
+
+/// This task is finished with its shared input: drop its reference.
+void powertask_shared_done(powertask_task_t *task);
+
+/// Allocate this buffered-input task's back buffers, if they aren't yet.
+void powertask_input_allocate(powertask_task_t *task);
+
+/// This buffered-input task is already queued or running: return a back buffer
+///   for the caller to fill with its next command.
+powertask_telemetry_t *powertask_input_stage(powertask_task_t *task);
+
+/// This buffered-input task's front command is done: swap in the oldest staged one.
+void powertask_input_swap(powertask_task_t *task);
+
+/// This task finished a command with this result: finish any handles waiting on it.
+void powertask_handle_complete(powertask_task_t *task,powertask_result_t result);
+
+/// This task is being unregistered: finish its waiting handles, and 
+///   stop finished handles from pointing at its output.
+void powertask_handle_forget(powertask_task_t *task);
+
+/// powertask_make_runnable_sequenced for a task we already have.
+powertask_telemetry_t *powertask_task_make_runnable_sequenced(powertask_task_t *task,uint32_t sequence);
+
+/// Mark this sequence number seen.  Returns 1 if it's new, 0 if it was 
+///   already seen or is too old for the window.
+int powertask_window_accept(powertask_window_t *window,uint32_t sequence);
+
+#ifdef POWERTASK_HOSTED
+/// Allocate telemetry with room for len bytes of data in the memory shared 
+///   with isolated workers.  Returns 0 if isolation isn't started or it's full.
+powertask_telemetry_t *powertask_isolate_allocate(powertask_length_t len);
+
+/// Run this isolated task's function on this input in a worker process.
+powertask_result_t powertask_isolate_run(powertask_task_t *task,const powertask_telemetry_t *input);
+
+/// New code was loaded: re-fork the workers so they have it.
+void powertask_isolate_refresh(void);
+
+/// Read the hardware counters just before a task function call, and
+///   add what they counted to the task's totals just after it.
+void powertask_pmu_begin(void);
+void powertask_pmu_end(powertask_task_t *task);
+#else
+#define powertask_pmu_begin() /* no hardware counters in flight builds */
+#define powertask_pmu_end(task)
+#endif
+
+/// Return the number of runnable tasks, not counting the idle task.
+int powertask_runnable_count(void);
+
+/// Return the energy_per_run total of the runnable tasks.
+uint32_t powertask_queued_energy(void);
+
+/// This offload task is up to run: if a peer node should run it instead,
+///   forward it there and return 1.
+int powertask_node_offload(powertask_task_t *task);
+
+/// Return 1 if this task can run at the current performance state.
+int powertask_perf_matches(const powertask_task_t *task);
+
+/// Return 1 if another task may run ahead of this one to save a performance state switch.
+int powertask_perf_may_bypass(const powertask_task_t *task);
+
+/// Another task at the current performance state is running ahead of this one.
+void powertask_perf_bypass(powertask_task_t *task);
+
+/// Switch to the performance state this task asks for, before its function runs.
+void powertask_perf_apply(const powertask_task_t *task);
+
+/// Scheduler counters for housekeeping, bumped by run_next.
+struct powertask_counters_t {
+    uint32_t passes; // calls to run_next
+    uint32_t idle; // passes that ran only the idle task
+    uint32_t runs; // task functions run (or answered from the cache)
+    uint32_t failures; // runs that failed
+    uint32_t retries; // runs that returned RETRY
+    uint32_t skips; // tasks skipped for lack of battery
+};
+extern struct powertask_counters_t powertask_counters;
+
+/// Call this function on every registered task, in ID order.
+void powertask_task_walk(void (*visit)(powertask_task_t *task));
+
+/// Return the number of tree nodes powertask_task_lookup visits to find this ID.
+int powertask_task_depth(powertask_ID_t ID);
+
+/// Register the builtin Housekeeping task.
+void powertask_housekeeping_setup(void);
+
+/// Register the builtin MemoryRead and LogRead tasks.
+void powertask_dump_setup(void);
+
+/// Move any time-tagged commands due at or before "now" onto the run queue.
+///   Called by powertask_run_next before choosing a task.
+void powertask_timed_release(powertask_time_t now);
+
+/// This task is about to start: record its start jitter if it was time-tagged.
+void powertask_timed_started(powertask_task_t *task,powertask_time_t now);
+
+/// This task finished a command: release its waiting time-tagged commands it has room for.
+void powertask_timed_resume(powertask_task_t *task);
+
+/// This task is being unregistered: drop its waiting time-tagged commands.
+void powertask_timed_forget(powertask_task_t *task);
+
+/// Number of periodic tasks: while it's 0, run_next skips the periodic hooks.
+extern int powertask_periodic_count;
+
+/// A time-tagged command released this periodic task: count the release,
+///   and store the next one.  Called before the task is made runnable.
+void powertask_periodic_release(powertask_task_t *task,powertask_time_t when);
+
+/// This periodic task joined (1) or left (0) the run queue.
+void powertask_periodic_runnable(powertask_task_t *task,int runnable);
+
+/// Return the highest priority runnable periodic task the battery can pay for, or 0.
+///   While a starved task has energy "reserved" (or 0 if none), another 
+///   task must also leave the reserved task's minimum_battery unspent.
+powertask_task_t *powertask_periodic_pick(powertask_energy_t battery,
+    const powertask_task_t *reserved);
+
+/// This task ran from "start" until now, using this much energy: 
+///   update periodic job measurements, or the longest non-periodic run.
+void powertask_periodic_ran(powertask_task_t *task,powertask_time_t start,uint32_t used,
+    powertask_result_t result);
+
+/// This periodic task is being unregistered: take it out of the periodic set.
+void powertask_periodic_forget(powertask_task_t *task);
+
+/// Register the builtin SequenceStart task.
+void powertask_sequence_setup(void);
+
+/// This task is being unregistered: delete the stored sequences that run it.
+void powertask_sequence_forget(powertask_ID_t task_ID);
+
+#endif
@@ -0,0 +1,274 @@
+/**
+ Process isolation: on hosted Linux builds, POWERTASK_FLAG_ISOLATED tasks
+ run in pre-forked worker processes, so a crashing task function kills
+ only its worker.  Each worker has a mailbox in shared memory, and the
+ telemetry of isolated tasks is allocated in that shared memory too, so
+ a call passes pointers, not copies.  Both sides spin briefly before
+ sleeping on a futex, so back-to-back calls need no system calls at all.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include "powertask_internal.h"
+
+#ifdef POWERTASK_HOSTED
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/// One worker's mailbox.  The parent fills in a call and bumps "request";
+///   the worker runs it and sets "response" to match.
+struct isolate_mailbox_t {
+    uint32_t request; // futex word: calls posted
+    uint32_t response; // futex word: calls finished
+    uint32_t worker_sleeping; // 1 if the worker may be waiting on "request"
+    uint32_t parent_sleeping; // 1 if the parent may be waiting on "response"
+    powertask_function_t function;
+    const powertask_telemetry_t *input;
+    powertask_telemetry_t *output;
+    powertask_result_t result;
+};
+
+/// The shared memory: mailboxes, then the telemetry arena.
+static unsigned char *isolate_shared=0;
+static struct isolate_mailbox_t *isolate_mailbox=0;
+static uint32_t isolate_arena_used=0;
+#define ISOLATE_ARENA_START (POWERTASK_ISOLATE_WORKERS_MAX*sizeof(struct isolate_mailbox_t))
+
+static pid_t isolate_pid[POWERTASK_ISOLATE_WORKERS_MAX];
+static int isolate_workers=0;
+static int isolate_next=0; // round-robin dispatch
+static powertask_time_t isolate_timeout=0;
+static int isolate_spin=POWERTASK_ISOLATE_SPIN; // 0 on one CPU, where the other side can't run while we spin
+static powertask_isolate_stats_t isolate_stats;
+
+static long isolate_futex(uint32_t *word,int op,uint32_t value,const struct timespec *timeout)
+{
+    return syscall(SYS_futex,word,op,value,timeout,0,0);
+}
+
+static uint32_t isolate_load(uint32_t *word)
+{
+    return __atomic_load_n(word,__ATOMIC_ACQUIRE);
+}
+
+/// Block until *word changes from "seen", spinning first.  Sleeps at most "timeout".
+static void isolate_wait(uint32_t *word,uint32_t seen,uint32_t *sleeping,const struct timespec *timeout)
+{
+    int spin;
+    for (spin=0;spin<isolate_spin;spin++)
+        if (isolate_load(word)!=seen) return;
+    __atomic_store_n(sleeping,1,__ATOMIC_SEQ_CST);
+    if (isolate_load(word)==seen) // re-check, or we could miss the wake
+        isolate_futex(word,FUTEX_WAIT,seen,timeout);
+    __atomic_store_n(sleeping,0,__ATOMIC_RELAXED);
+}
+
+/// Publish a new value of *word, and wake the other side if it's asleep.
+static void isolate_post(uint32_t *word,uint32_t value,uint32_t *sleeping)
+{
+    __atomic_store_n(word,value,__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(sleeping,__ATOMIC_SEQ_CST))
+        isolate_futex(word,FUTEX_WAKE,1,0);
+}
+
+/// A worker process runs calls from its mailbox forever, starting after call "done".
+static void isolate_worker(struct isolate_mailbox_t *m,uint32_t done)
+{
+    prctl(PR_SET_PDEATHSIG,SIGKILL); // don't outlive the scheduler
+    if (getppid()==1) _exit(0);
+    while (1) {
+        isolate_wait(&m->request,done,&m->worker_sleeping,0);
+        done=isolate_load(&m->request);
+        m->result=m->function(m->input,m->output);
+        isolate_post(&m->response,done,&m->parent_sleeping);
+    }
+}
+
+/// Fork the worker for this slot.  Returns 1 on success.
+static int isolate_spawn(int w)
+{
+    struct isolate_mailbox_t *m=&isolate_mailbox[w];
+    m->response=m->request; // nothing outstanding
+    m->worker_sleeping=m->parent_sleeping=0;
+    fflush(stdout); // the child mustn't inherit unwritten output
+    pid_t pid=fork();
+    if (pid==0) isolate_worker(m,m->response); // does not return
+    if (pid<0) {
+        DEBUGF(0,("powertask_isolate: fork failed\n"));
+        isolate_pid[w]=0;
+        return 0;
+    }
+    isolate_pid[w]=pid;
+    isolate_stats.spawned++;
+    return 1;
+}
+
+/// Kill and reap the worker for this slot.
+static void isolate_kill(int w)
+{
+    if (isolate_pid[w]<=0) return;
+    kill(isolate_pid[w],SIGKILL);
+    waitpid(isolate_pid[w],0,0);
+    isolate_pid[w]=0;
+}
+
+int powertask_isolate_start(int workers,powertask_time_t timeout)
+{
+    int w;
+    if (workers<1 || workers>POWERTASK_ISOLATE_WORKERS_MAX) return 0;
+    if (isolate_workers) powertask_isolate_stop();
+    if (isolate_shared==0)
+    { // mapped once and kept: isolated tasks' telemetry lives here
+        void *p=mmap(0,ISOLATE_ARENA_START+POWERTASK_ISOLATE_BYTES,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_ANONYMOUS,-1,0);
+        if (p==MAP_FAILED) return 0;
+        isolate_shared=(unsigned char *)p;
+        isolate_mailbox=(struct isolate_mailbox_t *)p;
+    }
+    isolate_timeout=timeout;
+    isolate_spin=sysconf(_SC_NPROCESSORS_ONLN)>1?POWERTASK_ISOLATE_SPIN:0;
+    isolate_workers=workers;
+    for (w=0;w<workers;w++)
+        if (!isolate_spawn(w)) {
+            powertask_isolate_stop();
+            return 0;
+        }
+    DEBUGF(2,("powertask_isolate_start: %d workers\n",workers));
+    return 1;
+}
+
+void powertask_isolate_stop(void)
+{
+    int w;
+    for (w=0;w<isolate_workers;w++) isolate_kill(w);
+    isolate_workers=0;
+}
+
+void powertask_isolate_refresh(void)
+{
+    int w;
+    if (isolate_workers==0) return;
+    DEBUGF(2,("  re-forking isolated workers to pick up new code\n"));
+    for (w=0;w<isolate_workers;w++) {
+        isolate_kill(w);
+        isolate_spawn(w);
+    }
+}
+
+const powertask_isolate_stats_t *powertask_isolate_stats(void)
+{
+    return &isolate_stats;
+}
+
+/// Return 1 if this pointer is in the shared arena, where workers can see its current data.
+static int isolate_in_arena(const void *p,uint32_t length)
+{
+    const unsigned char *c=(const unsigned char *)p;
+    return isolate_shared && c>=isolate_shared+ISOLATE_ARENA_START
+        && c+length<=isolate_shared+ISOLATE_ARENA_START+isolate_arena_used;
+}
+
+powertask_telemetry_t *powertask_isolate_allocate(powertask_length_t len)
+{
+    uint32_t size=(sizeof(powertask_telemetry_header_t)+len+15)&~15u;
+    if (isolate_shared==0 || isolate_arena_used+size>POWERTASK_ISOLATE_BYTES) return 0;
+    powertask_telemetry_t *tel=(powertask_telemetry_t *)(isolate_shared+ISOLATE_ARENA_START+isolate_arena_used);
+    isolate_arena_used+=size;
+    memset(tel,0,size);
+    tel->header.length=len;
+    return tel;
+}
+
+/// Return the time now in microseconds, for timeouts.
+static powertask_time_t isolate_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1000000ull+ts.tv_nsec/1000;
+}
+
+/// Copy this telemetry into the shared arena's scratch space at "offset", returning the copy.
+static powertask_telemetry_t *isolate_scratch(uint32_t *offset,const powertask_telemetry_t *tel,uint32_t length)
+{
+    uint32_t size=(sizeof(powertask_telemetry_header_t)+length+15)&~15u;
+    if (*offset+size>POWERTASK_ISOLATE_BYTES-isolate_arena_used) return 0;
+    *offset+=size;
+    powertask_telemetry_t *copy=(powertask_telemetry_t *)(isolate_shared+ISOLATE_ARENA_START
+        +POWERTASK_ISOLATE_BYTES-*offset);
+    memcpy(copy,tel,sizeof(powertask_telemetry_header_t)+length);
+    return copy;
+}
+
+powertask_result_t powertask_isolate_run(powertask_task_t *task,const powertask_telemetry_t *input)
+{
+    powertask_length_t in_length=task->attribute->input_length, out_length=task->attribute->output_length;
+    if (isolate_workers==0) return task->attribute->function(input,task->output);
+
+    // Telemetry outside the arena (caller-owned or shared inputs) is copied through it.
+    const powertask_telemetry_t *call_input=input;
+    powertask_telemetry_t *call_output=task->output;
+    uint32_t scratch=0;
+    if (!isolate_in_arena(input,sizeof(powertask_telemetry_header_t)+in_length))
+        call_input=isolate_scratch(&scratch,input,in_length);
+    if (!isolate_in_arena(task->output,sizeof(powertask_telemetry_header_t)+out_length))
+        call_output=isolate_scratch(&scratch,task->output,out_length);
+    if (call_input==0 || call_output==0) {
+        DEBUGF(1,("  no shared memory to isolate %04x: running it in-process\n",(int)task->attribute->ID));
+        return task->attribute->function(input,task->output);
+    }
+    if (scratch) isolate_stats.copied++;
+
+    // Post the call
+    int w=isolate_next;
+    isolate_next=(isolate_next+1)%isolate_workers;
+    if (isolate_pid[w]<=0 && !isolate_spawn(w))
+        return task->attribute->function(input,task->output);
+    struct isolate_mailbox_t *m=&isolate_mailbox[w];
+    m->function=task->attribute->function;
+    m->input=call_input;
+    m->output=call_output;
+    uint32_t call=m->request+1;
+    isolate_post(&m->request,call,&m->worker_sleeping);
+    isolate_stats.calls++;
+
+    // Wait for the result, checking now and then that the worker is still alive
+    powertask_time_t start=isolate_now();
+    struct timespec slice={0,1000000}; // 1 ms
+    powertask_result_t result;
+    while (isolate_load(&m->response)!=call)
+    {
+        isolate_wait(&m->response,call-1,&m->parent_sleeping,&slice);
+        if (isolate_load(&m->response)==call) break;
+        int status;
+        if (waitpid(isolate_pid[w],&status,WNOHANG)==isolate_pid[w])
+        {
+            DEBUGF(1,("  isolated task %04x (%s) crashed its worker\n",
+                (int)task->attribute->ID,task->attribute->name));
+            isolate_pid[w]=0;
+            isolate_stats.crashes++;
+            isolate_spawn(w);
+            return POWERTASK_RESULT_FAIL_QUIET+POWERTASK_REASON_CRASHED;
+        }
+        if (isolate_timeout && isolate_now()-start>isolate_timeout)
+        {
+            DEBUGF(1,("  isolated task %04x (%s) timed out: killing its worker\n",
+                (int)task->attribute->ID,task->attribute->name));
+            isolate_kill(w);
+            isolate_stats.timeouts++;
+            isolate_spawn(w);
+            return POWERTASK_RESULT_FAIL_QUIET+POWERTASK_REASON_TIMEOUT;
+        }
+    }
+    result=m->result;
+    if (call_output!=task->output)
+        memcpy(task->output->data,call_output->data,out_length);
+    return result;
+}
+
+#endif
@@ -0,0 +1,107 @@
+/**
+ Result cache for deterministic tasks: if a task that declares
+ POWERTASK_FLAG_DETERMINISTIC gets the same input as a recent
+ successful run, reuse that run's output instead of spending
+ the energy to call the function again.
+
+ The cache is small, so lookup is a scan comparing hashes, and
+ the least recently used entry is the one replaced.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+/// One cached result.  The full input is kept, so a hash collision can't
+///   return the wrong output.
+struct powertask_memo_entry_t {
+    uint32_t hash; // hash of ID and input
+    uint32_t last_used; // memo_clock when last hit or stored (0 if unused)
+    powertask_ID_t ID;
+    powertask_length_t input_length, output_length;
+    powertask_data_t input[POWERTASK_MEMO_INPUT_MAX];
+    powertask_data_t output[POWERTASK_MEMO_OUTPUT_MAX];
+};
+typedef struct powertask_memo_entry_t powertask_memo_entry_t;
+
+static powertask_memo_entry_t memo_entries[POWERTASK_MEMO_MAX];
+static uint32_t memo_clock=0; // counts lookups, for least recently used
+static powertask_memo_stats_t memo_stats;
+
+/// Return 1 if this task's input and output fit in a cache entry.
+static int memo_fits(powertask_task_t *task)
+{
+    return task->attribute->input_length<=POWERTASK_MEMO_INPUT_MAX
+        && task->attribute->output_length<=POWERTASK_MEMO_OUTPUT_MAX;
+}
+
+/// FNV-1a hash of the task ID and input data
+static uint32_t memo_hash(powertask_task_t *task)
+{
+    uint32_t h=2166136261u;
+    powertask_length_t i, n=task->attribute->input_length;
+    h=(h^(task->attribute->ID&0xFF))*16777619u;
+    h=(h^(task->attribute->ID>>8))*16777619u;
+    for (i=0;i<n;i++)
+        h=(h^task->input->data[i])*16777619u;
+    return h;
+}
+
+int powertask_memo_lookup(powertask_task_t *task,uint32_t *hash)
+{
+    if (!memo_fits(task)) return 0;
+    uint32_t h=memo_hash(task);
+    *hash=h;
+    if (++memo_clock==0) memo_clock=1; // 0 marks unused entries
+
+    int i;
+    for (i=0;i<POWERTASK_MEMO_MAX;i++) {
+        powertask_memo_entry_t *e=&memo_entries[i];
+        if (e->hash==h && e->last_used!=0 && e->ID==task->attribute->ID
+         && 0==memcmp(e->input,task->input->data,e->input_length))
+        { // hit
+            memcpy(task->output->data,e->output,e->output_length);
+            e->last_used=memo_clock;
+            memo_stats.hits++;
+            memo_stats.energy_saved+=task->attribute->energy_per_run;
+            return 1;
+        }
+    }
+    memo_stats.misses++;
+    return 0;
+}
+
+void powertask_memo_store(powertask_task_t *task,uint32_t hash)
+{
+    if (!memo_fits(task)) return;
+
+    // Use an unused entry, or replace the least recently used one
+    powertask_memo_entry_t *e=0;
+    int i;
+    for (i=0;i<POWERTASK_MEMO_MAX;i++) {
+        powertask_memo_entry_t *c=&memo_entries[i];
+        if (c->last_used==0) { e=c; break; }
+        if (e==0 || (uint32_t)(memo_clock-c->last_used) > (uint32_t)(memo_clock-e->last_used)) e=c;
+    }
+    if (e->last_used!=0) memo_stats.evictions++;
+
+    e->hash=hash;
+    e->last_used=memo_clock;
+    e->ID=task->attribute->ID;
+    e->input_length=task->attribute->input_length;
+    e->output_length=task->attribute->output_length;
+    memcpy(e->input,task->input->data,e->input_length);
+    memcpy(e->output,task->output->data,e->output_length);
+}
+
+void powertask_memo_forget(powertask_ID_t ID)
+{
+    int i;
+    for (i=0;i<POWERTASK_MEMO_MAX;i++)
+        if (memo_entries[i].ID==ID) memo_entries[i].last_used=0;
+}
+
+const powertask_memo_stats_t *powertask_memo_stats(void)
+{
+    return &memo_stats;
+}
@@ -0,0 +1,133 @@
+/**
+ Task modules: on hosted Linux builds, tasks can be loaded from shared
+ objects with dlopen, and a new version of a module swapped in without
+ restarting the scheduler or losing queued commands.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include "powertask_internal.h"
+
+#ifdef POWERTASK_HOSTED
+#include <dlfcn.h>
+#include <string.h>
+
+/// Longest module name we store.
+#define POWERTASK_MODULE_NAME 32
+
+/// One loaded module.
+struct powertask_module_t {
+    char name[POWERTASK_MODULE_NAME]; // empty if this slot is free
+    void *library; // from dlopen
+    const powertask_attribute_t *const *tasks; // 0-terminated
+};
+static struct powertask_module_t modules[POWERTASK_MODULE_MAX];
+
+static struct powertask_module_t *module_lookup(const char *name)
+{
+    int i;
+    for (i=0;i<POWERTASK_MODULE_MAX;i++)
+        if (0==strncmp(modules[i].name,name,POWERTASK_MODULE_NAME)) return &modules[i];
+    return 0;
+}
+
+/// Return the attributes of the task with this ID in this module's list, or 0.
+static const powertask_attribute_t *module_find_task(const powertask_attribute_t *const *tasks,
+    powertask_ID_t ID)
+{
+    for (;*tasks;tasks++)
+        if ((*tasks)->ID==ID) return *tasks;
+    return 0;
+}
+
+/// Return 1 if this module's function is running right now.
+static int module_running(const struct powertask_module_t *m)
+{
+    powertask_task_t *task=powertask_current_task;
+    return task && module_find_task(m->tasks,task->attribute->ID)==task->attribute;
+}
+
+/// Return 1 if every task in this new module can be registered or swapped in.
+static int module_check(const powertask_attribute_t *const *tasks,const struct powertask_module_t *old)
+{
+    for (;*tasks;tasks++) {
+        const powertask_attribute_t *a=*tasks, *o;
+        powertask_task_t *task=powertask_task_lookup(a->ID);
+        if (task==0) continue; // new task
+        if (old==0 || (o=module_find_task(old->tasks,a->ID))==0 || task->attribute!=o) {
+            DEBUGF(1,("  module task %04x collides with registered task %s\n",(int)a->ID,task->attribute->name));
+            return 0;
+        }
+        if (!powertask_attribute_compatible(a,o)) {
+            DEBUGF(1,("  module task %04x doesn't match its old version\n",(int)a->ID));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int powertask_module_load(const char *name,const char *path)
+{
+    DEBUGF(2,("powertask_module_load %s from %s\n",name,path));
+    if (name[0]==0 || strlen(name)>=POWERTASK_MODULE_NAME) {
+        DEBUGF(1,("  bad module name\n"));
+        return -1;
+    }
+    struct powertask_module_t *old=module_lookup(name);
+    struct powertask_module_t *slot=old?old:module_lookup("");
+    if (slot==0) {
+        DEBUGF(1,("  no room for module %s (POWERTASK_MODULE_MAX)\n",name));
+        return -1;
+    }
+    if (old && module_running(old)) {
+        DEBUGF(1,("  module %s can't replace itself while running\n",name));
+        return -1;
+    }
+
+    void *library=dlopen(path,RTLD_NOW|RTLD_LOCAL);
+    if (library==0) {
+        DEBUGF(1,("  dlopen failed: %s\n",dlerror()));
+        return -1;
+    }
+    const powertask_attribute_t *const *tasks=
+        (const powertask_attribute_t *const *)dlsym(library,POWERTASK_MODULE_SYMBOL);
+    if (tasks==0 || (old && tasks==old->tasks) || !module_check(tasks,old)) {
+        DEBUGF(1,("  %s is not a usable task module\n",path));
+        dlclose(library); // dlopen counts references, even to the old version
+        return -1;
+    }
+
+    // Register new tasks, and swap in new versions of old ones
+    int count=0;
+    const powertask_attribute_t *const *t;
+    for (t=tasks;*t;t++,count++) {
+        if (powertask_task_lookup((*t)->ID)) powertask_replace(*t);
+        else powertask_register(*t);
+    }
+
+    if (old)
+    { // drop tasks the new version doesn't have, then close the old version
+        for (t=old->tasks;*t;t++)
+            if (!module_find_task(tasks,(*t)->ID)) powertask_unregister((*t)->ID);
+        dlclose(old->library);
+    }
+    strncpy(slot->name,name,POWERTASK_MODULE_NAME-1);
+    slot->library=library;
+    slot->tasks=tasks;
+    powertask_isolate_refresh(); // isolated workers need the new code
+    return count;
+}
+
+int powertask_module_unload(const char *name)
+{
+    struct powertask_module_t *m=module_lookup(name);
+    if (m==0 || name[0]==0) return 0;
+    if (module_running(m)) powertask_fatal("A task module can't unload itself while running",0);
+    DEBUGF(2,("powertask_module_unload %s\n",name));
+    const powertask_attribute_t *const *t;
+    for (t=m->tasks;*t;t++) powertask_unregister((*t)->ID);
+    dlclose(m->library);
+    m->name[0]=0;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,242 @@
+/**
+ Distributed scheduling: powertask instances on several boards trade
+ small energy summaries over a transport, and a POWERTASK_FLAG_OFFLOAD
+ task is forwarded (ID and input telemetry) to the peer with the most
+ energy to spare when this board can't pay for it, or has much less.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+/// Message types, the first byte of every message.  The second byte is
+///   the sender's node number; multi-byte fields are big-endian.
+#define NODE_SUMMARY 1 /* 2 byte battery, 2 byte available energy, 2 byte runnable tasks */
+#define NODE_TASK 2 /* 2 byte task ID, 2 byte input length, input bytes */
+
+/// The newest summary from each peer.
+struct node_peer_t {
+    unsigned char known; // 1 once a summary has arrived
+    powertask_time_t heard; // when it arrived
+    powertask_energy_t available; // its spare energy, less what we've sent it since
+};
+static struct node_peer_t node_peers[POWERTASK_NODE_MAX];
+
+static const powertask_transport_t *node_transport=0;
+static powertask_node_t node_self=0;
+static powertask_node_stats_t node_stats;
+
+/// A forwarded command that's waiting for its task to take it.
+static unsigned char node_pending[POWERTASK_NODE_MESSAGE_MAX];
+static int node_pending_length=0;
+
+void powertask_node_start(powertask_node_t self,const powertask_transport_t *transport)
+{
+    if (self>=POWERTASK_NODE_MAX) powertask_fatal("Node too big for POWERTASK_NODE_MAX",self);
+    node_self=self;
+    node_transport=transport;
+    node_pending_length=0;
+    memset(node_peers,0,sizeof(node_peers));
+}
+
+const powertask_node_stats_t *powertask_node_stats(void)
+{
+    return &node_stats;
+}
+
+/// Return this board's energy to spare: battery not already owed to queued tasks.
+static powertask_energy_t node_available(void)
+{
+    uint32_t battery=powertask_get_battery(), queued=powertask_queued_energy();
+    return battery>queued?battery-queued:0;
+}
+
+void powertask_node_publish(void)
+{
+    if (node_transport==0) return;
+    powertask_energy_t battery=powertask_get_battery(), available=node_available();
+    int runnable=powertask_runnable_count();
+    unsigned char m[8]={NODE_SUMMARY,node_self,battery>>8,battery&0xFF,
+        available>>8,available&0xFF,runnable>>8,runnable&0xFF};
+    if (node_transport->send(node_transport->context,POWERTASK_NODE_ALL,m,sizeof(m)))
+        node_stats.summaries_sent++;
+}
+
+/// Return 1 if this task can take a forwarded command now.  It must not be
+///   queued at all: node_received marks the task's front command, so a
+///   forwarded command staged behind a local one would lose its mark.
+static int node_can_queue(const powertask_task_t *task)
+{
+    return task->prev==0;
+}
+
+/// A forwarded command arrived: make the task runnable here with its input.
+///   Returns 0 if the task can't take it yet, so it should wait.
+static int node_receive_task(const unsigned char *m,uint32_t length)
+{
+    powertask_ID_t ID=(m[2]<<8)|m[3];
+    uint32_t input_length=(m[4]<<8)|m[5];
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0 || task->attribute->input_length!=input_length || length!=6+input_length
+      || task->attribute->batch_function)
+    {
+        DEBUGF(1,("powertask_node: dropping forwarded task %04x from node %d\n",(int)ID,(int)m[1]));
+        node_stats.dropped++;
+        return 1;
+    }
+    if (!node_can_queue(task)) return 0;
+    DEBUGF(3,("powertask_node: running task %04x for node %d\n",(int)ID,(int)m[1]));
+    powertask_telemetry_t *input=powertask_task_make_runnable(task);
+    memcpy(input->data,m+6,input_length);
+    task->node_received=1; // don't send it on again
+    node_stats.tasks_received++;
+    return 1;
+}
+
+int powertask_node_poll(void)
+{
+    static unsigned char m[POWERTASK_NODE_MESSAGE_MAX];
+    int count=0, length;
+    if (node_transport==0) return 0;
+    if (node_pending_length)
+    { // a forwarded command is still waiting: later messages wait behind it
+        if (!node_receive_task(node_pending,node_pending_length)) return 0;
+        node_pending_length=0;
+        count++;
+    }
+    while ((length=node_transport->receive(node_transport->context,m,sizeof(m)))>0)
+    {
+        count++;
+        if (length<2 || m[1]>=POWERTASK_NODE_MAX || m[1]==node_self) {
+            node_stats.dropped++;
+        }
+        else if (m[0]==NODE_SUMMARY && length==8) {
+            struct node_peer_t *p=&node_peers[m[1]];
+            p->known=1;
+            p->heard=powertask_get_time();
+            p->available=(m[4]<<8)|m[5];
+            node_stats.summaries_received++;
+        }
+        else if (m[0]==NODE_TASK && length>=6) {
+            if (!node_receive_task(m,length))
+            { // its task is busy: hold it, and leave the rest in the transport
+                memcpy(node_pending,m,length);
+                node_pending_length=length;
+                break;
+            }
+        }
+        else node_stats.dropped++;
+    }
+    return count;
+}
+
+int powertask_node_offload(powertask_task_t *task)
+{
+    const powertask_attribute_t *a=task->attribute;
+    if (node_transport==0 || task->node_received || a->batch_function
+      || a->input_length+6>POWERTASK_NODE_MESSAGE_MAX)
+        return 0;
+
+    // Only send it away if we can't pay for it, or a peer has much more to spare
+    powertask_energy_t available=node_available();
+    uint32_t need=(uint32_t)a->minimum_battery+a->energy_per_run;
+    uint32_t better=powertask_get_battery()<a->minimum_battery?0:(uint32_t)available+POWERTASK_NODE_MARGIN;
+    powertask_time_t now=powertask_get_time();
+    int n, best=-1;
+    for (n=0;n<POWERTASK_NODE_MAX;n++) {
+        struct node_peer_t *p=&node_peers[n];
+        if (!p->known || now-p->heard>POWERTASK_NODE_STALE) continue;
+        if (p->available<need || p->available<=better) continue;
+        if (best<0 || p->available>node_peers[best].available) best=n;
+    }
+    if (best<0) return 0;
+
+    // Send its ID and input
+    static unsigned char m[POWERTASK_NODE_MESSAGE_MAX];
+    const powertask_telemetry_t *input=task->input;
+    if (task->shared) input=powertask_shared_telemetry(task->shared);
+    m[0]=NODE_TASK; m[1]=node_self;
+    m[2]=a->ID>>8; m[3]=a->ID&0xFF;
+    m[4]=a->input_length>>8; m[5]=a->input_length&0xFF;
+    memcpy(m+6,input->data,a->input_length);
+    if (!node_transport->send(node_transport->context,best,m,6+a->input_length)) return 0;
+    DEBUGF(2,("powertask_node: forwarding %04x (%s) to node %d\n",(int)a->ID,a->name,best));
+
+    // Until its next summary, count this task against the peer's spare energy
+    struct node_peer_t *p=&node_peers[best];
+    p->available=p->available>a->energy_per_run?p->available-a->energy_per_run:0;
+    node_stats.tasks_forwarded++;
+    return 1;
+}
+
+
+#ifdef POWERTASK_HOSTED
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// The Unix datagram socket transport: node n's socket is "<directory>/node<n>".
+struct node_unix_t {
+    int fd;
+    powertask_node_t self;
+    char directory[80];
+};
+static struct node_unix_t node_unix;
+
+static void node_unix_address(struct sockaddr_un *address,powertask_node_t node)
+{
+    memset(address,0,sizeof(*address));
+    address->sun_family=AF_UNIX;
+    snprintf(address->sun_path,sizeof(address->sun_path),"%s/node%d",node_unix.directory,(int)node);
+}
+
+static int node_unix_send(void *context,powertask_node_t to,const void *bytes,uint32_t length)
+{
+    struct node_unix_t *u=(struct node_unix_t *)context;
+    struct sockaddr_un address;
+    if (to!=POWERTASK_NODE_ALL)
+    { // a stalled peer's full queue means not sent: never block run_next
+        node_unix_address(&address,to);
+        return sendto(u->fd,bytes,length,MSG_DONTWAIT,(struct sockaddr *)&address,sizeof(address))==(int)length;
+    }
+    int n, sent=0;
+    for (n=0;n<POWERTASK_NODE_MAX;n++) {
+        if (n==u->self) continue;
+        node_unix_address(&address,n);
+        if (sendto(u->fd,bytes,length,MSG_DONTWAIT,(struct sockaddr *)&address,sizeof(address))==(int)length)
+            sent++;
+    }
+    return sent>0;
+}
+
+static int node_unix_receive(void *context,void *bytes,uint32_t max)
+{
+    struct node_unix_t *u=(struct node_unix_t *)context;
+    int length=recv(u->fd,bytes,max,MSG_DONTWAIT);
+    return length>0?length:0;
+}
+
+static const powertask_transport_t node_unix_transport={
+    node_unix_send,node_unix_receive,&node_unix
+};
+
+const powertask_transport_t *powertask_transport_unix(const char *directory,powertask_node_t self)
+{
+    struct sockaddr_un address;
+    if (strlen(directory)>=sizeof(node_unix.directory) || self>=POWERTASK_NODE_MAX) return 0;
+    strcpy(node_unix.directory,directory);
+    node_unix.self=self;
+    if (node_unix.fd>0) close(node_unix.fd);
+    node_unix.fd=socket(AF_UNIX,SOCK_DGRAM,0);
+    if (node_unix.fd<0) return 0;
+    node_unix_address(&address,self);
+    unlink(address.sun_path);
+    if (bind(node_unix.fd,(struct sockaddr *)&address,sizeof(address))!=0) {
+        close(node_unix.fd);
+        node_unix.fd=0;
+        return 0;
+    }
+    return &node_unix_transport;
+}
+#endif
@@ -0,0 +1,87 @@
+/**
+ CPU performance state hints: switches the platform's performance state
+ to what each task asks for before its function runs, and counts switches.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+static powertask_perf_hook_t perf_hook=0;
+static uint8_t perf_batch_max=8;
+static powertask_perf_stats_t perf_stats;
+
+void powertask_perf_set_hook(powertask_perf_hook_t hook)
+{
+    perf_hook=hook;
+    perf_stats.state=0; // the new hook hasn't set anything yet
+}
+
+void powertask_perf_batch(uint8_t max)
+{
+    perf_batch_max=max;
+}
+
+const powertask_perf_stats_t *powertask_perf_stats(void)
+{
+    return &perf_stats;
+}
+
+int powertask_perf_matches(const powertask_task_t *task)
+{
+    uint8_t want=task->attribute->perf_state;
+    return want==POWERTASK_PERF_ANY || want==perf_stats.state;
+}
+
+int powertask_perf_may_bypass(const powertask_task_t *task)
+{
+    return task->perf_bypassed<perf_batch_max;
+}
+
+void powertask_perf_bypass(powertask_task_t *task)
+{
+    task->perf_bypassed++;
+    perf_stats.batched++;
+}
+
+void powertask_perf_apply(const powertask_task_t *task)
+{
+    uint8_t want=task->attribute->perf_state;
+    if (want==POWERTASK_PERF_ANY || want==perf_stats.state) return;
+    if (want>POWERTASK_PERF_STATES) powertask_fatal("Task perf_state too big for POWERTASK_PERF_STATES",task->attribute->ID);
+    DEBUGF(3,("  switching to performance state %d\n",(int)want));
+    if (perf_hook) perf_hook(want);
+    perf_stats.state=want;
+    perf_stats.switches++;
+}
+
+#ifdef POWERTASK_HOSTED
+static char perf_cpufreq_path[256];
+static uint32_t perf_cpufreq_khz[POWERTASK_PERF_STATES];
+
+static void perf_cpufreq_hook(uint8_t state)
+{
+    FILE *f=fopen(perf_cpufreq_path,"w");
+    if (f==0) {
+        DEBUGF(1,("powertask_perf: can't write %s\n",perf_cpufreq_path));
+        return;
+    }
+    fprintf(f,"%u\n",(unsigned int)perf_cpufreq_khz[state-1]);
+    fclose(f);
+}
+
+int powertask_perf_cpufreq(const char *path,const uint32_t khz[POWERTASK_PERF_STATES])
+{
+    int i;
+    FILE *f=fopen(path,"a"); // don't change anything until a task asks
+    if (f==0 || strlen(path)>=sizeof(perf_cpufreq_path)) {
+        if (f) fclose(f);
+        return 0;
+    }
+    fclose(f);
+    strcpy(perf_cpufreq_path,path);
+    for (i=0;i<POWERTASK_PERF_STATES;i++) perf_cpufreq_khz[i]=khz[i];
+    powertask_perf_set_hook(perf_cpufreq_hook);
+    return 1;
+}
+#endif
@@ -0,0 +1,445 @@
+/**
+ Periodic tasks and admission control: periodic tasks are released
+ through the time-tagged command queue, run ahead of other tasks in
+ rate-monotonic order, and are admitted only after response-time
+ analysis shows the whole periodic set still meets its periods.
+
+ The analysis is for non-preemptive fixed priorities.  Task i, with
+ execution C(i) and period T(i), can be blocked by one run already
+ started: B(i) is the longest execution of any lower priority periodic
+ task or non-periodic run.  Because a run can't be preempted, the first
+ job after a critical instant isn't always the worst: one that runs 
+ late can push the next job of task i later still.  So every job q in
+ the level-i busy period (the time t that tasks i and up keep the CPU
+ busy, the smallest fixed point of t = B(i) + sum over j<=i of 
+ ceil(t/T(j))*C(j)) is checked.  Job q's worst start delay w(q) is
+ the smallest fixed point of
+     w = B(i) + q*C(i) + sum over higher priority j of (floor(w/T(j))+1)*C(j)
+ and its response w(q)+C(i)-q*T(i) must be within T(i).  If tasks i 
+ and up use all the CPU, the busy period never ends, and task i misses.
+
+ Analysis is incremental: adding a task or measuring a longer execution
+ only makes busy periods and start delays grow, so re-analysis starts
+ each affected task from its old values, usually one iteration from the
+ answer, and skips the higher priority tasks whose blocking didn't 
+ change.  Removing a task re-analyzes from scratch.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+#define PERIODIC_WORDS ((POWERTASK_PERIODIC_MAX+31)/32)
+
+#if POWERTASK_PERIODIC_MAX > 65535
+#error "POWERTASK_PERIODIC_MAX must fit in powertask_task_t's 16-bit periodic index"
+#endif
+
+/// One periodic task.
+struct powertask_periodic_entry_t {
+    powertask_task_t *task;
+    powertask_periodic_stats_t stats;
+    powertask_time_t next_release; // time of the release we stored in the time-tagged queue
+    powertask_time_t released; // release time of the open job
+    powertask_time_t job_time; // run time of the open job so far
+    uint8_t open; // 1 from a release until that job finishes
+
+    // Analysis state, from the last analysis
+    powertask_time_t cost; // execution time used: the larger of declared and measured
+    powertask_time_t blocked; // B: longest run that can block this task
+    powertask_time_t start; // w(0): worst start delay of the first job
+    powertask_time_t busy; // t: level-i busy period
+};
+typedef struct powertask_periodic_entry_t powertask_periodic_entry_t;
+
+/// The periodic tasks in priority order: shortest period first (then first admitted).
+static powertask_periodic_entry_t periodic_table[POWERTASK_PERIODIC_MAX];
+int powertask_periodic_count=0;
+
+/// Bit i is set while periodic_table[i]'s task is runnable.
+static uint32_t periodic_ready[PERIODIC_WORDS];
+
+static uint8_t periodic_mode=POWERTASK_ADMISSION_REJECT;
+static powertask_time_t periodic_declared_blocking=0;
+static powertask_time_t periodic_measured_blocking=0;
+static powertask_schedulability_t periodic_result;
+
+/// First task whose analysis is out of date (powertask_periodic_count if
+///   only the totals are), or -1 if it's all up to date.
+static int periodic_stale=-1;
+static int periodic_scratch=0; // 1 if stale tasks must be analyzed from scratch
+
+static powertask_time_t periodic_blocking(void)
+{
+    if (periodic_measured_blocking>periodic_declared_blocking) return periodic_measured_blocking;
+    return periodic_declared_blocking;
+}
+
+/// Mark tasks from "first" on out of date.
+static void periodic_mark_stale(int first,int scratch)
+{
+    if (periodic_stale<0 || first<periodic_stale) periodic_stale=first;
+    if (scratch) periodic_scratch=1;
+}
+
+/// A run of this length can now block the tasks above index "below": mark
+///   stale the higher priority tasks it blocks longer, and everything after them.
+static void periodic_blocking_grew(int below,powertask_time_t cost)
+{
+    int first=below;
+    while (first>0 && periodic_table[first-1].blocked<cost) first--; // blocked shrinks down the table
+    periodic_mark_stale(first,0);
+}
+
+/// Set each task's index and ready bit from "first" on, after the table moved.
+static void periodic_renumber(int first)
+{
+    int i;
+    for (i=first;i<POWERTASK_PERIODIC_MAX;i++) {
+        uint32_t bit=1u<<(i%32);
+        if (i<powertask_periodic_count && periodic_table[i].task->prev) periodic_ready[i/32]|=bit;
+        else periodic_ready[i/32]&=~bit;
+        if (i<powertask_periodic_count) periodic_table[i].task->periodic=i+1;
+    }
+}
+
+/// Analyze tasks from "first" on, then total up the whole set.
+///   Returns 1 if the set is schedulable.
+static int periodic_analyze(int first,int scratch)
+{
+    int n=powertask_periodic_count, i, j;
+    powertask_schedulability_t *r=&periodic_result;
+
+    // Execution times, and blocking from the bottom up
+    powertask_time_t blocked=periodic_blocking();
+    for (i=n-1;i>=0;i--) {
+        powertask_periodic_entry_t *e=&periodic_table[i];
+        e->cost=e->stats.execution;
+        if (e->stats.measured>e->cost) e->cost=e->stats.measured;
+        e->blocked=blocked;
+        if (e->cost>blocked) blocked=e->cost;
+    }
+
+    // Worst response of each stale task, over the jobs in its busy period
+    if (first<n) r->analyses++;
+    for (i=first;i<n;i++) {
+        powertask_periodic_entry_t *e=&periodic_table[i];
+        powertask_time_t C=e->cost, T=e->stats.period, before=e->blocked, t, w, next, response=0;
+        uint64_t load=0;
+        uint32_t q, jobs;
+        for (j=0;j<i;j++) {
+            before+=periodic_table[j].cost; // one job of each higher priority task
+            load+=(periodic_table[j].cost*1000000ull+periodic_table[j].stats.period-1)/periodic_table[j].stats.period;
+        }
+        load+=(C*1000000ull+T-1)/T; // rounded up, so an overload is never missed
+        if (load>=1000000)
+        { // tasks i and up can keep the CPU busy forever
+            e->start=e->busy=0;
+            e->stats.response=~(powertask_time_t)0;
+            continue;
+        }
+        
+        // The level-i busy period
+        t=before+C;
+        if (!scratch && e->busy>t) t=e->busy; // the old t is still a lower bound
+        while (1) {
+            r->iterations++;
+            next=e->blocked;
+            for (j=0;j<=i;j++)
+                next+=(t+periodic_table[j].stats.period-1)/periodic_table[j].stats.period*periodic_table[j].cost;
+            if (next==t) break;
+            t=next;
+        }
+        e->busy=t;
+        jobs=(t+T-1)/T;
+        
+        // Each job's start delay: job q starts at least C after job q-1
+        w=before;
+        if (!scratch && e->start>w) w=e->start; // the old w(0) is still a lower bound
+        for (q=0;q<jobs;q++) {
+            while (1) {
+                r->iterations++;
+                next=e->blocked+q*C;
+                for (j=0;j<i;j++)
+                    next+=(w/periodic_table[j].stats.period+1)*periodic_table[j].cost;
+                if (next==w) break;
+                w=next;
+                if (w+C>T+q*T) break; // it can miss: w keeps growing
+            }
+            if (q==0) e->start=w;
+            if (w+C>q*T && w+C-q*T>response) response=w+C-q*T;
+            if (response>T) break;
+            w+=C;
+        }
+        e->stats.response=response;
+    }
+
+    // Totals over the whole set
+    uint64_t utilization=0, demand=0;
+    r->tasks=n;
+    r->critical=0;
+    r->slack=0;
+    r->schedulable=1;
+    powertask_time_t least=0;
+    for (i=0;i<n;i++) {
+        powertask_periodic_entry_t *e=&periodic_table[i];
+        uint32_t energy=e->task->attribute->energy_per_run;
+        if (e->stats.energy>energy) energy=e->stats.energy;
+        utilization+=e->cost*1000000ull/e->stats.period;
+        demand+=energy*1000000000ull/e->stats.period;
+        powertask_time_t slack=0;
+        if (e->stats.response<=e->stats.period) slack=e->stats.period-e->stats.response;
+        else r->schedulable=0;
+        if (r->critical==0 || slack<least) {
+            least=slack;
+            r->critical=e->task->attribute->ID;
+            r->slack=slack;
+        }
+    }
+    r->utilization=utilization>0xFFFFFFFFu?0xFFFFFFFFu:(uint32_t)utilization;
+    r->utilization_margin=(int32_t)(1000000-(int64_t)utilization);
+    r->blocking=periodic_blocking();
+    r->energy_demand=demand>0x7FFFFFFF?0x7FFFFFFF:(uint32_t)demand;
+    r->energy_margin=(int32_t)((int64_t)r->energy_income-r->energy_demand);
+    if (r->energy_income && r->energy_margin<0) r->schedulable=0;
+
+    periodic_stale=-1;
+    periodic_scratch=0;
+    return r->schedulable;
+}
+
+/// Bring the analysis up to date.
+static int periodic_update(void)
+{
+    if (periodic_stale<0) return periodic_result.schedulable;
+    return periodic_analyze(periodic_stale,periodic_scratch);
+}
+
+/// Take entry i out of the table.
+static void periodic_delete(int i)
+{
+    periodic_table[i].task->periodic=0;
+    powertask_periodic_count--;
+    memmove(&periodic_table[i],&periodic_table[i+1],(powertask_periodic_count-i)*sizeof(periodic_table[0]));
+    periodic_renumber(i);
+}
+
+int powertask_periodic(powertask_ID_t ID,powertask_time_t period,powertask_time_t execution)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) powertask_fatal("Invalid task in powertask_periodic",ID);
+    if (period==0) powertask_fatal("Periodic task needs a period",ID);
+    if (task->attribute->input_length>POWERTASK_TIMED_INPUT_MAX)
+        powertask_fatal("Task input too big for POWERTASK_TIMED_INPUT_MAX",ID);
+
+    powertask_periodic_entry_t old;
+    int old_index=task->periodic-1;
+    if (old_index>=0)
+    { // take it out, and put it back with the new parameters
+        old=periodic_table[old_index];
+        periodic_delete(old_index);
+        periodic_mark_stale(0,1);
+    }
+    if (powertask_periodic_count>=POWERTASK_PERIODIC_MAX)
+        powertask_fatal("Too many periodic tasks (POWERTASK_PERIODIC_MAX)",ID);
+    periodic_update(); // so the analysis saved below is current
+
+    // Its place in priority order: after every task with the same or shorter period
+    int p=powertask_periodic_count, i;
+    while (p>0 && periodic_table[p-1].stats.period>period) p--;
+
+    // Save the analysis it changes, to put back if it's rejected
+    static powertask_time_t saved_blocked[POWERTASK_PERIODIC_MAX], saved_start[POWERTASK_PERIODIC_MAX], 
+        saved_busy[POWERTASK_PERIODIC_MAX], saved_response[POWERTASK_PERIODIC_MAX];
+    powertask_schedulability_t saved_result=periodic_result;
+    for (i=0;i<powertask_periodic_count;i++) {
+        saved_blocked[i]=periodic_table[i].blocked;
+        saved_start[i]=periodic_table[i].start;
+        saved_busy[i]=periodic_table[i].busy;
+        saved_response[i]=periodic_table[i].stats.response;
+    }
+
+    memmove(&periodic_table[p+1],&periodic_table[p],(powertask_periodic_count-p)*sizeof(periodic_table[0]));
+    powertask_periodic_count++;
+    powertask_periodic_entry_t *e=&periodic_table[p];
+    memset(e,0,sizeof(*e));
+    e->task=task;
+    e->stats=old_index>=0?old.stats:e->stats; // keep what we've measured
+    e->stats.period=period;
+    e->stats.execution=execution;
+    periodic_renumber(p);
+
+    powertask_time_t cost=execution>e->stats.measured?execution:e->stats.measured;
+    periodic_blocking_grew(p,cost);
+    int ok=periodic_update();
+    DEBUGF(2,("powertask_periodic %04x (%s) every %llu us, %llu us: response %llu us, utilization %.1f%%%s\n",
+        (int)ID,task->attribute->name,(unsigned long long)period,(unsigned long long)execution,
+        (unsigned long long)e->stats.response,periodic_result.utilization*1.0e-4,
+        ok?"":", NOT SCHEDULABLE"));
+
+    if (!ok && periodic_mode==POWERTASK_ADMISSION_REJECT)
+    { // put everything back the way it was
+        DEBUGF(1,("powertask_periodic rejects %04x (%s): the periodic set can't meet its periods\n",
+            (int)ID,task->attribute->name));
+        periodic_delete(p);
+        for (i=0;i<powertask_periodic_count;i++) {
+            periodic_table[i].blocked=saved_blocked[i];
+            periodic_table[i].start=saved_start[i];
+            periodic_table[i].busy=saved_busy[i];
+            periodic_table[i].stats.response=saved_response[i];
+        }
+        saved_result.analyses=periodic_result.analyses; // keep counting what analysis costs
+        saved_result.iterations=periodic_result.iterations;
+        periodic_result=saved_result;
+        if (old_index>=0)
+        { // keep its old period, and its releases already stored
+            memmove(&periodic_table[old_index+1],&periodic_table[old_index],
+                (powertask_periodic_count-old_index)*sizeof(periodic_table[0]));
+            powertask_periodic_count++;
+            periodic_table[old_index]=old;
+            periodic_renumber(old_index);
+            periodic_mark_stale(0,1);
+        }
+        return 0;
+    }
+    if (!ok) DEBUGF(1,("powertask_periodic WARNING: admitting %04x (%s), but the periodic set can miss its periods\n",
+            (int)ID,task->attribute->name));
+
+    // Start releasing it
+    e->next_release=powertask_get_time();
+    powertask_make_runnable_at(ID,e->next_release);
+    return ok;
+}
+
+int powertask_periodic_remove(powertask_ID_t ID)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0 || task->periodic==0) return 0;
+    DEBUGF(2,("powertask_periodic_remove %04x (%s)\n",(int)ID,task->attribute->name));
+    periodic_delete(task->periodic-1);
+    periodic_mark_stale(0,1);
+    return 1;
+}
+
+void powertask_periodic_forget(powertask_task_t *task)
+{
+    periodic_delete(task->periodic-1);
+    periodic_mark_stale(0,1);
+}
+
+void powertask_periodic_admission(uint8_t mode)
+{
+    periodic_mode=mode;
+}
+
+void powertask_periodic_blocking(powertask_time_t longest)
+{
+    if (longest>periodic_blocking()) periodic_blocking_grew(powertask_periodic_count,longest);
+    else periodic_mark_stale(0,1); // blocking can shrink
+    periodic_declared_blocking=longest;
+}
+
+void powertask_periodic_income(uint32_t milliwatts)
+{
+    periodic_result.energy_income=milliwatts;
+    periodic_mark_stale(powertask_periodic_count,0);
+}
+
+const powertask_periodic_stats_t *powertask_periodic_stats(powertask_ID_t ID)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0 || task->periodic==0) return 0;
+    periodic_update();
+    return &periodic_table[task->periodic-1].stats;
+}
+
+const powertask_schedulability_t *powertask_schedulability(void)
+{
+    int was_schedulable=periodic_result.schedulable || periodic_result.tasks==0;
+    if (!periodic_update() && was_schedulable)
+        DEBUGF(1,("powertask_schedulability WARNING: with measured times, %04x can miss its period\n",
+            (int)periodic_result.critical));
+    return &periodic_result;
+}
+
+void powertask_periodic_release(powertask_task_t *task,powertask_time_t when)
+{
+    powertask_periodic_entry_t *e=&periodic_table[task->periodic-1];
+    if (when!=e->next_release) return; // stored before its period changed
+    e->stats.releases++;
+    if (task->prev && e->open)
+    { // the last job hasn't even started: this release is lost
+        e->stats.misses++;
+        DEBUGF(2,("  periodic task %04x is still queued at its next release\n",(int)task->attribute->ID));
+    }
+    else {
+        e->open=1;
+        e->released=when;
+        e->job_time=0;
+    }
+    e->next_release=when+e->stats.period;
+    powertask_make_runnable_at(task->attribute->ID,e->next_release);
+}
+
+void powertask_periodic_runnable(powertask_task_t *task,int runnable)
+{
+    int i=task->periodic-1;
+    if (runnable) periodic_ready[i/32]|=1u<<(i%32);
+    else periodic_ready[i/32]&=~(1u<<(i%32));
+}
+
+powertask_task_t *powertask_periodic_pick(powertask_energy_t battery,
+    const powertask_task_t *reserved)
+{
+    int w, looked=0;
+    for (w=0;w<PERIODIC_WORDS;w++) {
+        uint32_t bits=periodic_ready[w];
+        while (bits!=0) {
+            powertask_task_t *task=periodic_table[w*32+__builtin_ctz(bits)].task;
+            if (battery>=task->attribute->minimum_battery) {
+                if (reserved==0 || task==reserved
+                  || battery>=reserved->attribute->minimum_battery+task->attribute->energy_per_run)
+                    return task;
+                task->stats.held++; // running it would spend the starved task's energy
+            }
+            if (++looked>=POWERTASK_PERIODIC_LOOKAHEAD) return 0;
+            bits&=bits-1;
+        }
+    }
+    return 0;
+}
+
+void powertask_periodic_ran(powertask_task_t *task,powertask_time_t start,uint32_t used,
+    powertask_result_t result)
+{
+    powertask_time_t end=powertask_get_time();
+    powertask_time_t run=end>start?end-start:0;
+    if (task->periodic==0)
+    { // a non-periodic run blocks periodic tasks this long
+        if (run>periodic_measured_blocking) {
+            if (run>periodic_blocking()) periodic_blocking_grew(powertask_periodic_count,run);
+            periodic_measured_blocking=run;
+        }
+        return;
+    }
+    int i=task->periodic-1;
+    powertask_periodic_entry_t *e=&periodic_table[i];
+    e->job_time+=run;
+    if (result==POWERTASK_RESULT_RETRY) return; // the job isn't done
+
+    if (e->job_time>e->stats.measured) {
+        e->stats.measured=e->job_time;
+        if (e->job_time>e->cost) periodic_blocking_grew(i,e->job_time);
+    }
+    if (used>e->stats.energy) {
+        e->stats.energy=used;
+        if (used>e->task->attribute->energy_per_run) periodic_mark_stale(powertask_periodic_count,0);
+    }
+    if (e->open) {
+        powertask_time_t response=end>e->released?end-e->released:0;
+        if (response>e->stats.max_response) e->stats.max_response=response;
+        if (response>e->stats.period) e->stats.misses++;
+        e->open=0;
+    }
+    e->job_time=0;
+}
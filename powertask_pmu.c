@@ -0,0 +1,160 @@
+/**
+ Hardware performance counters: on hosted Linux builds, a group of
+ perf_event counters is read around every task function call, and the
+ difference is added to that task's totals, for ground profiling.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include "powertask_internal.h"
+
+#ifdef POWERTASK_HOSTED
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static const uint64_t pmu_config[POWERTASK_PMU_COUNTERS]={
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+static const char *pmu_names[POWERTASK_PMU_COUNTERS]={"cycles","instructions","cache misses","branch misses"};
+
+static int pmu_leader=-1; // the group leader's file descriptor, or -1 if not counting
+static int pmu_fd[POWERTASK_PMU_COUNTERS];
+static int pmu_slot[POWERTASK_PMU_COUNTERS]; // position in a group read of each open counter
+static int pmu_open=0; // counters in the group
+static int pmu_mask=0; // bitmask of the open counters
+
+/// A group read: the number of counters, then their values in the order they joined.
+struct pmu_read_t {
+    uint64_t nr;
+    uint64_t value[POWERTASK_PMU_COUNTERS];
+};
+static struct pmu_read_t pmu_before;
+static uint64_t pmu_overhead[POWERTASK_PMU_COUNTERS]; // counted by the reads themselves
+
+static void pmu_read(struct pmu_read_t *r)
+{
+    if (read(pmu_leader,r,sizeof(*r))<(ssize_t)sizeof(uint64_t)) r->nr=0;
+}
+
+/// Return counter c's value in this read, or 0 if it isn't open.
+static uint64_t pmu_value(const struct pmu_read_t *r,int c)
+{
+    if (!(pmu_mask&(1<<c)) || pmu_slot[c]>=(int)r->nr) return 0;
+    return r->value[pmu_slot[c]];
+}
+
+int powertask_pmu_start(void)
+{
+    int c;
+    if (pmu_leader>=0) powertask_pmu_stop();
+    for (c=0;c<POWERTASK_PMU_COUNTERS;c++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr,0,sizeof(attr));
+        attr.type=PERF_TYPE_HARDWARE;
+        attr.size=sizeof(attr);
+        attr.config=pmu_config[c];
+        attr.disabled=(pmu_leader<0); // the leader starts the whole group
+        attr.exclude_kernel=1;
+        attr.exclude_hv=1;
+        attr.read_format=PERF_FORMAT_GROUP;
+        int fd=syscall(SYS_perf_event_open,&attr,0,-1,pmu_leader,0); // this thread, any CPU
+        pmu_fd[c]=fd;
+        if (fd<0) {
+            DEBUGF(1,("powertask_pmu: can't open %s counter\n",pmu_names[c]));
+            continue;
+        }
+        if (pmu_leader<0) pmu_leader=fd;
+        pmu_slot[c]=pmu_open++;
+        pmu_mask|=1<<c;
+    }
+    if (pmu_leader<0) return 0;
+    ioctl(pmu_leader,PERF_EVENT_IOC_RESET,PERF_IOC_FLAG_GROUP);
+    ioctl(pmu_leader,PERF_EVENT_IOC_ENABLE,PERF_IOC_FLAG_GROUP);
+
+    // Measure what reading the counters costs: the least of many empty reads
+    struct pmu_read_t after;
+    int i;
+    for (c=0;c<POWERTASK_PMU_COUNTERS;c++) pmu_overhead[c]=~0ull;
+    for (i=0;i<100;i++) {
+        pmu_read(&pmu_before);
+        pmu_read(&after);
+        for (c=0;c<POWERTASK_PMU_COUNTERS;c++) {
+            uint64_t d=pmu_value(&after,c)-pmu_value(&pmu_before,c);
+            if (d<pmu_overhead[c]) pmu_overhead[c]=d;
+        }
+    }
+    DEBUGF(2,("powertask_pmu_start: %d counters, reads cost %llu cycles\n",
+        pmu_open,(unsigned long long)pmu_overhead[POWERTASK_PMU_CYCLES]));
+    return pmu_mask;
+}
+
+void powertask_pmu_stop(void)
+{
+    int c;
+    for (c=0;c<POWERTASK_PMU_COUNTERS;c++)
+        if ((pmu_mask&(1<<c)) && pmu_fd[c]!=pmu_leader) close(pmu_fd[c]);
+    if (pmu_leader>=0) close(pmu_leader);
+    pmu_leader=-1;
+    pmu_open=pmu_mask=0;
+}
+
+void powertask_pmu_begin(void)
+{
+    if (pmu_leader<0) return;
+    pmu_read(&pmu_before);
+}
+
+void powertask_pmu_end(powertask_task_t *task)
+{
+    if (pmu_leader<0) return;
+    struct pmu_read_t after;
+    pmu_read(&after);
+    if (task->pmu==0) {
+        task->pmu=(powertask_pmu_stats_t *)calloc(1,sizeof(powertask_pmu_stats_t));
+        if (task->pmu==0) return;
+    }
+    powertask_pmu_stats_t *s=task->pmu;
+    int c;
+    for (c=0;c<POWERTASK_PMU_COUNTERS;c++) {
+        uint64_t d=pmu_value(&after,c)-pmu_value(&pmu_before,c);
+        d=d>pmu_overhead[c]?d-pmu_overhead[c]:0;
+        s->total[c]+=d;
+        if (c==POWERTASK_PMU_CYCLES && d>s->max_cycles) s->max_cycles=d;
+    }
+    s->calls++;
+}
+
+const powertask_pmu_stats_t *powertask_pmu_stats(powertask_ID_t ID)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    return task?task->pmu:0;
+}
+
+/// Print one task's line of the report.
+static void pmu_report_task(powertask_task_t *task)
+{
+    const powertask_pmu_stats_t *s=task->pmu;
+    if (s==0 || s->calls==0) return;
+    double n=s->calls;
+    printf("%04x %-16s %8u %10.0f %10.0f %6.2f %10.1f %10.1f\n",
+        (int)task->attribute->ID,task->attribute->name,(unsigned int)s->calls,
+        s->total[POWERTASK_PMU_CYCLES]/n,(double)s->max_cycles,
+        s->total[POWERTASK_PMU_CYCLES]?(double)s->total[POWERTASK_PMU_INSTRUCTIONS]/s->total[POWERTASK_PMU_CYCLES]:0.0,
+        s->total[POWERTASK_PMU_CACHE_MISSES]/n,s->total[POWERTASK_PMU_BRANCH_MISSES]/n);
+}
+
+void powertask_pmu_report(void)
+{
+    printf("ID   %-16s %8s %10s %10s %6s %10s %10s\n","task","calls","cycles","max","IPC","cache miss","branch miss");
+    powertask_task_walk(pmu_report_task);
+}
+
+#endif
@@ -0,0 +1,127 @@
+/**
+ Bulk data stores and region inputs: a task's input can name a range of
+ bytes in a read-only store (flash, or a memory-mapped file on hosted
+ builds), which the task reads in place instead of getting a copy.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+#ifdef POWERTASK_HOSTED
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// One registered store.
+struct powertask_store_t {
+    const powertask_data_t *base; // 0 if not registered
+    uint32_t length;
+};
+static struct powertask_store_t stores[POWERTASK_STORE_MAX];
+
+void powertask_store_register(powertask_store_ID_t store,const void *base,uint32_t length)
+{
+    if (store>=POWERTASK_STORE_MAX) powertask_fatal("Invalid store in powertask_store_register",store);
+    DEBUGF(3,("powertask_store_register %d: %d bytes at %p\n",(int)store,(int)length,base));
+    stores[store].base=(const powertask_data_t *)base;
+    stores[store].length=length;
+}
+
+#ifdef POWERTASK_HOSTED
+int powertask_store_map_file(powertask_store_ID_t store,const char *path)
+{
+    int fd=open(path,O_RDONLY);
+    if (fd<0) return 0;
+    struct stat st;
+    if (fstat(fd,&st)!=0 || st.st_size==0 || st.st_size>0xFFFFFFFFu) {
+        close(fd);
+        return 0;
+    }
+    void *base=mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd); // the mapping keeps the file open
+    if (base==MAP_FAILED) return 0;
+    powertask_store_register(store,base,(uint32_t)st.st_size);
+    return 1;
+}
+#endif
+
+uint32_t powertask_crc32(const void *data,uint32_t length)
+{
+    static uint32_t table[256];
+    static int table_ready=0;
+    if (!table_ready) {
+        uint32_t i,k;
+        for (i=0;i<256;i++) {
+            uint32_t c=i;
+            for (k=0;k<8;k++) c=(c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+            table[i]=c;
+        }
+        table_ready=1;
+    }
+    const powertask_data_t *p=(const powertask_data_t *)data;
+    uint32_t crc=0xFFFFFFFFu;
+    while (length--) crc=table[(crc^*p++)&0xFF]^(crc>>8);
+    return crc^0xFFFFFFFFu;
+}
+
+/// Return the region's data if it lies inside a registered store, else 0.
+static const powertask_data_t *region_find(const powertask_region_t *r)
+{
+    if (r->store>=POWERTASK_STORE_MAX) return 0;
+    const struct powertask_store_t *s=&stores[r->store];
+    if (s->base==0 || r->offset>s->length || r->length>s->length-r->offset) return 0;
+    return s->base+r->offset;
+}
+
+void powertask_make_runnable_region(powertask_ID_t ID,powertask_store_ID_t store,
+    uint32_t offset,uint32_t length,uint32_t crc32)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) powertask_fatal("Invalid task in powertask_make_runnable_region",ID);
+    if (!(task->attribute->flags&POWERTASK_FLAG_REGION_INPUT)
+      || task->attribute->input_length!=sizeof(powertask_region_t))
+        powertask_fatal("powertask_make_runnable_region task needs a region input",ID);
+
+    powertask_region_t r;
+    r.offset=offset;
+    r.length=length;
+    r.crc32=crc32;
+    r.store=store;
+    if (region_find(&r)==0)
+        DEBUGF(1,("  region for task %04x is outside store %d\n",(int)ID,(int)store));
+
+    powertask_telemetry_t *input=powertask_make_runnable(ID);
+    memcpy(input->data,&r,sizeof(r));
+}
+
+int powertask_region_check(powertask_task_t *task)
+{
+    powertask_region_t r;
+    if (task->attribute->input_length!=sizeof(r)) return 0;
+    memcpy(&r,task->input->data,sizeof(r));
+    const powertask_data_t *data=region_find(&r);
+    if (data==0) {
+        DEBUGF(1,("  task %04x region is outside store %d\n",(int)task->attribute->ID,(int)r.store));
+        return 0;
+    }
+    if (r.crc32!=0 && !task->region_checked)
+    { // check the CRC once per command, not on every retry
+        if (powertask_crc32(data,r.length)!=r.crc32) {
+            DEBUGF(1,("  task %04x region fails its CRC check\n",(int)task->attribute->ID));
+            return 0;
+        }
+        task->region_checked=1;
+    }
+    return 1;
+}
+
+const void *powertask_region_data(const powertask_telemetry_t *input,uint32_t *length)
+{
+    powertask_region_t r;
+    memcpy(&r,input->data,sizeof(r));
+    *length=r.length;
+    return region_find(&r);
+}
@@ -0,0 +1,216 @@
+/**
+ Stored command sequences: a list of task commands uplinked once,
+ then replayed by a single small SequenceStart command.
+
+ Sequence code is checked when it's defined, so starting a sequence
+ just walks the stored bytes making tasks runnable.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+/// One stored sequence: its code is in sequence_code[offset .. offset+length).
+struct powertask_sequence_t {
+    powertask_ID_t ID;
+    uint16_t offset;
+    uint16_t length;
+};
+typedef struct powertask_sequence_t powertask_sequence_t;
+
+static powertask_sequence_t sequences[POWERTASK_SEQUENCE_MAX];
+static int sequence_count=0;
+static powertask_data_t sequence_code[POWERTASK_SEQUENCE_BYTES];
+static uint16_t sequence_code_used=0; // bytes of sequence_code in use, packed at the start
+
+/// Read big-endian operands
+static uint16_t sequence_read16(const powertask_data_t *p)
+{
+    return (p[0]<<8) | p[1];
+}
+static uint32_t sequence_read32(const powertask_data_t *p)
+{
+    return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | (p[2]<<8) | p[3];
+}
+
+/// Find the stored sequence with this ID, or return 0.
+static powertask_sequence_t *sequence_lookup(powertask_ID_t ID)
+{
+    int i;
+    for (i=0;i<sequence_count;i++)
+        if (sequences[i].ID==ID) return &sequences[i];
+    return 0;
+}
+
+/// Check this sequence code.  Returns 1 if it can be run without further checks.
+static int sequence_check(const powertask_data_t *code,powertask_length_t length)
+{
+    powertask_length_t i=0;
+    while (i<length) {
+        powertask_data_t op=code[i++];
+        if (op==POWERTASK_SEQ_END) {
+            return i==length; // END must be the last byte
+        }
+        else if (op==POWERTASK_SEQ_RUN) {
+            if (i+2>length) return 0;
+            powertask_ID_t ID=sequence_read16(&code[i]);
+            i+=2;
+            powertask_task_t *task=powertask_task_lookup(ID);
+            if (task==0) {
+                DEBUGF(1,("  sequence runs unregistered task %04x\n",(int)ID));
+                return 0;
+            }
+            if (task->attribute->input_length>POWERTASK_TIMED_INPUT_MAX) {
+                DEBUGF(1,("  sequence task %04x input too big for POWERTASK_TIMED_INPUT_MAX\n",(int)ID));
+                return 0;
+            }
+            if (i+task->attribute->input_length>length) return 0;
+            i+=task->attribute->input_length;
+        }
+        else if (op==POWERTASK_SEQ_DELAY) {
+            if (i+4>length) return 0;
+            i+=4;
+        }
+        else {
+            DEBUGF(1,("  sequence has invalid opcode %02x\n",(int)op));
+            return 0;
+        }
+    }
+    return 0; // ran off the end without an END
+}
+
+int powertask_sequence_delete(powertask_ID_t ID)
+{
+    powertask_sequence_t *seq=sequence_lookup(ID);
+    if (seq==0) return 0;
+
+    // Pack the code of later sequences down over the deleted code
+    uint16_t end=seq->offset+seq->length;
+    memmove(&sequence_code[seq->offset],&sequence_code[end],sequence_code_used-end);
+    sequence_code_used-=seq->length;
+    int i;
+    for (i=0;i<sequence_count;i++)
+        if (sequences[i].offset>seq->offset) sequences[i].offset-=seq->length;
+
+    *seq=sequences[--sequence_count];
+    return 1;
+}
+
+/// Return 1 if this checked sequence code makes this task runnable.
+static int sequence_runs(const powertask_data_t *p,powertask_ID_t task_ID)
+{
+    while (1) {
+        powertask_data_t op=*p++;
+        if (op==POWERTASK_SEQ_RUN) {
+            powertask_ID_t ID=sequence_read16(p);
+            if (ID==task_ID) return 1;
+            p+=2+powertask_task_lookup(ID)->attribute->input_length;
+        }
+        else if (op==POWERTASK_SEQ_DELAY) p+=4;
+        else return 0; // END
+    }
+}
+
+void powertask_sequence_forget(powertask_ID_t task_ID)
+{
+    int i=0;
+    while (i<sequence_count) {
+        if (sequence_runs(&sequence_code[sequences[i].offset],task_ID)) {
+            DEBUGF(1,("  deleting sequence %04x: it runs unregistered task %04x\n",
+                (int)sequences[i].ID,(int)task_ID));
+            powertask_sequence_delete(sequences[i].ID); // moves the last sequence to i
+        }
+        else i++;
+    }
+}
+
+int powertask_sequence_define(powertask_ID_t ID,const powertask_data_t *code,powertask_length_t length)
+{
+    DEBUGF(3,("powertask_sequence_define %04x, %d bytes\n",(int)ID,(int)length));
+    if (!sequence_check(code,length)) {
+        DEBUGF(1,("  rejecting invalid sequence %04x\n",(int)ID));
+        return 0;
+    }
+
+    powertask_sequence_t *old=sequence_lookup(ID);
+    uint16_t old_length=old?old->length:0;
+    if (sequence_code_used-old_length+length>POWERTASK_SEQUENCE_BYTES
+     || (old==0 && sequence_count>=POWERTASK_SEQUENCE_MAX))
+    {
+        DEBUGF(1,("  no room to store sequence %04x\n",(int)ID));
+        return 0;
+    }
+    if (old) powertask_sequence_delete(ID);
+
+    powertask_sequence_t *seq=&sequences[sequence_count++];
+    seq->ID=ID;
+    seq->offset=sequence_code_used;
+    seq->length=length;
+    memcpy(&sequence_code[seq->offset],code,length);
+    sequence_code_used+=length;
+    return 1;
+}
+
+int powertask_sequence_start(powertask_ID_t ID)
+{
+    powertask_sequence_t *seq=sequence_lookup(ID);
+    if (seq==0) {
+        DEBUGF(1,("powertask_sequence_start: no sequence %04x\n",(int)ID));
+        return -1;
+    }
+    DEBUGF(3,("powertask_sequence_start %04x\n",(int)ID));
+
+    // The code was checked at define time, so just walk it.
+    const powertask_data_t *p=&sequence_code[seq->offset];
+    powertask_time_t start=powertask_get_time();
+    uint32_t delay=0;
+    int count=0;
+    while (1) {
+        powertask_data_t op=*p++;
+        if (op==POWERTASK_SEQ_RUN) {
+            powertask_ID_t task_ID=sequence_read16(p);
+            p+=2;
+            powertask_task_t *task=powertask_task_lookup(task_ID);
+            if (task==0) powertask_fatal("Sequence runs an unregistered task",task_ID);
+            // The template is input_length bytes, as checked at define time:
+            //   caller-allocated input buffers may not have their header filled in.
+            powertask_length_t length=task->attribute->input_length;
+            powertask_telemetry_t *input;
+            if (delay==0) input=powertask_task_make_runnable(task);
+            else input=powertask_make_runnable_at(task_ID,start+delay);
+            memcpy(input->data,p,length);
+            p+=length;
+            count++;
+        }
+        else if (op==POWERTASK_SEQ_DELAY) {
+            delay=sequence_read32(p);
+            p+=4;
+        }
+        else /* POWERTASK_SEQ_END */ {
+            return count;
+        }
+    }
+}
+
+
+/// This is the builtin SequenceStart task: input is the big-endian sequence ID.
+static powertask_result_t powertask_sequence_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    if (powertask_sequence_start(sequence_read16(input->data))<0)
+        return POWERTASK_RESULT_FAIL_QUIET+1; // reason 1: no such sequence
+    return POWERTASK_RESULT_OK;
+}
+const static powertask_attribute_t attributes_sequence_task={
+    POWERTASK_ID_SEQUENCE_START, /* our task ID */
+    "SequenceStart", /* human-readable name */
+    0, /* minimum battery energy (Joules) */
+    powertask_sequence_task, /* function to run */
+    2, /* bytes of telemetry input data required */
+    0 /* bytes of telemetry output data produced */
+};
+
+void powertask_sequence_setup(void)
+{
+    powertask_register(&attributes_sequence_task);
+}
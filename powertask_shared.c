@@ -0,0 +1,89 @@
+/**
+ Shared inputs: one immutable, reference counted telemetry buffer used
+ as the input of many runnable tasks, instead of a copy for each task.
+
+ Buffers come from a static pool and go back when the last reference
+ is dropped.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+struct powertask_shared_t {
+    uint16_t references; // 0 if this buffer is free
+    powertask_telemetry_header_t header; // these two fields are laid out
+    powertask_data_t data[POWERTASK_SHARED_BYTES]; //  like a powertask_telemetry_t
+};
+
+static powertask_shared_t shared_pool[POWERTASK_SHARED_MAX];
+static powertask_shared_stats_t shared_stats;
+
+powertask_shared_t *powertask_shared_create(powertask_length_t length)
+{
+    if (length>POWERTASK_SHARED_BYTES) powertask_fatal("Shared input too big for POWERTASK_SHARED_BYTES",length);
+    int i;
+    for (i=0;i<POWERTASK_SHARED_MAX;i++) {
+        powertask_shared_t *s=&shared_pool[i];
+        if (s->references==0) {
+            s->references=1;
+            s->header.ID=0;
+            s->header.length=length;
+            shared_stats.created++;
+            if (++shared_stats.in_use>shared_stats.high_water)
+                shared_stats.high_water=shared_stats.in_use;
+            DEBUGF(3,("powertask_shared_create %d bytes in buffer %d\n",(int)length,i));
+            return s;
+        }
+    }
+    DEBUGF(1,("powertask_shared_create: pool empty (POWERTASK_SHARED_MAX)\n"));
+    return 0;
+}
+
+powertask_telemetry_t *powertask_shared_telemetry(powertask_shared_t *shared)
+{
+    return (powertask_telemetry_t *)&shared->header;
+}
+
+void powertask_shared_release(powertask_shared_t *shared)
+{
+    if (shared->references==0) powertask_fatal("powertask_shared_release of a free buffer",0);
+    if (--shared->references==0) {
+        DEBUGF(3,("  shared input buffer %d is free\n",(int)(shared-shared_pool)));
+        shared_stats.in_use--;
+    }
+}
+
+void powertask_make_runnable_shared(powertask_ID_t ID,powertask_shared_t *shared)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) powertask_fatal("Invalid task in powertask_make_runnable_shared",ID);
+    if (shared->header.length<task->attribute->input_length)
+        powertask_fatal("Shared input smaller than task input_length",ID);
+    if (task->attribute->batch_function || task->attribute->input_depth>1
+      || (task->attribute->flags&POWERTASK_FLAG_REGION_INPUT))
+        powertask_fatal("Task can't take a shared input",ID);
+
+    powertask_telemetry_t *input=powertask_make_runnable(ID); // drops any shared input it already had
+    if (task->prev==0)
+    { // held off: the delayed command gets a copy (a quarantined task drops it)
+        memcpy(input->data,shared->data,task->attribute->input_length);
+        return;
+    }
+
+    shared->references++;
+    shared_stats.references++;
+    task->shared=shared;
+}
+
+/// This task is finished with its shared input.
+void powertask_shared_done(powertask_task_t *task)
+{
+    powertask_shared_release(task->shared);
+    task->shared=0;
+}
+
+const powertask_shared_stats_t *powertask_shared_stats(void)
+{
+    return &shared_stats;
+}
@@ -0,0 +1,236 @@
+/**
+ Time-tagged command queue: stores "run task X with input Y at time T"
+ commands until their time comes, then makes the task runnable.
+
+ The commands live in a static pool of slots.  A binary min-heap of
+ (time, slot) keys orders them, so storing a command is O(log n),
+ and checking whether anything is due is O(1).
+
+ A due command whose task has no room for another input (it's still
+ runnable with one buffer, or its buffers are full) keeps its slot and
+ waits on that task's own list, and is released when the task finishes
+ a command, so its input isn't lost and it doesn't hold up other tasks.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+#if POWERTASK_TIMED_MAX > 65535
+#error "POWERTASK_TIMED_MAX must fit in the 16-bit slot numbers"
+#endif
+
+/// One stored command, with room for its input telemetry.
+///  The header and data are laid out like a powertask_telemetry_t.
+struct powertask_timed_slot_t {
+    powertask_telemetry_header_t header; // header.ID is the task to run
+    powertask_data_t data[POWERTASK_TIMED_INPUT_MAX];
+    powertask_time_t when; // due time, while waiting for its task
+    uint16_t next_waiting; // next slot+1 waiting for the same task, or 0
+};
+typedef struct powertask_timed_slot_t powertask_timed_slot_t;
+
+/// One heap entry: when to release, and which slot holds the command.
+struct powertask_timed_key_t {
+    powertask_time_t when;
+    uint32_t order; // breaks ties between equal times, so they release in FIFO order
+    uint16_t slot;
+};
+typedef struct powertask_timed_key_t powertask_timed_key_t;
+
+static powertask_timed_slot_t timed_slots[POWERTASK_TIMED_MAX];
+static uint16_t timed_free[POWERTASK_TIMED_MAX]; // stack of unused slot numbers
+static int timed_free_count=-1; // -1 means the free stack hasn't been filled yet
+static powertask_timed_key_t timed_heap[POWERTASK_TIMED_MAX];
+static int timed_count=0; // number of keys in timed_heap
+static int timed_waiting_count=0; // due commands waiting on their tasks' lists
+static uint32_t timed_order=0;
+static powertask_timed_stats_t timed_stats;
+
+/// Return 1 if key a should be released before key b.
+static int timed_before(const powertask_timed_key_t *a,const powertask_timed_key_t *b)
+{
+    if (a->when!=b->when) return a->when < b->when;
+    return (int32_t)(a->order - b->order) < 0; // wraparound-safe
+}
+
+/// Return 1 if this task can take a released command without replacing one
+///   it already has.  Periodic releases have no input to lose.
+static int timed_can_release(const powertask_task_t *task)
+{
+    const powertask_attribute_t *a=task->attribute;
+    if (task->prev==0 || task->periodic) return 1;
+    if (a->batch_function) return task->batch_queued<(a->batch_max?a->batch_max:1);
+    return a->input_depth>1 && task->input_staged<a->input_depth-1;
+}
+
+/// Move the key at index i up toward the root until the heap is ordered.
+static void timed_sift_up(int i)
+{
+    powertask_timed_key_t key=timed_heap[i];
+    while (i>0) {
+        int parent=(i-1)/2;
+        if (!timed_before(&key,&timed_heap[parent])) break;
+        timed_heap[i]=timed_heap[parent];
+        i=parent;
+    }
+    timed_heap[i]=key;
+}
+
+/// Move the key at index i down toward the leaves until the heap is ordered.
+static void timed_sift_down(int i)
+{
+    powertask_timed_key_t key=timed_heap[i];
+    while (1) {
+        int child=2*i+1;
+        if (child>=timed_count) break;
+        if (child+1<timed_count && timed_before(&timed_heap[child+1],&timed_heap[child]))
+            child++; // the smaller child
+        if (!timed_before(&timed_heap[child],&key)) break;
+        timed_heap[i]=timed_heap[child];
+        i=child;
+    }
+    timed_heap[i]=key;
+}
+
+powertask_telemetry_t *powertask_make_runnable_at(powertask_ID_t ID,powertask_time_t when)
+{
+    powertask_task_t *task=powertask_task_lookup(ID);
+    if (task==0) powertask_fatal("Invalid task in powertask_make_runnable_at",ID);
+    if (task->attribute->input_length>POWERTASK_TIMED_INPUT_MAX)
+        powertask_fatal("Task input too big for POWERTASK_TIMED_INPUT_MAX",ID);
+
+    if (timed_free_count<0)
+    { // first use: every slot is free
+        for (timed_free_count=0;timed_free_count<POWERTASK_TIMED_MAX;timed_free_count++)
+            timed_free[timed_free_count]=POWERTASK_TIMED_MAX-1-timed_free_count;
+    }
+    if (timed_free_count==0) powertask_fatal("Time-tagged command queue full (POWERTASK_TIMED_MAX)",ID);
+
+    DEBUGF(3,("powertask_make_runnable_at %04x (%s) at time %llu\n",
+        (int)ID,task->attribute->name,(unsigned long long)when));
+
+    uint16_t slot=timed_free[--timed_free_count];
+    powertask_timed_slot_t *s=&timed_slots[slot];
+    s->header.ID=ID;
+    s->header.length=task->attribute->input_length;
+    memset(s->data,0,sizeof(s->data));
+
+    powertask_timed_key_t *key=&timed_heap[timed_count];
+    key->when=when;
+    key->order=timed_order++;
+    key->slot=slot;
+    timed_sift_up(timed_count++);
+
+    timed_stats.stored++;
+    if (timed_count>timed_stats.high_water) timed_stats.high_water=timed_count;
+
+    // Rely on caller to fill in telemetry data, just like powertask_make_runnable
+    return (powertask_telemetry_t *)s;
+}
+
+/// Make the task runnable with this slot's stored input, and free the slot.
+static void timed_start(powertask_task_t *task,uint16_t slot,powertask_time_t when)
+{
+    powertask_timed_slot_t *s=&timed_slots[slot];
+    if (task->periodic) powertask_periodic_release(task,when); // stores the next release
+    powertask_telemetry_t *input=powertask_make_runnable(s->header.ID);
+    memcpy(input->data,s->data,s->header.length);
+    if (task->prev)
+    { // queued, not delayed or dropped by hold-off or quarantine
+        task->scheduled=when;
+        task->timed=1;
+    }
+
+    timed_free[timed_free_count++]=slot;
+    timed_stats.released++;
+}
+
+void powertask_timed_release(powertask_time_t now)
+{
+    int released=0;
+    while (timed_count>0 && timed_heap[0].when<=now)
+    {
+        if (POWERTASK_TIMED_RELEASE_MAX && released++>=POWERTASK_TIMED_RELEASE_MAX) break;
+        powertask_timed_key_t key=timed_heap[0];
+        timed_heap[0]=timed_heap[--timed_count];
+        if (timed_count>0) timed_sift_down(0);
+
+        powertask_timed_slot_t *s=&timed_slots[key.slot];
+        DEBUGF(3,("  releasing time-tagged command for %04x, due %llu\n",
+            (int)s->header.ID,(unsigned long long)key.when));
+        powertask_task_t *task=powertask_task_lookup(s->header.ID);
+        if (task==0 || task->attribute->input_length!=s->header.length) {
+            DEBUGF(1,("  dropping time-tagged command for %s task %04x\n",
+                task?"re-registered":"unregistered",(int)s->header.ID));
+            timed_free[timed_free_count++]=key.slot;
+            timed_stats.dropped++;
+            continue;
+        }
+        if (task->timed_waiting || !timed_can_release(task))
+        { // it would replace the task's queued input: wait in line for the task
+            DEBUGF(3,("  task %04x has no room, command waits\n",(int)s->header.ID));
+            s->when=key.when;
+            s->next_waiting=0;
+            if (task->timed_waiting) timed_slots[task->timed_waiting_last-1].next_waiting=key.slot+1;
+            else task->timed_waiting=key.slot+1;
+            task->timed_waiting_last=key.slot+1;
+            timed_waiting_count++;
+            timed_stats.waited++;
+            continue;
+        }
+        timed_start(task,key.slot,key.when);
+    }
+}
+
+void powertask_timed_resume(powertask_task_t *task)
+{
+    while (task->timed_waiting && timed_can_release(task)) {
+        uint16_t slot=task->timed_waiting-1;
+        task->timed_waiting=timed_slots[slot].next_waiting;
+        timed_waiting_count--;
+        if (task->attribute->input_length!=timed_slots[slot].header.length)
+        { // its input changed size while it waited
+            DEBUGF(1,("  dropping time-tagged command for changed task %04x\n",(int)task->attribute->ID));
+            timed_free[timed_free_count++]=slot;
+            timed_stats.dropped++;
+            continue;
+        }
+        timed_start(task,slot,timed_slots[slot].when);
+    }
+}
+
+void powertask_timed_forget(powertask_task_t *task)
+{
+    while (task->timed_waiting) {
+        uint16_t slot=task->timed_waiting-1;
+        task->timed_waiting=timed_slots[slot].next_waiting;
+        timed_waiting_count--;
+        timed_free[timed_free_count++]=slot;
+    }
+}
+
+void powertask_timed_started(powertask_task_t *task,powertask_time_t now)
+{
+    if (!task->timed) return;
+    task->timed=0;
+
+    powertask_time_t jitter=0;
+    if (now>task->scheduled) jitter=now-task->scheduled;
+    DEBUGF(4,("  time-tagged start jitter %llu\n",(unsigned long long)jitter));
+
+    timed_stats.started++;
+    timed_stats.jitter_last=jitter;
+    timed_stats.jitter_total+=jitter;
+    if (jitter>timed_stats.jitter_max) timed_stats.jitter_max=jitter;
+}
+
+int powertask_timed_pending(void)
+{
+    return timed_count+timed_waiting_count;
+}
+
+const powertask_timed_stats_t *powertask_timed_stats(void)
+{
+    return &timed_stats;
+}
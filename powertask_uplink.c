@@ -0,0 +1,301 @@
+/**
+ Authenticated uplink: decodes uplink frames as their bytes arrive,
+ computing the frame's SipHash-2-4 MAC in the same loop that buffers
+ the bytes, then rejects forged or replayed frames before any of their
+ commands reach powertask_make_runnable.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <string.h>
+#include "powertask_internal.h"
+
+/********* SipHash-2-4, incremental *********/
+struct uplink_siphash_t {
+    uint64_t v0,v1,v2,v3;
+    uint64_t tail; // bytes not yet in a whole word
+    uint32_t length; // bytes hashed so far
+};
+typedef struct uplink_siphash_t uplink_siphash_t;
+
+#define SIP_ROTL(x,b) (((x)<<(b))|((x)>>(64-(b))))
+#define SIP_ROUND { \
+    v0+=v1; v1=SIP_ROTL(v1,13); v1^=v0; v0=SIP_ROTL(v0,32); \
+    v2+=v3; v3=SIP_ROTL(v3,16); v3^=v2; \
+    v0+=v3; v3=SIP_ROTL(v3,21); v3^=v0; \
+    v2+=v1; v1=SIP_ROTL(v1,17); v1^=v2; v2=SIP_ROTL(v2,32); }
+#define SIP_WORD(m) { uint64_t m_=(m); v3^=m_; SIP_ROUND SIP_ROUND v0^=m_; }
+
+/// Load 8 little-endian bytes.
+static uint64_t sip_load(const powertask_data_t *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1]<<8) | ((uint64_t)p[2]<<16) | ((uint64_t)p[3]<<24)
+        | ((uint64_t)p[4]<<32) | ((uint64_t)p[5]<<40) | ((uint64_t)p[6]<<48) | ((uint64_t)p[7]<<56);
+}
+
+static void sip_start(uplink_siphash_t *s,const uint8_t key[16])
+{
+    uint64_t k0=sip_load(key), k1=sip_load(key+8);
+    s->v0=k0^0x736f6d6570736575ull;
+    s->v1=k1^0x646f72616e646f6dull;
+    s->v2=k0^0x6c7967656e657261ull;
+    s->v3=k1^0x7465646279746573ull;
+    s->tail=0;
+    s->length=0;
+}
+
+/// Hash n bytes from src, and if dest isn't 0 copy them there in the same loop.
+///   The state lives in locals, since stores to dest could alias it.
+static void sip_absorb(uplink_siphash_t *s,powertask_data_t *dest,const powertask_data_t *src,uint32_t n)
+{
+    uint64_t v0=s->v0, v1=s->v1, v2=s->v2, v3=s->v3, tail=s->tail;
+    uint32_t length=s->length;
+    while (n>0 && (length&7)!=0)
+    { // finish a partial word
+        if (dest) *dest++=*src;
+        tail|=(uint64_t)*src++<<(8*(length&7));
+        length++; n--;
+        if ((length&7)==0) { SIP_WORD(tail); tail=0; }
+    }
+    for (;n>=8;n-=8,src+=8,length+=8)
+    { // whole words
+        if (dest) { memcpy(dest,src,8); dest+=8; }
+        SIP_WORD(sip_load(src));
+    }
+    while (n-->0)
+    { // start a partial word
+        if (dest) *dest++=*src;
+        tail|=(uint64_t)*src++<<(8*(length&7));
+        length++;
+    }
+    s->v0=v0; s->v1=v1; s->v2=v2; s->v3=v3; s->tail=tail;
+    s->length=length;
+}
+
+static uint64_t sip_finish(uplink_siphash_t *s)
+{
+    uint64_t v0=s->v0, v1=s->v1, v2=s->v2, v3=s->v3;
+    uint64_t b=((uint64_t)s->length<<56)|s->tail;
+    SIP_WORD(b);
+    v2^=0xff;
+    SIP_ROUND SIP_ROUND SIP_ROUND SIP_ROUND
+    return v0^v1^v2^v3;
+}
+
+uint64_t powertask_siphash(const uint8_t key[16],const void *data,uint32_t length)
+{
+    uplink_siphash_t s;
+    sip_start(&s,key);
+    sip_absorb(&s,0,(const powertask_data_t *)data,length);
+    return sip_finish(&s);
+}
+
+
+/********* Sequence number window *********/
+int powertask_window_accept(powertask_window_t *window,uint32_t sequence)
+{
+    int32_t ahead=(int32_t)(sequence-window->highest);
+    if (!window->started)
+    { // the first one sets the window, wherever the counter starts
+        window->started=1;
+        window->seen=1;
+        window->highest=sequence;
+        return 1;
+    }
+    if (ahead>0)
+    { // newest yet: slide the window up
+        window->seen=(ahead>=64)?0:(window->seen<<ahead);
+        window->seen|=1;
+        window->highest=sequence;
+        return 1;
+    }
+    uint32_t behind=-ahead;
+    if (behind>=64) return 0; // too old to tell
+    uint64_t bit=(uint64_t)1<<behind;
+    if (window->seen&bit) return 0; // seen it
+    window->seen|=bit;
+    return 1;
+}
+
+
+/********* Frame decoder *********/
+#define UPLINK_HEADER 6 /* length and sequence number */
+#define UPLINK_MAC 8
+
+/// Decoder states
+#define UPLINK_HUNT 0 /* looking for the sync word */
+#define UPLINK_BODY 1 /* hashing the header and commands */
+#define UPLINK_CHECK 2 /* collecting the MAC */
+
+static uint8_t uplink_key[16];
+static int uplink_keyed=0;
+static powertask_window_t uplink_window;
+static powertask_uplink_stats_t uplink_stats;
+
+static int uplink_state=UPLINK_HUNT;
+static uint16_t uplink_sync=0; // last two bytes seen while hunting
+static uplink_siphash_t uplink_hash;
+static powertask_data_t uplink_frame[UPLINK_HEADER+POWERTASK_UPLINK_FRAME_MAX];
+static uint32_t uplink_fill=0; // bytes of uplink_frame received
+static uint32_t uplink_end=0; // UPLINK_HEADER plus the command length, once known
+static powertask_data_t uplink_mac[UPLINK_MAC];
+static uint32_t uplink_mac_fill=0;
+
+/// Where each command's input starts in uplink_frame, and its length, found as bytes arrive.
+///   Tasks are looked up again when the frame is dispatched, since they may
+///   be unregistered or swapped between receive calls.
+static uint16_t uplink_inputs[POWERTASK_UPLINK_COMMANDS_MAX];
+static powertask_length_t uplink_lengths[POWERTASK_UPLINK_COMMANDS_MAX];
+static int uplink_command_count=0;
+static uint32_t uplink_next_command=0; // offset of the next command's ID
+static int uplink_bad=0; // 1 if this frame is malformed
+static int uplink_sequenced=0; // 1 if commands carry sequence numbers
+
+void powertask_uplink_set_key(const uint8_t key[16])
+{
+    memcpy(uplink_key,key,16);
+    uplink_keyed=1;
+}
+
+const powertask_uplink_stats_t *powertask_uplink_stats(void)
+{
+    return &uplink_stats;
+}
+
+/// Find the commands that have fully arrived, checking each task ID.
+static void uplink_parse(void)
+{
+    while (!uplink_bad && uplink_next_command+2<=uplink_fill && uplink_next_command<uplink_end) {
+        powertask_data_t *p=&uplink_frame[uplink_next_command];
+        powertask_task_t *task=powertask_task_lookup((p[0]<<8)|p[1]);
+        if (task==0 || uplink_command_count>=POWERTASK_UPLINK_COMMANDS_MAX) {
+            DEBUGF(1,("  uplink frame has unknown task %04x or too many commands\n",(p[0]<<8)|p[1]));
+            uplink_bad=1;
+            break;
+        }
+        uint32_t header=uplink_sequenced?6:2; // ID, and maybe sequence number
+        uplink_lengths[uplink_command_count]=task->attribute->input_length;
+        uplink_inputs[uplink_command_count++]=uplink_next_command+header;
+        uplink_next_command+=header+task->attribute->input_length;
+    }
+}
+
+/// The whole frame is here: check it, and dispatch its commands.
+static int uplink_finish(void)
+{
+    uint64_t mac=0;
+    int i;
+    for (i=0;i<UPLINK_MAC;i++) mac=(mac<<8)|uplink_mac[i];
+    if (!uplink_keyed || mac!=sip_finish(&uplink_hash)) {
+        DEBUGF(1,("  uplink frame fails its MAC check\n"));
+        uplink_stats.bad_mac++;
+        return 0;
+    }
+    if (uplink_bad || uplink_next_command!=uplink_end) {
+        uplink_stats.malformed++;
+        return 0;
+    }
+    uint32_t header=uplink_sequenced?6:2;
+    for (i=0;i<uplink_command_count;i++)
+    { // the frame was split up using these tasks' input lengths: they must still hold
+        const powertask_data_t *id=&uplink_frame[uplink_inputs[i]-header];
+        powertask_task_t *task=powertask_task_lookup((id[0]<<8)|id[1]);
+        if (task==0 || task->attribute->input_length!=uplink_lengths[i]) {
+            DEBUGF(1,("  uplink task %04x was unregistered or changed mid-frame\n",(id[0]<<8)|id[1]));
+            uplink_stats.malformed++;
+            return 0;
+        }
+    }
+    const powertask_data_t *h=uplink_frame;
+    uint32_t sequence=((uint32_t)h[2]<<24)|((uint32_t)h[3]<<16)|(h[4]<<8)|h[5];
+    if (!powertask_window_accept(&uplink_window,sequence)) {
+        DEBUGF(1,("  uplink frame %u is a replay\n",(unsigned int)sequence));
+        uplink_stats.replayed++;
+        return 0;
+    }
+
+    DEBUGF(3,("uplink frame %u: %d commands\n",(unsigned int)sequence,uplink_command_count));
+    int dispatched=0;
+    for (i=0;i<uplink_command_count;i++) {
+        const powertask_data_t *c=&uplink_frame[uplink_inputs[i]];
+        const powertask_data_t *id=c-header;
+        powertask_task_t *task=powertask_task_lookup((id[0]<<8)|id[1]);
+        powertask_telemetry_t *input;
+        if (uplink_sequenced) {
+            const powertask_data_t *q=c-4;
+            input=powertask_task_make_runnable_sequenced(task,
+                ((uint32_t)q[0]<<24)|((uint32_t)q[1]<<16)|(q[2]<<8)|q[3]);
+            if (input==0) continue; // duplicate
+        }
+        else input=powertask_task_make_runnable(task);
+        memcpy(input->data,c,uplink_lengths[i]);
+        dispatched++;
+    }
+    uplink_stats.frames++;
+    uplink_stats.commands+=dispatched;
+    return dispatched;
+}
+
+int powertask_uplink_receive(const void *bytes,uint32_t length)
+{
+    const powertask_data_t *p=(const powertask_data_t *)bytes;
+    int dispatched=0;
+    while (length>0) {
+        if (uplink_state==UPLINK_HUNT)
+        {
+            uplink_sync=(uplink_sync<<8)|*p++;
+            length--;
+            if (uplink_sync!=POWERTASK_UPLINK_SYNC && uplink_sync!=POWERTASK_UPLINK_SYNC_SEQUENCED) {
+                uplink_stats.skipped++;
+                continue;
+            }
+            uplink_state=UPLINK_BODY;
+            uplink_stats.skipped--; // the first sync byte was counted, but wasn't skipped
+            sip_start(&uplink_hash,uplink_key);
+            uplink_sequenced=(uplink_sync==POWERTASK_UPLINK_SYNC_SEQUENCED);
+            if (uplink_sequenced)
+            { // authenticate the frame type too
+                powertask_data_t sync[2]={POWERTASK_UPLINK_SYNC_SEQUENCED>>8,POWERTASK_UPLINK_SYNC_SEQUENCED&0xFF};
+                sip_absorb(&uplink_hash,0,sync,2);
+            }
+            uplink_sync=0;
+            uplink_fill=0;
+            uplink_end=UPLINK_HEADER; // until the length arrives
+            uplink_command_count=0;
+            uplink_next_command=UPLINK_HEADER;
+            uplink_bad=0;
+        }
+        else if (uplink_state==UPLINK_BODY)
+        {
+            uint32_t n=uplink_end-uplink_fill;
+            if (n>length) n=length;
+            sip_absorb(&uplink_hash,&uplink_frame[uplink_fill],p,n);
+            uplink_fill+=n; p+=n; length-=n;
+            if (uplink_fill==UPLINK_HEADER && uplink_end==UPLINK_HEADER)
+            { // the header is here: now we know the length
+                uint32_t commands=(uplink_frame[0]<<8)|uplink_frame[1];
+                if (commands>POWERTASK_UPLINK_FRAME_MAX) {
+                    DEBUGF(1,("  uplink frame too long: %d bytes\n",(int)commands));
+                    uplink_stats.malformed++;
+                    uplink_state=UPLINK_HUNT;
+                    continue;
+                }
+                uplink_end=UPLINK_HEADER+commands;
+            }
+            uplink_parse();
+            if (uplink_fill==uplink_end) {
+                uplink_state=UPLINK_CHECK;
+                uplink_mac_fill=0;
+            }
+        }
+        else
+        {
+            uplink_mac[uplink_mac_fill++]=*p++;
+            length--;
+            if (uplink_mac_fill==UPLINK_MAC) {
+                dispatched+=uplink_finish();
+                uplink_state=UPLINK_HUNT;
+            }
+        }
+    }
+    return dispatched;
+}
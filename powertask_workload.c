@@ -0,0 +1,452 @@
+/**
+ Synthetic workload generator: builds task populations from a config,
+ with one shared synthetic task function, and delivers their uplink
+ commands by a chosen arrival process.  See powertask_workload.h.
+
+ CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "powertask_workload.h"
+
+/// One generated task.
+struct workload_task_t {
+    powertask_attribute_t attribute;
+    char name[8];
+    struct powertask_workload_t *workload;
+    uint32_t work_ns; // CPU time to burn per run
+    uint8_t retry, fail; // percent chance of each outcome per run
+    int first_edge, edges; // successors are edge[first_edge .. first_edge+edges)
+    int predecessors; // tasks that make this one runnable
+    powertask_time_t next_arrival; // PERIODIC roots: time of the next command
+};
+
+struct powertask_workload_t {
+    powertask_workload_config_t config;
+    int count;
+    struct workload_task_t *task;
+    int *edge; // successor task indexes
+    int *root; // indexes of tasks commanded from uplink
+    int roots;
+    uint64_t random; // state of the random number generator
+    int started; // 1 once arrival times have been set from the first "now"
+    powertask_time_t period; // PERIODIC: microseconds between one root's commands
+    powertask_time_t next_arrival; // POISSON and BURSTY: time of the next command or burst
+    powertask_workload_stats_t stats;
+};
+
+/// Registered generated tasks, by ID, for the shared task function.
+static struct workload_task_t *workload_by_ID[0x10000];
+
+/// Return 64 random bits (xorshift64*).
+static uint64_t workload_random(powertask_workload_t *w)
+{
+    uint64_t x=w->random;
+    x^=x>>12; x^=x<<25; x^=x>>27;
+    w->random=x;
+    return x*0x2545F4914F6CDD1Dull;
+}
+
+/// Return a random number in [0,1).
+static double workload_uniform(powertask_workload_t *w)
+{
+    return (workload_random(w)>>11)*(1.0/9007199254740992.0);
+}
+
+/// Return a random time until the next event of a process with this rate per second.
+static powertask_time_t workload_interval(powertask_workload_t *w,double rate)
+{
+    return (powertask_time_t)(-log(1.0-workload_uniform(w))*1.0e6/rate);
+}
+
+static uint32_t workload_draw(powertask_workload_t *w,const powertask_workload_dist_t *d)
+{
+    if (d->shape==POWERTASK_DIST_UNIFORM && d->high>d->low)
+        return d->low+(uint32_t)(workload_random(w)%((uint64_t)d->high-d->low+1));
+    if (d->shape==POWERTASK_DIST_EXPONENTIAL) {
+        double v=-log(1.0-workload_uniform(w))*d->low;
+        return v>d->high?d->high:(uint32_t)v;
+    }
+    return d->low;
+}
+
+
+/********* Calibrated CPU burn ***********/
+static double workload_loops_per_ns=0;
+static uint32_t workload_sink;
+
+/// Spin this many loop iterations.
+static void workload_spin(uint64_t loops)
+{
+    uint32_t x=workload_sink;
+    while (loops--) x=x*1103515245u+12345u;
+    workload_sink=x;
+}
+
+static double workload_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+1.0e-9*ts.tv_nsec;
+}
+
+/// Measure the burn loop's speed: the fastest of a few tries.
+static void workload_calibrate(void)
+{
+    int i;
+    for (i=0;i<5;i++) {
+        double start=workload_seconds();
+        workload_spin(1<<20);
+        double rate=(1<<20)/((workload_seconds()-start)*1.0e9);
+        if (rate>workload_loops_per_ns) workload_loops_per_ns=rate;
+    }
+}
+
+
+/********* The synthetic task ***********/
+/// Command this task: make it runnable with its ID and a fill pattern as input.
+static void workload_command(struct workload_task_t *t)
+{
+    powertask_telemetry_t *input=powertask_make_runnable(t->attribute.ID);
+    if (input==0) return;
+    input->data[0]=t->attribute.ID>>8;
+    input->data[1]=t->attribute.ID&0xFF;
+    memset(input->data+POWERTASK_WORKLOAD_INPUT_MIN,t->attribute.ID&0xFF,
+        t->attribute.input_length-POWERTASK_WORKLOAD_INPUT_MIN);
+}
+
+static powertask_result_t workload_task(const powertask_telemetry_t *input,
+    powertask_telemetry_t *output)
+{
+    struct workload_task_t *t=workload_by_ID[(input->data[0]<<8)|input->data[1]];
+    if (t==0) return POWERTASK_RESULT_FAIL_QUIET+1; // not a workload command
+    powertask_workload_t *w=t->workload;
+    w->stats.runs++;
+    w->stats.work_ns+=t->work_ns;
+    workload_spin((uint64_t)(t->work_ns*workload_loops_per_ns));
+
+    // Spend our energy, and write our output from our input
+    powertask_energy_t battery=powertask_get_battery(), energy=t->attribute.energy_per_run;
+    powertask_set_battery(battery>energy?battery-energy:0);
+    powertask_length_t i, in=t->attribute.input_length;
+    for (i=0;i<t->attribute.output_length;i++) output->data[i]=input->data[i%in];
+
+    uint32_t roll=workload_random(w)%100;
+    if (roll<t->retry) {
+        w->stats.retries++;
+        return POWERTASK_RESULT_RETRY;
+    }
+    if (roll<(uint32_t)t->retry+t->fail) {
+        w->stats.failures++;
+        return POWERTASK_RESULT_FAIL_QUIET+1;
+    }
+    int e;
+    for (e=0;e<t->edges;e++) {
+        workload_command(&w->task[w->edge[t->first_edge+e]]);
+        w->stats.triggered++;
+    }
+    return POWERTASK_RESULT_OK;
+}
+
+
+/********* Configs ***********/
+void powertask_workload_defaults(powertask_workload_config_t *config)
+{
+    memset(config,0,sizeof(*config));
+    config->seed=1;
+    config->tasks=16;
+    config->ids=POWERTASK_WORKLOAD_IDS_SEQUENTIAL;
+    config->first_ID=0x2000;
+    config->groups=1;
+    config->energy.low=5;
+    config->input.low=POWERTASK_WORKLOAD_INPUT_MIN;
+    config->output.low=8;
+    config->work.low=1000;
+    config->shape=POWERTASK_WORKLOAD_INDEPENDENT;
+    config->chain_length=4;
+    config->fanout=2;
+    config->arrivals=POWERTASK_WORKLOAD_POISSON;
+    config->rate=100;
+    config->burst=8;
+}
+
+/// Parse a distribution: "5", "uniform:1:20", or "exp:5:100".
+static int workload_parse_dist(powertask_workload_dist_t *d,const char *v)
+{
+    char *end;
+    if (strncmp(v,"uniform:",8)==0) { d->shape=POWERTASK_DIST_UNIFORM; v+=8; }
+    else if (strncmp(v,"exp:",4)==0) { d->shape=POWERTASK_DIST_EXPONENTIAL; v+=4; }
+    else {
+        d->shape=POWERTASK_DIST_CONSTANT;
+        d->low=d->high=strtoul(v,&end,0);
+        return end!=v && *end==0;
+    }
+    d->low=strtoul(v,&end,0);
+    if (end==v || *end!=':') return 0;
+    v=end+1;
+    d->high=strtoul(v,&end,0);
+    return end!=v && *end==0 && d->high>=d->low;
+}
+
+/// Parse a whole number into *n.
+static int workload_parse_int(int *n,const char *v,int base)
+{
+    char *end;
+    long l=strtol(v,&end,base);
+    *n=(int)l;
+    return end!=v && *end==0 && l>=0 && l<=0x7FFFFFFF;
+}
+
+/// Apply one key=value pair.  Returns 0 if it's invalid.
+static int workload_parse_pair(powertask_workload_config_t *c,const char *key,const char *v)
+{
+    int n=0, ok;
+    if (strcmp(key,"seed")==0) { ok=workload_parse_int(&n,v,0); c->seed=n; return ok; }
+    if (strcmp(key,"tasks")==0) return workload_parse_int(&c->tasks,v,0);
+    if (strcmp(key,"first_id")==0) { ok=workload_parse_int(&n,v,16); c->first_ID=n; return ok && n<0x10000; }
+    if (strcmp(key,"groups")==0) { ok=workload_parse_int(&n,v,0); c->groups=n; return ok && n<256; }
+    if (strcmp(key,"chain")==0) return workload_parse_int(&c->chain_length,v,0);
+    if (strcmp(key,"fanout")==0) return workload_parse_int(&c->fanout,v,0);
+    if (strcmp(key,"burst")==0) return workload_parse_int(&c->burst,v,0);
+    if (strcmp(key,"energy")==0) return workload_parse_dist(&c->energy,v);
+    if (strcmp(key,"battery")==0) return workload_parse_dist(&c->battery,v);
+    if (strcmp(key,"input")==0) return workload_parse_dist(&c->input,v);
+    if (strcmp(key,"output")==0) return workload_parse_dist(&c->output,v);
+    if (strcmp(key,"work")==0) return workload_parse_dist(&c->work,v);
+    if (strcmp(key,"retry")==0) return workload_parse_dist(&c->retry,v);
+    if (strcmp(key,"fail")==0) return workload_parse_dist(&c->fail,v);
+    if (strcmp(key,"rate")==0) {
+        char *end;
+        c->rate=strtod(v,&end);
+        return end!=v && *end==0;
+    }
+    if (strcmp(key,"ids")==0) {
+        if (strcmp(v,"sequential")==0) c->ids=POWERTASK_WORKLOAD_IDS_SEQUENTIAL;
+        else if (strcmp(v,"random")==0) c->ids=POWERTASK_WORKLOAD_IDS_RANDOM;
+        else return 0;
+        return 1;
+    }
+    if (strcmp(key,"shape")==0) {
+        if (strcmp(v,"independent")==0) c->shape=POWERTASK_WORKLOAD_INDEPENDENT;
+        else if (strcmp(v,"chains")==0) c->shape=POWERTASK_WORKLOAD_CHAINS;
+        else if (strcmp(v,"dag")==0) c->shape=POWERTASK_WORKLOAD_DAG;
+        else return 0;
+        return 1;
+    }
+    if (strcmp(key,"arrivals")==0) {
+        if (strcmp(v,"periodic")==0) c->arrivals=POWERTASK_WORKLOAD_PERIODIC;
+        else if (strcmp(v,"poisson")==0) c->arrivals=POWERTASK_WORKLOAD_POISSON;
+        else if (strcmp(v,"bursty")==0) c->arrivals=POWERTASK_WORKLOAD_BURSTY;
+        else return 0;
+        return 1;
+    }
+    return 0;
+}
+
+int powertask_workload_parse(powertask_workload_config_t *config,const char *text)
+{
+    powertask_workload_config_t c=*config;
+    char word[128];
+    while (*text) {
+        int n=0;
+        while (*text==' ' || *text=='\t' || *text=='\n') text++;
+        while (*text && *text!=' ' && *text!='\t' && *text!='\n') {
+            if (n+1>=(int)sizeof(word)) return 0;
+            word[n++]=*text++;
+        }
+        if (n==0) break;
+        word[n]=0;
+        char *equals=strchr(word,'=');
+        if (equals==0) return 0;
+        *equals=0;
+        if (!workload_parse_pair(&c,word,equals+1)) {
+            fprintf(stderr,"powertask_workload: bad setting %s=%s\n",word,equals+1);
+            return 0;
+        }
+    }
+    *config=c;
+    return 1;
+}
+
+
+/********* Generation ***********/
+/// Pick the task IDs.  Returns 0 if there aren't enough.
+static int workload_pick_IDs(powertask_workload_t *w)
+{
+    const powertask_workload_config_t *c=&w->config;
+    int i;
+    if (c->ids==POWERTASK_WORKLOAD_IDS_SEQUENTIAL) {
+        if (c->first_ID<0x1000 || c->first_ID+c->tasks>0xF000) return 0;
+        for (i=0;i<w->count;i++) w->task[i].attribute.ID=c->first_ID+i;
+        return 1;
+    }
+    static unsigned char used[0x10000];
+    memset(used,0,sizeof(used));
+    int free_IDs=0, ID;
+    for (ID=0x1000;ID<0xF000;ID++)
+        if (powertask_task_lookup(ID)==0) free_IDs++;
+        else used[ID]=1;
+    if (w->count>free_IDs) return 0;
+    for (i=0;i<w->count;i++) {
+        do ID=0x1000+workload_random(w)%(0xF000-0x1000); while (used[ID]);
+        used[ID]=1;
+        w->task[i].attribute.ID=ID;
+    }
+    return 1;
+}
+
+/// Link successors: chains, or a DAG whose edges all point to later tasks.
+static void workload_link(powertask_workload_t *w)
+{
+    const powertask_workload_config_t *c=&w->config;
+    int i, e=0;
+    for (i=0;i<w->count;i++) {
+        struct workload_task_t *t=&w->task[i];
+        t->first_edge=e;
+        if (c->shape==POWERTASK_WORKLOAD_CHAINS) {
+            if ((i+1)%c->chain_length!=0 && i+1<w->count) w->edge[e++]=i+1;
+        }
+        else if (c->shape==POWERTASK_WORKLOAD_DAG && i+1<w->count) {
+            int k, want=workload_random(w)%(c->fanout+1);
+            for (k=0;k<want;k++) {
+                int to=i+1+workload_random(w)%(w->count-i-1), d, seen=0;
+                for (d=t->first_edge;d<e;d++) if (w->edge[d]==to) seen=1;
+                if (!seen) w->edge[e++]=to;
+            }
+        }
+        t->edges=e-t->first_edge;
+    }
+    for (e=0;e<w->count;e++)
+        for (i=0;i<w->task[e].edges;i++) w->task[w->edge[w->task[e].first_edge+i]].predecessors++;
+    w->roots=0;
+    for (i=0;i<w->count;i++)
+        if (w->task[i].predecessors==0) w->root[w->roots++]=i;
+}
+
+powertask_workload_t *powertask_workload_generate(const powertask_workload_config_t *config)
+{
+    const powertask_workload_config_t *c=config;
+    if (c->tasks<1 || c->tasks>0xE000 || c->groups<1 || c->groups>POWERTASK_GROUP_MAX
+      || c->chain_length<1 || c->fanout<0 || c->rate<=0 || c->burst<1
+      || c->input.high>0xFFFF || c->output.high>0xFFFF)
+        return 0;
+    if (workload_loops_per_ns==0) workload_calibrate();
+
+    powertask_workload_t *w=(powertask_workload_t *)calloc(1,sizeof(powertask_workload_t));
+    w->config=*c;
+    w->count=c->tasks;
+    w->task=(struct workload_task_t *)calloc(w->count,sizeof(struct workload_task_t));
+    w->edge=(int *)calloc((size_t)w->count*(c->fanout+1),sizeof(int));
+    w->root=(int *)calloc(w->count,sizeof(int));
+    w->random=0x9E3779B97F4A7C15ull*(c->seed+1);
+    if (!workload_pick_IDs(w)) {
+        powertask_workload_free(w);
+        return 0;
+    }
+
+    int i;
+    for (i=0;i<w->count;i++) {
+        struct workload_task_t *t=&w->task[i];
+        powertask_attribute_t *a=&t->attribute;
+        snprintf(t->name,sizeof(t->name),"W%04X",(unsigned int)a->ID);
+        a->name=t->name;
+        a->function=workload_task;
+        a->minimum_battery=workload_draw(w,&c->battery);
+        a->energy_per_run=workload_draw(w,&c->energy);
+        a->input_length=workload_draw(w,&c->input);
+        if (a->input_length<POWERTASK_WORKLOAD_INPUT_MIN) a->input_length=POWERTASK_WORKLOAD_INPUT_MIN;
+        a->output_length=workload_draw(w,&c->output);
+        a->group=i%c->groups;
+        t->workload=w;
+        t->work_ns=workload_draw(w,&c->work);
+        uint32_t retry=workload_draw(w,&c->retry), fail=workload_draw(w,&c->fail);
+        t->retry=retry>100?100:retry;
+        t->fail=fail>100u-t->retry?100-t->retry:fail;
+    }
+    workload_link(w);
+    return w;
+}
+
+int powertask_workload_count(const powertask_workload_t *w)
+{
+    return w->count;
+}
+
+const powertask_attribute_t *powertask_workload_attribute(const powertask_workload_t *w,int i)
+{
+    return &w->task[i].attribute;
+}
+
+void powertask_workload_register(powertask_workload_t *w)
+{
+    int i;
+    for (i=0;i<w->count;i++) {
+        workload_by_ID[w->task[i].attribute.ID]=&w->task[i];
+        powertask_register(&w->task[i].attribute);
+    }
+}
+
+void powertask_workload_unregister(powertask_workload_t *w)
+{
+    int i;
+    for (i=0;i<w->count;i++) {
+        powertask_unregister(w->task[i].attribute.ID);
+        workload_by_ID[w->task[i].attribute.ID]=0;
+    }
+}
+
+
+/********* Arrivals ***********/
+int powertask_workload_arrive(powertask_workload_t *w,powertask_time_t now)
+{
+    const powertask_workload_config_t *c=&w->config;
+    int i, count=0;
+    if (w->roots==0) return 0;
+    if (!w->started)
+    { // first call: arrivals start now
+        w->started=1;
+        w->period=(powertask_time_t)(1.0e6/c->rate);
+        if (w->period<1) w->period=1;
+        for (i=0;i<w->roots;i++)
+            w->task[w->root[i]].next_arrival=now+workload_random(w)%w->period;
+        w->next_arrival=now+workload_interval(w,c->arrivals==POWERTASK_WORKLOAD_BURSTY?c->rate/c->burst:c->rate);
+    }
+
+    if (c->arrivals==POWERTASK_WORKLOAD_PERIODIC) {
+        for (i=0;i<w->roots;i++) {
+            struct workload_task_t *t=&w->task[w->root[i]];
+            while (t->next_arrival<=now) {
+                workload_command(t);
+                t->next_arrival+=w->period;
+                count++;
+            }
+        }
+    }
+    else {
+        int per=c->arrivals==POWERTASK_WORKLOAD_BURSTY?c->burst:1;
+        while (w->next_arrival<=now) {
+            for (i=0;i<per;i++) workload_command(&w->task[w->root[workload_random(w)%w->roots]]);
+            count+=per;
+            w->next_arrival+=workload_interval(w,c->rate/per);
+        }
+    }
+    w->stats.arrivals+=count;
+    return count;
+}
+
+const powertask_workload_stats_t *powertask_workload_stats(const powertask_workload_t *w)
+{
+    return &w->stats;
+}
+
+void powertask_workload_free(powertask_workload_t *w)
+{
+    if (w==0) return;
+    free(w->task);
+    free(w->edge);
+    free(w->root);
+    free(w);
+}
@@ -0,0 +1,123 @@
+/*
+  Synthetic workloads for benchmarking and simulating the powertask scheduler.
+
+  A workload is a generated population of tasks, described by a config:
+  how many, their IDs, energy, telemetry sizes, CPU time per run, how
+  often they RETRY or fail, how they trigger each other (chains or a DAG),
+  and how commands for them arrive from uplink.  Every generated task runs
+  the same synthetic function, which burns calibrated CPU time, spends its
+  energy from the battery, and makes its successors runnable when it succeeds.
+
+  This is hosted-only tooling, not part of the flight scheduler.
+
+  CJ Emerson and Orion Lawlor, 2021-01, public domain
+*/
+#ifndef __UAF_POWERTASK_WORKLOAD_H
+#define __UAF_POWERTASK_WORKLOAD_H
+
+#include "powertask.h"
+
+/// A distribution of whole numbers: each generated task draws one value.
+struct powertask_workload_dist_t {
+    uint8_t shape; // POWERTASK_DIST_ shape
+    uint32_t low; // the constant, smallest value, or mean
+    uint32_t high; // the largest value (not used by CONSTANT)
+};
+typedef struct powertask_workload_dist_t powertask_workload_dist_t;
+
+#define POWERTASK_DIST_CONSTANT 0 /* always low */
+#define POWERTASK_DIST_UNIFORM 1 /* evenly spread from low to high */
+#define POWERTASK_DIST_EXPONENTIAL 2 /* mean low, capped at high: mostly small, a few big */
+
+/// How task IDs are picked.
+#define POWERTASK_WORKLOAD_IDS_SEQUENTIAL 0 /* first_ID, first_ID+1, ... in registration order */
+#define POWERTASK_WORKLOAD_IDS_RANDOM 1 /* distinct random IDs in the application range */
+
+/// How tasks trigger each other when they succeed.
+#define POWERTASK_WORKLOAD_INDEPENDENT 0 /* every task is commanded from uplink */
+#define POWERTASK_WORKLOAD_CHAINS 1 /* chains of chain_length tasks: each runs the next */
+#define POWERTASK_WORKLOAD_DAG 2 /* each task runs up to fanout later tasks; tasks nothing runs are commanded */
+
+/// How uplink commands for the commanded (root) tasks arrive.
+#define POWERTASK_WORKLOAD_PERIODIC 0 /* each root every 1/rate seconds, at a random phase */
+#define POWERTASK_WORKLOAD_POISSON 1 /* commands at random times, rate per second in all */
+#define POWERTASK_WORKLOAD_BURSTY 2 /* bursts of "burst" commands at random times, rate per second in all */
+
+/// Every generated task's input starts with its own task ID, big-endian, 
+///   so the shared synthetic function knows which task it is running.
+///   powertask_workload_arrive fills this in; other commands must too.
+#define POWERTASK_WORKLOAD_INPUT_MIN 2
+
+/// Everything that describes a workload.  Start from powertask_workload_defaults.
+struct powertask_workload_config_t {
+    uint32_t seed; // the same seed makes the same workload and arrivals
+    int tasks; // number of tasks
+    uint8_t ids; // POWERTASK_WORKLOAD_IDS_ pattern (RANDOM skips IDs already registered)
+    powertask_ID_t first_ID; // first ID for SEQUENTIAL
+    uint8_t groups; // tasks are spread evenly over groups 0 .. groups-1
+    powertask_workload_dist_t energy; // energy_per_run (Joules), spent by each run
+    powertask_workload_dist_t battery; // minimum_battery (Joules)
+    powertask_workload_dist_t input; // input_length, at least POWERTASK_WORKLOAD_INPUT_MIN
+    powertask_workload_dist_t output; // output_length
+    powertask_workload_dist_t work; // CPU time burned per run (nanoseconds)
+    powertask_workload_dist_t retry; // percent chance each run returns RETRY
+    powertask_workload_dist_t fail; // percent chance each run fails
+    uint8_t shape; // POWERTASK_WORKLOAD_ shape
+    int chain_length; // tasks per chain
+    int fanout; // most successors of a DAG task
+    uint8_t arrivals; // POWERTASK_WORKLOAD_ arrival process
+    double rate; // commands per second (per root for PERIODIC)
+    int burst; // commands per burst
+};
+typedef struct powertask_workload_config_t powertask_workload_config_t;
+
+/// Fill in a small, simple workload: 16 independent tasks, Poisson arrivals.
+void powertask_workload_defaults(powertask_workload_config_t *config);
+
+/// Change config settings from text of whitespace-separated key=value pairs:
+///   seed=, tasks=, ids=sequential|random, first_id= (hex), groups=,
+///   energy=, battery=, input=, output=, work=, retry=, fail=,
+///   shape=independent|chains|dag, chain=, fanout=,
+///   arrivals=periodic|poisson|bursty, rate=, burst=.
+///   Distributions are "5", "uniform:1:20", or "exp:5:100".
+/// Returns 1 on success, 0 (and changes nothing) if any pair is invalid.
+int powertask_workload_parse(powertask_workload_config_t *config,const char *text);
+
+/// Counts of what a workload's tasks did.
+struct powertask_workload_stats_t {
+    uint32_t arrivals; // uplink commands delivered
+    uint32_t runs; // synthetic function calls
+    uint32_t retries; // runs that returned RETRY
+    uint32_t failures; // runs that failed
+    uint32_t triggered; // successors made runnable by a finished task
+    uint64_t work_ns; // CPU time the runs were asked to burn
+};
+typedef struct powertask_workload_stats_t powertask_workload_stats_t;
+
+/// A generated workload.
+struct powertask_workload_t;
+typedef struct powertask_workload_t powertask_workload_t;
+
+/// Generate a workload from this config.  Returns 0 if the config is invalid.
+///   The first call calibrates the CPU burn loop, which takes a few milliseconds.
+powertask_workload_t *powertask_workload_generate(const powertask_workload_config_t *config);
+
+/// Return the number of tasks, and the attributes of task i (0 .. count-1).
+int powertask_workload_count(const powertask_workload_t *w);
+const powertask_attribute_t *powertask_workload_attribute(const powertask_workload_t *w,int i);
+
+/// Register or unregister every task of the workload.
+void powertask_workload_register(powertask_workload_t *w);
+void powertask_workload_unregister(powertask_workload_t *w);
+
+/// Deliver the uplink commands that have arrived by time "now" (microseconds).
+///   Call this before each powertask_run_next.  Returns the commands delivered.
+int powertask_workload_arrive(powertask_workload_t *w,powertask_time_t now);
+
+/// Return what the workload's tasks have done.
+const powertask_workload_stats_t *powertask_workload_stats(const powertask_workload_t *w);
+
+/// Free the workload.  Unregister it first.
+void powertask_workload_free(powertask_workload_t *w);
+
+#endif